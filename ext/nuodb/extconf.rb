@@ -139,6 +139,10 @@ if have_header('stdint.h') then
   $CPPFLAGS << " -DHAVE_STDINT_H"
 end
 
+# Blocking client calls release the GVL where the interpreter supports it.
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl2', 'ruby/thread.h')
+
 if CONFIG['warnflags']
   CONFIG['warnflags'].slice!(/-Wdeclaration-after-statement/)
   CONFIG['warnflags'].slice!(/-Wimplicit-function-declaration/)
@@ -170,4 +174,19 @@ add_define 'HAVE_GCC_ATOMIC_BUILTINS' if try_link(<<SRC)
   __sync_fetch_and_sub(&atomic_var, 1);
 SRC
 
+# Character values are validated with AVX2 where the processor supports it,
+# detected at load time, so the extension still runs on processors without.
+add_define 'HAVE_GCC_TARGET_AVX2' if try_link(<<SRC)
+  #include <immintrin.h>
+  __attribute__((target("avx2")))
+  int movemask(const char * bytes) {
+    return _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) bytes));
+  }
+  int main() {
+    char bytes[32] = {0};
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? movemask(bytes) : 0;
+  }
+SRC
+
 create_makefile('nuodb/nuodb')
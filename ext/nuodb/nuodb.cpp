@@ -31,12 +31,32 @@
  */
 
 #include <ruby.h>
+#include <ruby/encoding.h>
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+#if defined(__SSE2__) || defined(HAVE_GCC_TARGET_AVX2)
+#include <immintrin.h>
+#endif
 #include "atomic.h"
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
 #include <time.h>
+#include <unistd.h>
+#include <math.h>
 #include <stdio.h>
+#include <strings.h>
 #include <typeinfo>
 #include <stdarg.h>
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
 
 #define HAVE_CXA_DEMANGLE
 
@@ -96,6 +116,7 @@ static VALUE m_nuodb;
 // C O N S T A N T S
 
 static VALUE c_nuodb_error;
+static VALUE c_nuodb_pool_timeout_error;
 
 // ----------------------------------------------------------------------------
 // C L A S S E S
@@ -104,17 +125,101 @@ static VALUE nuodb_connection_klass;
 static VALUE nuodb_statement_klass;
 static VALUE nuodb_prepared_statement_klass;
 static VALUE nuodb_result_klass;
+static VALUE nuodb_pool_klass;
+static VALUE nuodb_router_klass;
 
 // ----------------------------------------------------------------------------
 // S Y M B O L S
 
-static VALUE sym_database, sym_username, sym_password, sym_schema, sym_timezone;
+static VALUE sym_database, sym_username, sym_password, sym_schema, sym_timezone, sym_timeout;
+static VALUE sym_fetch_size, sym_statement_cache_size, sym_lazy;
+static VALUE sym_reconnect, sym_reconnect_attempts, sym_reconnect_delay, sym_reconnect_max_delay;
+static VALUE sym_min_size, sym_max_size, sym_checkout_timeout, sym_idle_timeout, sym_validate;
+static VALUE sym_databases, sym_balance, sym_round_robin, sym_least_outstanding, sym_latency_weighted;
+static VALUE sym_order_by, sym_descending, sym_limit;
+static VALUE sym_batch_size;
+static VALUE sym_decimal, sym_bigdecimal, sym_rational, sym_string, sym_encoding;
+
+// ----------------------------------------------------------------------------
+// R E G I S T R Y
+
+/*
+ * Method ids and classes used on the per-value decode and bind paths. Ids are
+ * interned once in Init_nuodb; classes living in libraries the extension does
+ * not load itself are required and resolved on first use, then kept pinned.
+ */
+static ID id_jd, id_tv_sec, id_tv_usec, id_to_time, id_write, id_close, id_open, id_cmp, id_mult;
+static ID id_date, id_bigdecimal, id_column, id_column_vector, id_routed_statement;
+
+static VALUE c_date = Qnil;
+static VALUE c_bigdecimal = Qnil;
+static VALUE c_column = Qnil;
+static VALUE c_column_vector = Qnil;
+static VALUE c_routed_statement = Qnil;
+// 10 ** -scale as BigDecimal, per scale up to 18, see nuodb_bigdecimal_unit
+static VALUE c_bigdecimal_units[19];
+
+static VALUE
+nuodb_registry_class(VALUE * klass, VALUE outer, char const * feature, ID name)
+{
+    if (NIL_P(*klass))
+    {
+        rb_require(feature);
+        *klass = rb_const_get(outer, name);
+    }
+    return *klass;
+}
+
+static void
+nuodb_define_registry()
+{
+    id_jd = rb_intern("jd");
+    id_tv_sec = rb_intern("tv_sec");
+    id_tv_usec = rb_intern("tv_usec");
+    id_to_time = rb_intern("to_time");
+    id_write = rb_intern("write");
+    id_close = rb_intern("close");
+    id_open = rb_intern("open");
+    id_cmp = rb_intern("<=>");
+    id_mult = rb_intern("*");
+
+    id_date = rb_intern("Date");
+    id_bigdecimal = rb_intern("BigDecimal");
+    id_column = rb_intern("Column");
+    id_column_vector = rb_intern("ColumnVector");
+    id_routed_statement = rb_intern("RoutedStatement");
+
+    rb_gc_register_address(&c_date);
+    rb_gc_register_address(&c_bigdecimal);
+    rb_gc_register_address(&c_column);
+    rb_gc_register_address(&c_column_vector);
+    rb_gc_register_address(&c_routed_statement);
+    for (int scale = 0; scale < 19; ++scale)
+    {
+        c_bigdecimal_units[scale] = Qnil;
+        rb_gc_register_address(&c_bigdecimal_units[scale]);
+    }
+}
 
 // ----------------------------------------------------------------------------
 // B E H A V I O R S
 
 static const bool ENABLE_CLOSE_HOOK = true;
 
+// ----------------------------------------------------------------------------
+// P R O C E S S
+
+/*
+ * The id of the current process, refreshed in forked children so that handles
+ * inherited across fork are told apart with a compare rather than a syscall.
+ */
+static pid_t nuodb_current_pid;
+
+static void nuodb_atfork_child()
+{
+    nuodb_current_pid = getpid();
+}
+
 // ----------------------------------------------------------------------------
 // L O G G I N G   A N D   T R A C I N G
 
@@ -319,6 +424,116 @@ struct nuodb_handle
     rb_atomic_t atomic;
     nuodb_handle * parent_handle;
     VALUE parent;
+    // the process owning the NuoDB session the handle belongs to
+    pid_t pid;
+};
+
+/*
+ * The schema cache holds the column definitions of tables, keyed by schema
+ * and table name, so that repeated metadata lookups for the same table do not
+ * round trip to the database. Defaults are Ruby values and are marked by the
+ * owning connection.
+ */
+struct nuodb_column_definition
+{
+    std::string name;
+    NuoDB::SqlType type;
+    int precision;
+    int scale;
+    bool nullable;
+    VALUE default_value;
+};
+
+struct nuodb_table_definition
+{
+    std::vector<nuodb_column_definition> columns;
+};
+
+typedef std::pair<std::string, std::string> nuodb_table_key;
+
+/*
+ * The columns of recent result shapes, see Result#columns, in least recently
+ * used order, most recent first; bounded as ad hoc queries each add a shape.
+ */
+struct nuodb_result_shapes
+{
+    typedef std::list<std::pair<std::string, VALUE> > entry_list;
+
+    entry_list entries;
+    std::map<std::string, entry_list::iterator> index;
+};
+
+static const size_t NUODB_RESULT_SHAPES = 256;
+
+struct nuodb_schema_cache
+{
+    std::map<nuodb_table_key, nuodb_table_definition> tables;
+    std::map<std::string, VALUE> table_names;
+    nuodb_result_shapes result_columns;
+};
+
+/*
+ * The statement cache holds prepared statements, keyed by SQL text and
+ * generated keys mode, for reuse by later prepares of the same statement. The
+ * entries are kept in least recently used order, most recent first; entries
+ * lent out to a prepare block are in use and are neither handed out again nor
+ * evicted until the block exits.
+ */
+struct nuodb_statement_cache_entry
+{
+    std::string key;
+    VALUE statement;
+    bool in_use;
+};
+
+struct nuodb_statement_cache
+{
+    typedef std::list<nuodb_statement_cache_entry> entry_list;
+
+    size_t capacity;
+    entry_list entries;
+    std::map<std::string, entry_list::iterator> index;
+
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+};
+
+/*
+ * The local timezone offsets of the instants dates decode to, see
+ * nuodb_date_to_rb, in a small direct-mapped cache keyed by instant: dates
+ * fall on few distinct instants, midnights, so most lookups hit.
+ */
+static const size_t NUODB_TIMEZONE_CACHE_SIZE = 256;
+
+struct nuodb_timezone_cache
+{
+    long epoch_offset;
+    bool valid[NUODB_TIMEZONE_CACHE_SIZE];
+    int64_t instants[NUODB_TIMEZONE_CACHE_SIZE];
+    long offsets[NUODB_TIMEZONE_CACHE_SIZE];
+};
+
+/*
+ * The state of the connection that fetch functions decode values with.
+ */
+struct nuodb_decode_context
+{
+    nuodb_timezone_cache * timezone;
+    // the encoding index of character values, binary values are ASCII-8BIT
+    int encoding;
+};
+
+/*
+ * How NUMERIC and DECIMAL values of columns declared with fraction digits are
+ * returned; values of columns declared with a scale of 0 are returned as
+ * Integer except as String.
+ */
+enum nuodb_decimal_mode
+{
+    NUODB_DECIMAL_BIGDECIMAL,
+    NUODB_DECIMAL_RATIONAL,
+    NUODB_DECIMAL_STRING
 };
 
 struct nuodb_connection_handle : nuodb_handle
@@ -330,22 +545,108 @@ struct nuodb_connection_handle : nuodb_handle
     VALUE timezone;
 
     NuoDB::Connection * pointer;
+    nuodb_schema_cache * schema_cache;
+    nuodb_statement_cache * statement_cache;
+    nuodb_timezone_cache * timezone_cache;
+    // serializes use of the client objects, see nuodb_connection_acquire
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    rb_atomic_t busy;
+    VALUE owner;
+    // the calls holding or waiting for the connection, see NuoDB::Router
+    rb_atomic_t outstanding;
+    int query_timeout;
+    int fetch_size;
+    nuodb_decimal_mode decimal_mode;
+    int encoding;
+    // connecting is deferred until first use
+    bool deferred;
+    // restored when reconnecting
+    bool autocommit;
+
+    // reconnecting when the session is lost, see Connection.new
+    bool resilient;
+    size_t reconnect_attempts;
+    double reconnect_delay;
+    double reconnect_max_delay;
+    // counts the sessions opened, so that statements notice reconnects
+    unsigned long session;
+    // moving average of the seconds blocking calls take, see NuoDB::Router
+    double latency;
+};
+
+/*
+ * A parameter plan holds the SQL type of each parameter of a prepared
+ * statement, in parameter order, as reported by the parameter metadata.
+ */
+struct nuodb_parameter_plan
+{
+    std::vector<NuoDB::SqlType> types;
 };
 
 struct nuodb_prepared_statement_handle : nuodb_handle
 {
     NuoDB::PreparedStatement * pointer;
+    nuodb_parameter_plan * parameter_plan;
+    int batch_size;
+
+    // what it takes to prepare the statement again after a reconnect
+    unsigned long session;
+    VALUE sql;
+    bool generated_keys;
+    bool read_only;
+    // the values bound, recorded on resilient connections only
+    VALUE bindings;
+    // the settings made by timeout=, fetch_size= and max_rows=, -1 if unset
+    int query_timeout;
+    int fetch_size;
+    int max_rows;
 };
 
 struct nuodb_statement_handle : nuodb_handle
 {
     NuoDB::Statement * pointer;
+    unsigned long session;
+    // the settings made by timeout=, fetch_size= and max_rows=, -1 if unset
+    int query_timeout;
+    int fetch_size;
+    int max_rows;
+};
+
+/*
+ * A row decoder is the per-result plan used to convert the current row of a
+ * result set to Ruby values: one type-specialized fetch function per column,
+ * in column order, resolved from the result set metadata exactly once.
+ */
+typedef VALUE (*nuodb_fetch_func)(int column, NuoDB::SqlType type, NuoDB::ResultSet * results, nuodb_decode_context const * context);
+
+struct nuodb_column_decoder
+{
+    nuodb_fetch_func fetch;
+    NuoDB::SqlType type;
+    NuoDB::SqlType family;
+    nuodb_decimal_mode decimal;
+    // for NUMERIC and DECIMAL, whether the column is declared with a scale of 0
+    bool integral;
+};
+
+struct nuodb_row_decoder
+{
+    std::vector<nuodb_column_decoder> columns;
 };
 
 struct nuodb_result_handle : nuodb_handle
 {
     NuoDB::ResultSet * pointer;
+    NuoDB::Statement * statement;
     NuoDB::Connection * connection;
+    nuodb_row_decoder * decoder;
+    size_t prefetch;
+    // counts the calls advancing the cursor, see Result#estimated_round_trips
+    size_t fetched;
+    int fetch_size;
+    // the session of the connection the result set belongs to
+    unsigned long session;
 };
 
 template<typename handle_type>
@@ -355,6 +656,12 @@ handle_type * cast_handle(VALUE value)
     return static_cast<handle_type*>(DATA_PTR(value));
 }
 
+// connects a deferred connection on first use, see Connection.new
+static nuodb_connection_handle * nuodb_connection_get(VALUE value);
+
+// reconnects a resilient connection whose session was lost, see Connection.new
+static bool internal_connection_recover(nuodb_connection_handle * handle, int error_code);
+
 template<typename handle_type, typename return_type>
 return_type * cast_pointer_member(VALUE value)
 {
@@ -362,6 +669,29 @@ return_type * cast_pointer_member(VALUE value)
     return cast_handle<handle_type>(value)->pointer;
 }
 
+/*
+ * Handles inherited across fork belong to the parent's NuoDB session, which
+ * the child must not touch: they are neither used nor closed in the child,
+ * their client objects are left to the parent.
+ */
+template<typename handle_type>
+void nuodb_handle_abandon_inherited(handle_type * handle)
+{
+    if (handle->pid != nuodb_current_pid)
+    {
+        handle->pointer = NULL;
+    }
+}
+
+template<typename handle_type>
+void nuodb_handle_check_owner(handle_type * handle, char const * type_name)
+{
+    if (handle->pid != nuodb_current_pid)
+    {
+        rb_raise(rb_eArgError, "invalid state: %s created in parent process before fork", type_name);
+    }
+}
+
 static void track_ref_count(char const * context, nuodb_handle * handle)
 {
     trace("track_ref_count");
@@ -469,2032 +799,8935 @@ static void rb_raise_nuodb_error(int code, const char * fmt, ...)
 using namespace NuoDB;
 
 //------------------------------------------------------------------------------
+// blocking calls
 
 static
-VALUE nuodb_result_free_protect(VALUE value)
+double nuodb_monotonic_time()
 {
-    trace("nuodb_result_free_protect");
-    nuodb_result_handle * handle = reinterpret_cast<nuodb_result_handle *>(value);
-    if (handle != NULL)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Calls into the NuoDB client that may block on the network run with the GVL
+ * released so that other Ruby threads keep running meanwhile. A blocking call
+ * runs without the GVL and so must neither touch Ruby objects nor raise; any
+ * SQLException it throws is captured and raised once the GVL is reacquired.
+ *
+ * The NuoDB client objects of a connection must not be used concurrently, so
+ * only one blocking call may be in flight per connection at any one time; a
+ * second thread entering the client while the GVL is released waits for the
+ * first to release the connection.
+ */
+struct nuodb_blocking_call
+{
+    bool completed;
+    bool failed;
+    int error_code;
+    char error_text[BUFSIZ];
+
+    nuodb_blocking_call() : completed(false), failed(false), error_code(0)
     {
-        if (handle->pointer != NULL)
-        {
-            try
-            {
-                track_ref_count("CLOSE RESULT", handle);
-                log(INFO, "closing result");
-                handle->pointer->close();
-                handle->pointer = NULL;
-            }
-            catch (SQLException & e)
-            {
-                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close result: %s", e.getText());
-            }
-        }
+        error_text[0] = '\0';
     }
-    return Qnil;
+
+    virtual ~nuodb_blocking_call()
+    {
+    }
+
+    virtual void run() = 0;
+
+    /*
+     * Invoked from the unblocking function, on an arbitrary thread, when Ruby
+     * needs to interrupt the thread running the call. By default a call is not
+     * interruptible and interrupts are processed once it returns.
+     */
+    virtual void cancel()
+    {
+    }
+};
+
+static
+void * nuodb_blocking_call_run(void * data)
+{
+    nuodb_blocking_call * call = static_cast<nuodb_blocking_call *>(data);
+    try
+    {
+        call->run();
+    }
+    catch (SQLException & e)
+    {
+        call->failed = true;
+        call->error_code = e.getSqlcode();
+        snprintf(call->error_text, sizeof(call->error_text), "%s", e.getText());
+    }
+    catch (...)
+    {
+        call->failed = true;
+        snprintf(call->error_text, sizeof(call->error_text), "%s", "unexpected error in the NuoDB client");
+    }
+    call->completed = true;
+    return NULL;
 }
 
 static
-void nuodb_result_free(void * ptr)
+void nuodb_blocking_call_unblock(void * data)
 {
-    trace("nuodb_result_free");
-    if (ptr != NULL)
+    try
     {
-        int exception = 0;
-        rb_protect(nuodb_result_free_protect, reinterpret_cast<VALUE>(ptr), &exception);
-        if (exception)
-        {
-            rb_jump_tag(exception);
-        }
+        static_cast<nuodb_blocking_call *>(data)->cancel();
+    }
+    catch (...)
+    {
+        // the call runs to completion, or until the query timeout expires
     }
 }
 
 static
-void nuodb_result_mark(void * ptr)
+void nuodb_connection_lock_init(nuodb_connection_handle * handle)
 {
-    trace("nuodb_result_mark");
-    nuodb_result_handle * handle = static_cast<nuodb_result_handle *>(ptr);
-    rb_gc_mark(handle->parent);
+    pthread_mutex_init(&handle->lock, NULL);
+    pthread_cond_init(&handle->released, NULL);
+    handle->busy = 0;
+    handle->owner = Qnil;
+    handle->outstanding = 0;
 }
 
 static
-void nuodb_result_decr_reference_count(nuodb_handle * handle)
+void nuodb_connection_lock_destroy(nuodb_connection_handle * handle)
 {
-    trace("nuodb_result_decr_reference_count");
-    decr_reference_count(handle);
+    pthread_cond_destroy(&handle->released);
+    pthread_mutex_destroy(&handle->lock);
 }
 
 /*
- * call-seq:
- *  finish()
- *
- * Releases the result set and any associated resources.
+ * Acquires the connection for the thread unless in use; does not block.
  */
 static
-VALUE nuodb_result_finish(VALUE self)
+bool nuodb_connection_try_acquire(nuodb_connection_handle * handle, VALUE thread)
 {
-    trace("nuodb_result_free_protect");
-    nuodb_result_handle * handle = cast_handle<nuodb_result_handle>(self);//reinterpret_cast<nuodb_result_handle *>(value);
-    nuodb_result_free(handle);
-//    if (handle != NULL)
-//    {
-//        if (handle->pointer != NULL)
-//        {
-//            try
-//            {
-//                //handle->pointer->close();
-//                //handle->pointer = NULL;
-//            }
-//            catch (SQLException & e)
-//            {
-//                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close result: %s", e.getText());
-//            }
-//        }
-//    }
-    return Qnil;
-//
-//
-//
-//    trace("nuodb_result_finish");
-//    if (ENABLE_CLOSE_HOOK)
-//    {
-//        //nuodb_result_decr_reference_count(cast_handle<nuodb_result_handle>(self));
-//    }
-//    nuodb_result_handle * handle = ;
-//    if (handle != NULL && handle->pointer != NULL)
-//    {
-//        if (ATOMIC_DEC(handle->atomic) == 0)
-//        {
-//            try
-//            {
-//                //handle->pointer->close();
-//                //handle->pointer = NULL;
-//            }
-//            catch (SQLException & e)
-//            {
-//                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close result set: %s", e.getText());
-//            }
-//        }
-//    }
-//    return Qnil;
+    pthread_mutex_lock(&handle->lock);
+    bool acquired = handle->busy == 0;
+    if (acquired)
+    {
+        handle->busy = 1;
+        handle->owner = thread;
+        handle->outstanding++;
+    }
+    pthread_mutex_unlock(&handle->lock);
+    return acquired;
 }
 
+/*
+ * A thread waiting for the connection waits with the GVL released, and stops
+ * waiting, without acquiring the connection, once Ruby interrupts it.
+ */
+struct nuodb_connection_wait
+{
+    nuodb_connection_handle * handle;
+    VALUE thread;
+    bool acquired;
+    bool interrupted;
+};
+
 static
-VALUE nuodb_map_sql_type(int type)
+void * nuodb_connection_wait_run(void * data)
 {
-    VALUE symbol = Qnil;
-    switch(type)
+    nuodb_connection_wait * wait = static_cast<nuodb_connection_wait *>(data);
+    nuodb_connection_handle * handle = wait->handle;
+    pthread_mutex_lock(&handle->lock);
+    handle->outstanding++;
+    while (handle->busy != 0 && !wait->interrupted)
     {
-    case NUOSQL_TINYINT:
-    case NUOSQL_SMALLINT:
-    case NUOSQL_INTEGER:
-    case NUOSQL_BIGINT:
-        symbol = ID2SYM(rb_intern("integer"));
-        break;
+        pthread_cond_wait(&handle->released, &handle->lock);
+    }
+    if (!wait->interrupted)
+    {
+        handle->busy = 1;
+        handle->owner = wait->thread;
+        wait->acquired = true;
+    }
+    else
+    {
+        handle->outstanding--;
+    }
+    pthread_mutex_unlock(&handle->lock);
+    return NULL;
+}
 
-    case NUOSQL_BINARY:
-	symbol = ID2SYM(rb_intern("binary"));
-	break;
-    
-    case NUOSQL_FLOAT:
-    case NUOSQL_DOUBLE:
-        symbol = ID2SYM(rb_intern("float"));
-        break;
+static
+void nuodb_connection_wait_unblock(void * data)
+{
+    nuodb_connection_wait * wait = static_cast<nuodb_connection_wait *>(data);
+    pthread_mutex_lock(&wait->handle->lock);
+    wait->interrupted = true;
+    pthread_cond_broadcast(&wait->handle->released);
+    pthread_mutex_unlock(&wait->handle->lock);
+}
 
-    case NUOSQL_CHAR:
-    case NUOSQL_VARCHAR:
-    case NUOSQL_LONGVARCHAR:
-        symbol = ID2SYM(rb_intern("string"));
-        break;
+/*
+ * Acquires the connection for the current thread, waiting while another
+ * thread uses it; raises if the current thread uses it already, say while
+ * iterating prefetched rows, as waiting would never end.
+ */
+static
+void nuodb_connection_acquire(nuodb_connection_handle * handle)
+{
+    if (handle == NULL)
+    {
+        return;
+    }
+    VALUE thread = rb_thread_current();
+    if (nuodb_connection_try_acquire(handle, thread))
+    {
+        return;
+    }
+    if (handle->owner == thread)
+    {
+        rb_raise(rb_eArgError, "invalid state: connection in use by this thread");
+    }
 
-    case NUOSQL_BIT:
-    case NUOSQL_BOOLEAN:
-        symbol = ID2SYM(rb_intern("boolean"));
-        break;
+    nuodb_connection_wait wait;
+    wait.handle = handle;
+    wait.thread = thread;
+    wait.acquired = false;
+    while (!wait.acquired)
+    {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+        wait.interrupted = false;
+        // n.b. the wait is skipped if an interrupt is pending on entry
+        rb_thread_call_without_gvl2(nuodb_connection_wait_run, &wait, nuodb_connection_wait_unblock, &wait);
+#else
+        rb_thread_wait_for(rb_time_interval(rb_float_new(0.001)));
+        wait.acquired = nuodb_connection_try_acquire(handle, thread);
+#endif
+        if (!wait.acquired)
+        {
+            rb_thread_check_ints();
+        }
+    }
+}
 
-    case NUOSQL_DATE:
-        symbol = ID2SYM(rb_intern("date"));
-        break;
+static
+void nuodb_connection_release(nuodb_connection_handle * handle)
+{
+    if (handle != NULL)
+    {
+        pthread_mutex_lock(&handle->lock);
+        handle->busy = 0;
+        handle->owner = Qnil;
+        handle->outstanding--;
+        pthread_cond_broadcast(&handle->released);
+        pthread_mutex_unlock(&handle->lock);
+    }
+}
 
-    case NUOSQL_TIMESTAMP:
-        symbol = ID2SYM(rb_intern("timestamp"));
-        break;
+static
+void nuodb_connection_record_latency(nuodb_connection_handle * handle, double started)
+{
+    if (handle != NULL)
+    {
+        double elapsed = nuodb_monotonic_time() - started;
+        handle->latency = handle->latency > 0 ? handle->latency * 0.8 + elapsed * 0.2 : elapsed;
+    }
+}
 
-    case NUOSQL_TIME:
-        symbol = ID2SYM(rb_intern("time"));
-        break;
+/*
+ * Runs the call on the connection with the GVL released. Pending interrupts
+ * are processed after the connection is released again, which may raise; on
+ * return the caller checks call.failed and raises with call.error_text.
+ *
+ * Calls that are safe to make concurrently with others on the connection,
+ * such as cancellation, pass a NULL connection handle.
+ */
+static
+void nuodb_call_without_gvl(nuodb_connection_handle * handle, nuodb_blocking_call & call)
+{
+    nuodb_connection_acquire(handle);
+    double started = handle != NULL ? nuodb_monotonic_time() : 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    // n.b. the call is skipped if an interrupt is pending on entry
+    while (!call.completed)
+    {
+        rb_thread_call_without_gvl2(nuodb_blocking_call_run, &call, nuodb_blocking_call_unblock, &call);
+        if (!call.completed)
+        {
+            nuodb_connection_release(handle);
+            rb_thread_check_ints();
+            nuodb_connection_acquire(handle);
+        }
+    }
+    nuodb_connection_record_latency(handle, started);
+    nuodb_connection_release(handle);
+    rb_thread_check_ints();
+#else
+    nuodb_blocking_call_run(&call);
+    nuodb_connection_record_latency(handle, started);
+    nuodb_connection_release(handle);
+#endif
+}
 
-    case NUOSQL_DECIMAL:
-        symbol = ID2SYM(rb_intern("decimal"));
-        break;
+struct nuodb_open_database_call : nuodb_blocking_call
+{
+    Connection * connection;
+    char const * database;
+    Properties * properties;
 
-    case NUOSQL_NUMERIC:
-        symbol = ID2SYM(rb_intern("numeric"));
-        break;
+    void run()
+    {
+        connection->openDatabase(database, properties);
+    }
+};
 
-    case NUOSQL_BLOB:
-        symbol = ID2SYM(rb_intern("blob"));
-        break;
-//    case NUOSQL_CLOB:
-//        symbol = ID2SYM(rb_intern("clob"));
-//        break;
+struct nuodb_commit_call : nuodb_blocking_call
+{
+    Connection * connection;
 
-    case NUOSQL_NULL:
-    //case NUOSQL_BLOB:
-    case NUOSQL_CLOB:
-    case NUOSQL_LONGVARBINARY:
-    default:
-        rb_raise(rb_eNotImpError, "Unsupported SQL type: %d", type);
+    void run()
+    {
+        connection->commit();
     }
-    return symbol;
-}
-static
-VALUE nuodb_result_alloc(VALUE parent, NuoDB::ResultSet * results, NuoDB::Connection * connection)
+};
+
+struct nuodb_rollback_call : nuodb_blocking_call
 {
-    trace("nuodb_result_alloc");
-    nuodb_handle * parent_handle = cast_handle<nuodb_handle>(parent);
-    if (parent_handle != NULL)
+    Connection * connection;
+
+    void run()
     {
-        nuodb_result_handle * handle = ALLOC(struct nuodb_result_handle);
-        handle->free_func = RUBY_DATA_FUNC(nuodb_result_free);
-        handle->atomic = 0;
-        handle->parent = parent;
-        handle->parent_handle = parent_handle;
-        handle->pointer = results;
-        handle->connection = connection;
-        incr_reference_count(handle);
-        VALUE self = Data_Wrap_Struct(nuodb_result_klass, nuodb_result_mark, nuodb_result_decr_reference_count, handle);
+        connection->rollback();
+    }
+};
 
-        rb_iv_set(self, "@columns", Qnil);
-        rb_iv_set(self, "@rows", Qnil);
+struct nuodb_ping_call : nuodb_blocking_call
+{
+    Connection * connection;
 
-        if (!rb_block_given_p()) {
-            trace("nuodb_result_alloc: no block");
+    void run()
+    {
+        connection->ping();
+    }
+};
 
-            return self;
-        }
+struct nuodb_execute_call : nuodb_blocking_call
+{
+    Statement * statement;
+    char const * sql;
+    bool result;
 
-        trace("nuodb_result_alloc: begin block");
+    void run()
+    {
+        result = statement->execute(sql, NuoDB::RETURN_GENERATED_KEYS);
+    }
 
-        int exception = 0;
-        VALUE result = rb_protect(rb_yield, self, &exception);
+    void cancel()
+    {
+        statement->cancel();
+    }
+};
 
-        trace("nuodb_result_alloc: end block");
+struct nuodb_prepared_execute_call : nuodb_blocking_call
+{
+    PreparedStatement * statement;
+    bool result;
 
-        //nuodb_result_finish(self);
+    void run()
+    {
+        result = statement->execute();
+    }
 
-        trace("nuodb_result_alloc: auto finish");
+    void cancel()
+    {
+        statement->cancel();
+    }
+};
 
-        if (exception)
-        {
-            rb_jump_tag(exception);
-        }
-        else
-        {
-            return result;
-        }
+struct nuodb_next_call : nuodb_blocking_call
+{
+    ResultSet * results;
+    Statement * statement;
+    bool result;
+
+    void run()
+    {
+        result = results->next();
     }
-    else
+
+    void cancel()
     {
-        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+        statement->cancel();
     }
-    return Qnil;
-}
+};
 
-static int64_t
-nuodb_get_rb_timezone_offset()
+struct nuodb_execute_batch_call : nuodb_blocking_call
 {
-    VALUE time = rb_funcall(rb_cTime, rb_intern("at"), 1, rb_float_new(0));
-    VALUE offset = rb_funcall(time, rb_intern("utc_offset"), 0);
-    return NUM2LONG(offset);
-}
+    PreparedStatement * statement;
+    int const * counts;
 
-static VALUE
-nuodb_get_rb_value(int column, SqlType type, ResultSet * results)
+    void run()
+    {
+        counts = statement->executeBatch();
+    }
+
+    void cancel()
+    {
+        statement->cancel();
+    }
+};
+
+struct nuodb_cancel_call : nuodb_blocking_call
 {
-    VALUE value = Qnil;
-    switch (type)
+    Statement * statement;
+
+    void run()
     {
-        case NUOSQL_BIT:
-        case NUOSQL_BOOLEAN:
+        statement->cancel();
+    }
+};
+
+/*
+ * Statements are created, and prepared, with the connection's query timeout
+ * and fetch size, 0 leaving the client defaults.
+ */
+struct nuodb_create_statement_call : nuodb_blocking_call
+{
+    Connection * connection;
+    int query_timeout;
+    int fetch_size;
+    Statement * statement;
+
+    void run()
+    {
+        statement = connection->createStatement();
+        if (query_timeout > 0)
         {
-            // try-catch b.c. http://tools/jira/browse/DB-2379
-            try
-            {
-                bool field = results->getBoolean(column);
-                if (!results->wasNull())
-                {
-                    value = AS_QBOOL(field);
-                }
-            }
-            catch (SQLException & e)
-            {
-                 // see JDBC spec, DB-2379, however, according to RoR rules this
-                 // should return nil. See the following test case:
-                 // test_default_values_on_empty_strings(BasicsTest) [test/cases/base_test.rb:]
-            }
-            break;
+            statement->setQueryTimeout(query_timeout);
         }
-        case NUOSQL_FLOAT:
-        case NUOSQL_DOUBLE:
+        if (fetch_size > 0)
         {
-            double field = results->getDouble(column);
-            if (!results->wasNull())
-            {
-                value = rb_float_new(field);
-            }
-            break;
+            statement->setFetchSize(fetch_size);
         }
-        case NUOSQL_TINYINT:
-        case NUOSQL_SMALLINT:
-        case NUOSQL_INTEGER:
+    }
+};
+
+struct nuodb_prepare_call : nuodb_blocking_call
+{
+    Connection * connection;
+    char const * sql;
+    bool generated_keys;
+    int query_timeout;
+    int fetch_size;
+    PreparedStatement * statement;
+
+    void run()
+    {
+        if (generated_keys)
         {
-            int field = results->getInt(column);
-            if (!results->wasNull())
-            {
-                value = INT2NUM(field);
-            }
-            break;
+            statement = connection->prepareStatement(sql, NuoDB::RETURN_GENERATED_KEYS);
         }
-        case NUOSQL_BIGINT:
+        else
         {
-            int64_t field = results->getLong(column);
-            if (!results->wasNull())
-            {
-                value = LONG2NUM(field);
-            }
-            break;
+            statement = connection->prepareStatement(sql);
         }
-
-	case NUOSQL_BLOB:
-	case NUOSQL_BINARY:
-        case NUOSQL_VARCHAR:
-        case NUOSQL_LONGVARCHAR:
+        if (query_timeout > 0)
         {
-            char const * field = results->getString(column);
-            if (!results->wasNull())
-            {
-                value = rb_str_new2(field);
-            }
-            break;
+            statement->setQueryTimeout(query_timeout);
         }
-        case NUOSQL_DATE:
+        if (fetch_size > 0)
         {
-            NuoDB::Date * field = results->getDate(column);
-            if (!results->wasNull())
-            {
-                double secs = (double) field->getSeconds();
-                VALUE time = rb_funcall(rb_cTime, rb_intern("at"), 1, rb_float_new(secs - nuodb_get_rb_timezone_offset()));
-                value = rb_funcall(time, rb_intern("to_date"), 0);
-            }
-            break;
+            statement->setFetchSize(fetch_size);
         }
-        case NUOSQL_TIME:
-        case NUOSQL_TIMESTAMP:
+    }
+};
+
+/*
+ * Makes the statement settings other than -1, then reads all of them back.
+ */
+struct nuodb_statement_settings_call : nuodb_blocking_call
+{
+    Statement * statement;
+    int query_timeout;
+    int fetch_size;
+    int max_rows;
+
+    nuodb_statement_settings_call(Statement * target)
+        : statement(target), query_timeout(-1), fetch_size(-1), max_rows(-1)
+    {
+    }
+
+    void run()
+    {
+        if (query_timeout >= 0)
         {
-            NuoDB::Timestamp * field = results->getTimestamp(column);
-            if (!results->wasNull())
-            {
-                double secs = ((double) field->getSeconds()) + (((double) field->getNanos()) / 1000000);
-                value = rb_funcall(rb_cTime, rb_intern("at"), 1, rb_float_new(secs)); //  - nuodb_get_rb_timezone_offset()
-            }
-            break;
+            statement->setQueryTimeout(query_timeout);
         }
-        case NUOSQL_NUMERIC:
+        if (fetch_size >= 0)
         {
-            char const * field = results->getString(column);
-            if (!results->wasNull())
-            {
-                rb_require("bigdecimal");
-                VALUE klass = rb_const_get(rb_cObject, rb_intern("BigDecimal"));
-                VALUE args[1];
-                args[0] = rb_str_new2(field);
-                value = rb_class_new_instance(1, args, klass);
-            }
-            break;
+            statement->setFetchSize(fetch_size);
         }
-        default:
+        if (max_rows >= 0)
         {
-            rb_raise(rb_eTypeError, "Not a supported ruby type: %d", type);
-            break;
+            statement->setMaxRows(max_rows);
         }
+        query_timeout = statement->getQueryTimeout();
+        fetch_size = statement->getFetchSize();
+        max_rows = statement->getMaxRows();
     }
-    return value;
-}
+};
+
+struct nuodb_update_count_call : nuodb_blocking_call
+{
+    Statement * statement;
+    int count;
+
+    void run()
+    {
+        count = statement->getUpdateCount();
+    }
+};
+
+struct nuodb_result_set_call : nuodb_blocking_call
+{
+    Statement * statement;
+    bool generated_keys;
+    ResultSet * results;
+
+    void run()
+    {
+        results = generated_keys ? statement->getGeneratedKeys() : statement->getResultSet();
+    }
+};
 
 /*
- * call-seq:
- *      result.columns -> ary
- *
- * Returns an array of Column objects.
- *
- *      results = statement.results
- *      ...
- *      results.columns.each do |column|
- *          puts "#{column.name}, #{column.default}, #{column.type}, #{column.null}"
- *      end
+ * Readies a cached prepared statement for its next borrower: clears the
+ * parameters and the batch, and restores the connection's query timeout and
+ * fetch size, and no row limit, unless all of them are left be (-1).
  */
-static VALUE
-nuodb_result_columns(VALUE self)
+struct nuodb_prepared_reset_call : nuodb_blocking_call
 {
-    trace("nuodb_result_columns");
-    nuodb_result_handle * handle = cast_handle<nuodb_result_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+    PreparedStatement * statement;
+    bool clear_batch;
+    int query_timeout;
+    int fetch_size;
+    int max_rows;
+
+    void run()
     {
-        VALUE columns = rb_iv_get(self, "@columns");
-        if (NIL_P(columns))
+        statement->clearParameters();
+        if (clear_batch)
         {
-            try
-            {
-                ResultSetMetaData * result_metadata = handle->pointer->getMetaData();
-                DatabaseMetaData * database_metadata = handle->connection->getMetaData();
+            statement->clearBatch();
+        }
+        if (query_timeout >= 0)
+        {
+            statement->setQueryTimeout(query_timeout);
+            statement->setFetchSize(fetch_size);
+            statement->setMaxRows(max_rows);
+        }
+    }
+};
 
-                VALUE array = rb_ary_new();
-                rb_require("nuodb/column");
-                VALUE column_klass = rb_const_get(m_nuodb, rb_intern("Column"));
+struct nuodb_autocommit_call : nuodb_blocking_call
+{
+    Connection * connection;
+    bool autocommit;
 
-                int column_count = result_metadata->getColumnCount();
-                for (int column_index = 1; column_index < column_count + 1; ++column_index)
-                {
-                    char const * schema_name = result_metadata->getSchemaName(column_index);
-                    char const * table_name = result_metadata->getTableName(column_index);
-                    char const * column_name = result_metadata->getColumnName(column_index);
+    void run()
+    {
+        connection->setAutoCommit(autocommit);
+    }
+};
 
-                    // args: [name, default, sql_type, null]
-                    VALUE args[4];
+struct nuodb_parameter_types_call : nuodb_blocking_call
+{
+    PreparedStatement * statement;
+    std::vector<SqlType> * types;
 
-                    args[0] = rb_str_new2(result_metadata->getColumnLabel(column_index));
+    void run()
+    {
+        ParameterMetaData * metadata = statement->getParameterMetaData();
+        int parameter_count = metadata->getParameterCount();
+        types->resize(parameter_count);
+        for (int parameter = 1; parameter < parameter_count + 1; ++parameter)
+        {
+            (*types)[parameter - 1] = (SqlType) metadata->getParameterType(parameter);
+        }
+    }
+};
 
-                    ResultSet * database_metadata_results = database_metadata->getColumns(NULL,
-                        schema_name, table_name, column_name);
+/*
+ * Reads the names of the tables of the schema, to be turned into Ruby
+ * strings once the GVL is held again; lives on the heap, see
+ * nuodb_connection_tables.
+ */
+struct nuodb_get_tables_call : nuodb_blocking_call
+{
+    Connection * connection;
+    char const * schema;
+    std::vector<std::string> names;
+    nuodb_connection_handle * handle;
 
-                    if(database_metadata_results->next())
-                    {
-                        try
-                        {
-                            args[1] = nuodb_get_rb_value(database_metadata_results->findColumn("COLUMN_DEF"),
-                                (SqlType) result_metadata->getColumnType(column_index), database_metadata_results);
-                        }
-                        catch (SQLException & e)
-                        {
-                            args[1] = Qnil;
-                        }
-                    }
-                    else
-                    {
-                        args[1] = Qnil;
-                    }
-                    database_metadata_results->close();
+    void run()
+    {
+        char const * types[] = { "TABLE" };
+        ResultSet * results = connection->getMetaData()->getTables(NULL, schema, "%", 1, types);
+        int name_index = results->findColumn("TABLE_NAME");
+        while (results->next())
+        {
+            names.push_back(results->getString(name_index));
+        }
+        results->close();
+    }
+};
 
-                    args[2] = nuodb_map_sql_type(result_metadata->getColumnType(column_index));
-                    args[3] = result_metadata->isNullable(column_index) ? Qtrue : Qfalse;
+/*
+ * Runs several calls concurrently, each on a native thread of its own but at
+ * most NUODB_PARALLEL_THREADS threads at a time; calls that failed before
+ * they could run are skipped. Interrupting cancels every call.
+ */
+static const size_t NUODB_PARALLEL_THREADS = 32;
 
-                    VALUE column = rb_class_new_instance(4, args, column_klass);
-                    rb_ary_push(array, column);
-                }
+struct nuodb_parallel_call : nuodb_blocking_call
+{
+    std::vector<nuodb_blocking_call *> calls;
+    rb_atomic_t claimed;
 
-                rb_iv_set(self, "@columns", array);
+    nuodb_parallel_call() : claimed(0)
+    {
+    }
 
-                return array;
+    static void * work(void * data)
+    {
+        nuodb_parallel_call * self = static_cast<nuodb_parallel_call *>(data);
+        for (;;)
+        {
+            size_t index = ATOMIC_INC(self->claimed) - 1;
+            if (index >= self->calls.size())
+            {
+                break;
             }
-            catch (SQLException & e)
+            nuodb_blocking_call * call = self->calls[index];
+            if (!call->failed)
             {
-                rb_raise_nuodb_error(e.getSqlcode(), "Failed to create column info: %s", e.getText());
+                nuodb_blocking_call_run(call);
             }
         }
-        else
+        return NULL;
+    }
+
+    void run()
+    {
+        size_t count = calls.size() < NUODB_PARALLEL_THREADS ? calls.size() : NUODB_PARALLEL_THREADS;
+        std::vector<pthread_t> threads(count);
+        size_t started = 0;
+        while (started < count && pthread_create(&threads[started], NULL, work, this) == 0)
         {
-            return columns;
+            started++;
+        }
+        // n.b. should no thread start the calls run on this one
+        work(this);
+        for (size_t i = 0; i < started; ++i)
+        {
+            pthread_join(threads[i], NULL);
         }
     }
-    else
+
+    void cancel()
     {
-        rb_raise(rb_eArgError, "invalid state: result handle nil");
+        for (size_t i = 0; i < calls.size(); ++i)
+        {
+            calls[i]->cancel();
+        }
     }
-    return Qnil;
+};
+
+//------------------------------------------------------------------------------
+// options
+
+static
+double nuodb_seconds_option(VALUE hash, VALUE key, double value)
+{
+    VALUE option = rb_hash_aref(hash, key);
+    if (option != Qnil)
+    {
+        if (!rb_obj_is_kind_of(option, rb_cNumeric))
+        {
+            rb_raise(rb_eTypeError, "wrong %s argument type %s (Numeric expected)", rb_id2name(SYM2ID(key)), rb_class2name(CLASS_OF(option)));
+        }
+        value = NUM2DBL(option);
+        if (value < 0)
+        {
+            rb_raise(rb_eArgError, "%s must not be negative", rb_id2name(SYM2ID(key)));
+        }
+    }
+    return value;
+}
+
+static
+size_t nuodb_size_option(VALUE hash, VALUE key, size_t value)
+{
+    VALUE option = rb_hash_aref(hash, key);
+    if (option != Qnil)
+    {
+        if (TYPE(option) != T_FIXNUM)
+        {
+            rb_raise(rb_eTypeError, "wrong %s argument type %s (Integer expected)", rb_id2name(SYM2ID(key)), rb_class2name(CLASS_OF(option)));
+        }
+        long size = FIX2LONG(option);
+        if (size < 0)
+        {
+            rb_raise(rb_eArgError, "%s must not be negative", rb_id2name(SYM2ID(key)));
+        }
+        value = size;
+    }
+    return value;
 }
 
+//------------------------------------------------------------------------------
+// SQL classification
+
 /*
- * call-seq:
- *      result.rows -> ary
- *
- * Returns an array of rows, each of which is an array of values.
- *
- * Note that calling #rows for large result sets is sub-optimal as it will load
- * the entire dataset into memory. Users should prefer calling #each over #rows.
- *
- *      results = statement.results
- *      ...
- *      results.rows.each do |row|
- *          row.each do |value|
- *              puts value
- *          end
- *      end
+ * Tells whether the SQL text is a query that only reads, that is a SELECT
+ * without FOR UPDATE.
  */
-static VALUE
-nuodb_result_rows(VALUE self)
+static bool
+nuodb_sql_is_read(char const * sql, long length)
 {
-    trace("nuodb_result_rows");
-    nuodb_result_handle * handle = cast_handle<nuodb_result_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+    char const * end = sql + length;
+    while (sql < end && (isspace(*sql) || *sql == '('))
     {
-        VALUE rows = rb_iv_get(self, "@rows");
-        if (NIL_P(rows))
+        ++sql;
+    }
+    if (end - sql < 6 || strncasecmp(sql, "select", 6) != 0 ||
+            (end - sql > 6 && (isalnum(sql[6]) || sql[6] == '_')))
+    {
+        return false;
+    }
+    for (char const * text = sql; end - text >= 10; ++text)
+    {
+        if (strncasecmp(text, "for update", 10) == 0)
         {
-            try
-            {
-                rows = rb_ary_new();
+            return false;
+        }
+    }
+    return true;
+}
 
-                while (handle->pointer->next())
-                {
-                    VALUE row = rb_ary_new();
+//------------------------------------------------------------------------------
+// query timeouts and cancellation
 
-                    NuoDB::ResultSetMetaData * metadata = handle->pointer->getMetaData();
-                    int32_t column_count = metadata->getColumnCount();
-                    for (int32_t column = 1; column < column_count + 1; column++)
-                    {
-                        SqlType type = (SqlType) metadata->getColumnType(column);
-                        rb_ary_push(row, nuodb_get_rb_value(column, type, handle->pointer));
-                    }
+/*
+ * Converts a timeout in seconds to the whole seconds the client expects,
+ * rounding up; nil and zero mean no timeout.
+ */
+static int
+nuodb_timeout_seconds(VALUE value)
+{
+    if (NIL_P(value))
+    {
+        return 0;
+    }
+    if (!rb_obj_is_kind_of(value, rb_cNumeric))
+    {
+        rb_raise(rb_eTypeError, "wrong timeout argument type %s (Numeric expected)", rb_class2name(CLASS_OF(value)));
+    }
+    double seconds = NUM2DBL(value);
+    if (seconds < 0)
+    {
+        rb_raise(rb_eArgError, "timeout must not be negative");
+    }
+    return (int) ceil(seconds);
+}
 
-                    rb_ary_push(rows, row);
-                }
+/*
+ * call-seq:
+ *  timeout= seconds
+ *
+ * Sets the number of seconds a statement may execute before it is cancelled
+ * by the database; nil or 0 removes the limit.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+template<typename handle_type>
+VALUE nuodb_statement_timeout_set(VALUE self, VALUE value)
+{
+    trace("nuodb_statement_timeout_set");
 
-                rb_iv_set(self, "@rows", rows);
-            }
-            catch (SQLException & e)
-            {
-                rb_raise_nuodb_error(e.getSqlcode(), "Failed to create a rows array: %s", e.getText());
-            }
+    int seconds = nuodb_timeout_seconds(value);
+    handle_type * handle = cast_handle<handle_type>(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_statement_settings_call call(handle->pointer);
+        call.query_timeout = seconds;
+        nuodb_call_without_gvl(static_cast<nuodb_connection_handle *>(handle->parent_handle), call);
+        if (call.failed)
+        {
+            rb_raise_nuodb_error(call.error_code, "Failed to set the query timeout for the statement: %s", call.error_text);
         }
-        return rows;
+        handle->query_timeout = seconds;
     }
     else
     {
-        rb_raise(rb_eArgError, "invalid state: result handle nil");
+        rb_raise(rb_eArgError, "invalid state: statement handle nil");
     }
-    return Qnil;
+    return value;
 }
 
 /*
  * call-seq:
- *      result.each { |tuple| ... }
+ *  timeout -> Number
  *
- * Invokes the block for each tuple in the result set.
+ * Returns the number of seconds a statement may execute, 0 if unlimited.
  *
- *      connection.prepare select_dml do |select|
- *          ...
- *          if select.execute
- *              select.results.each do |row|
- *                  ...
- *              end
- *          end
- *      end
+ * <b>This is a NuoDB-specific extension.</b>
  */
-static VALUE
-nuodb_result_each(VALUE self)
+template<typename handle_type>
+VALUE nuodb_statement_timeout_get(VALUE self)
 {
-    trace("nuodb_result_each");
-    nuodb_result_handle * handle = cast_handle<nuodb_result_handle>(self);
+    trace("nuodb_statement_timeout_get");
+
+    handle_type * handle = cast_handle<handle_type>(self);
     if (handle != NULL && handle->pointer != NULL)
     {
-        VALUE rows = rb_iv_get(self, "@rows");
-        if (NIL_P(rows))
-        {
-			rows = nuodb_result_rows(self);
-        }
-        for (int i = 0; i < RARRAY_LEN(rows); i++)
+        nuodb_statement_settings_call call(handle->pointer);
+        nuodb_call_without_gvl(static_cast<nuodb_connection_handle *>(handle->parent_handle), call);
+        if (call.failed)
         {
-            rb_yield(rb_ary_entry(rows, i));
+            rb_raise_nuodb_error(call.error_code, "Failed to get the query timeout for the statement: %s", call.error_text);
         }
-        return self;
+        return INT2NUM(call.query_timeout);
     }
     else
     {
-        rb_raise(rb_eArgError, "invalid state: result handle nil");
+        rb_raise(rb_eArgError, "invalid state: statement handle nil");
     }
     return Qnil;
 }
 
-static
-void nuodb_define_result_api()
+/*
+ * call-seq:
+ *  cancel()
+ *
+ * Cancels the statement if it is executing. This may be called from another
+ * thread than the one executing the statement, in which the execution fails
+ * with a DatabaseError.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+template<typename handle_type>
+VALUE nuodb_statement_cancel(VALUE self)
 {
-    /*
-     * A Result object maintains a connection to a specific database. SQL
-     * statements are executed and results are returned within the context of
-     * a connection.
-     */
-    nuodb_result_klass = rb_define_class_under(m_nuodb, "Result", rb_cObject);
-    rb_include_module(nuodb_result_klass, rb_mEnumerable);
-
-    rb_define_attr(nuodb_result_klass, "columns", 1, 0);
-    rb_define_attr(nuodb_result_klass, "rows", 1, 0);
-
-    // DBI
-
-    rb_define_method(nuodb_result_klass, "each", RUBY_METHOD_FUNC(nuodb_result_each), 0);
-    rb_define_method(nuodb_result_klass, "columns", RUBY_METHOD_FUNC(nuodb_result_columns), 0);
-    rb_define_method(nuodb_result_klass, "rows", RUBY_METHOD_FUNC(nuodb_result_rows), 0);
-    //rb_define_method(nuodb_result_klass, "finish", RUBY_METHOD_FUNC(nuodb_result_finish), 0);
-}
+    trace("nuodb_statement_cancel");
 
-//------------------------------------------------------------------------------
-
-static
-VALUE nuodb_statement_free_protect(VALUE value)
-{
-    trace("nuodb_statement_free_protect");
-    nuodb_statement_handle * handle = reinterpret_cast<nuodb_statement_handle*>(value);
-    if (handle != NULL)
+    handle_type * handle = cast_handle<handle_type>(self);
+    if (handle != NULL && handle->pointer != NULL)
     {
-        if (handle->pointer != NULL)
+        nuodb_cancel_call call;
+        call.statement = handle->pointer;
+        nuodb_call_without_gvl(NULL, call);
+        if (call.failed)
         {
-            try
-            {
-                log(INFO, "closing statement");
-                handle->pointer->close();
-                handle->pointer = NULL;
-            }
-            catch (SQLException & e)
-            {
-                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close statement: %s", e.getText());
-            }
+            rb_raise_nuodb_error(call.error_code, "Failed to cancel the statement: %s", call.error_text);
         }
     }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+    }
     return Qnil;
 }
 
-static
-void nuodb_statement_free(void * ptr)
+//------------------------------------------------------------------------------
+// fetch size and row limits
+
+/*
+ * Converts a row count to the int the client expects; nil means 0, that is
+ * the client default for fetch sizes and no limit for row limits.
+ */
+static int
+nuodb_row_count(VALUE value, char const * name)
 {
-    trace("nuodb_statement_free");
-    if (ptr != NULL)
+    if (NIL_P(value))
     {
-        int exception = 0;
-        rb_protect(nuodb_statement_free_protect, reinterpret_cast<VALUE>(ptr), &exception);
-        if (exception)
-        {
-            rb_jump_tag(exception);
-        }
+        return 0;
+    }
+    if (TYPE(value) != T_FIXNUM)
+    {
+        rb_raise(rb_eTypeError, "wrong %s argument type %s (Integer expected)", name, rb_class2name(CLASS_OF(value)));
     }
+    long count = FIX2LONG(value);
+    if (count < 0)
+    {
+        rb_raise(rb_eArgError, "%s must not be negative", name);
+    }
+    return count > INT_MAX ? INT_MAX : (int) count;
 }
 
-static
-void nuodb_statement_mark(void * ptr)
-{
-    trace("nuodb_statement_mark");
-
-    nuodb_statement_handle * handle = static_cast<nuodb_statement_handle *>(ptr);
+/*
+ * call-seq:
+ *  fetch_size= rows
+ *
+ * Sets the number of rows the client fetches per round trip for the results
+ * of the statement; nil or 0 leaves it to the client. Larger fetch sizes
+ * take fewer round trips to the transaction engine at the cost of memory.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+template<typename handle_type>
+VALUE nuodb_statement_fetch_size_set(VALUE self, VALUE value)
+{
+    trace("nuodb_statement_fetch_size_set");
+
+    int rows = nuodb_row_count(value, "fetch_size");
+    handle_type * handle = cast_handle<handle_type>(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_statement_settings_call call(handle->pointer);
+        call.fetch_size = rows;
+        nuodb_call_without_gvl(static_cast<nuodb_connection_handle *>(handle->parent_handle), call);
+        if (call.failed)
+        {
+            rb_raise_nuodb_error(call.error_code, "Failed to set the fetch size for the statement: %s", call.error_text);
+        }
+        handle->fetch_size = rows;
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+    }
+    return value;
+}
+
+/*
+ * call-seq:
+ *  fetch_size -> Number
+ *
+ * Returns the number of rows the client fetches per round trip, 0 if left
+ * to the client.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+template<typename handle_type>
+VALUE nuodb_statement_fetch_size_get(VALUE self)
+{
+    trace("nuodb_statement_fetch_size_get");
+
+    handle_type * handle = cast_handle<handle_type>(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_statement_settings_call call(handle->pointer);
+        nuodb_call_without_gvl(static_cast<nuodb_connection_handle *>(handle->parent_handle), call);
+        if (call.failed)
+        {
+            rb_raise_nuodb_error(call.error_code, "Failed to get the fetch size for the statement: %s", call.error_text);
+        }
+        return INT2NUM(call.fetch_size);
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  max_rows= rows
+ *
+ * Limits the results of the statement to at most that many rows, the rest
+ * are silently dropped; nil or 0 removes the limit.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+template<typename handle_type>
+VALUE nuodb_statement_max_rows_set(VALUE self, VALUE value)
+{
+    trace("nuodb_statement_max_rows_set");
+
+    int rows = nuodb_row_count(value, "max_rows");
+    handle_type * handle = cast_handle<handle_type>(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_statement_settings_call call(handle->pointer);
+        call.max_rows = rows;
+        nuodb_call_without_gvl(static_cast<nuodb_connection_handle *>(handle->parent_handle), call);
+        if (call.failed)
+        {
+            rb_raise_nuodb_error(call.error_code, "Failed to set the row limit for the statement: %s", call.error_text);
+        }
+        handle->max_rows = rows;
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+    }
+    return value;
+}
+
+/*
+ * call-seq:
+ *  max_rows -> Number
+ *
+ * Returns the most rows the results of the statement hold, 0 if unlimited.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+template<typename handle_type>
+VALUE nuodb_statement_max_rows_get(VALUE self)
+{
+    trace("nuodb_statement_max_rows_get");
+
+    handle_type * handle = cast_handle<handle_type>(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_statement_settings_call call(handle->pointer);
+        nuodb_call_without_gvl(static_cast<nuodb_connection_handle *>(handle->parent_handle), call);
+        if (call.failed)
+        {
+            rb_raise_nuodb_error(call.error_code, "Failed to get the row limit for the statement: %s", call.error_text);
+        }
+        return INT2NUM(call.max_rows);
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * Applies the settings made on the statement to the statement created afresh
+ * after a reconnect, as the connection defaults apply to it otherwise.
+ */
+template<typename handle_type>
+void nuodb_statement_reapply_settings(handle_type * handle)
+{
+    if (handle->query_timeout < 0 && handle->fetch_size < 0 && handle->max_rows < 0)
+    {
+        return;
+    }
+    nuodb_statement_settings_call call(handle->pointer);
+    call.query_timeout = handle->query_timeout;
+    call.fetch_size = handle->fetch_size;
+    call.max_rows = handle->max_rows;
+    nuodb_call_without_gvl(static_cast<nuodb_connection_handle *>(handle->parent_handle), call);
+    if (call.failed)
+    {
+        rb_raise_nuodb_error(call.error_code, "Failed to restore the settings of the statement: %s", call.error_text);
+    }
+}
+
+/*
+ * Returns the update count of the statement's last execution; raises with
+ * the message given should the client fail.
+ */
+template<typename handle_type>
+int nuodb_statement_update_count_of(handle_type * handle, char const * message)
+{
+    nuodb_update_count_call call;
+    call.statement = handle->pointer;
+    call.count = -1;
+    nuodb_call_without_gvl(static_cast<nuodb_connection_handle *>(handle->parent_handle), call);
+    if (call.failed)
+    {
+        rb_raise_nuodb_error(call.error_code, "%s: %s", message, call.error_text);
+    }
+    return call.count;
+}
+
+/*
+ * Returns the result set, or the generated keys, of the statement's last
+ * execution; raises with the message given should the client fail.
+ */
+template<typename handle_type>
+ResultSet * nuodb_statement_result_set_of(handle_type * handle, bool generated_keys, char const * message)
+{
+    nuodb_result_set_call call;
+    call.statement = handle->pointer;
+    call.generated_keys = generated_keys;
+    call.results = NULL;
+    nuodb_call_without_gvl(static_cast<nuodb_connection_handle *>(handle->parent_handle), call);
+    if (call.failed)
+    {
+        rb_raise_nuodb_error(call.error_code, "%s: %s", message, call.error_text);
+    }
+    return call.results;
+}
+
+//------------------------------------------------------------------------------
+
+static
+VALUE nuodb_result_free_protect(VALUE value)
+{
+    trace("nuodb_result_free_protect");
+    nuodb_result_handle * handle = reinterpret_cast<nuodb_result_handle *>(value);
+    if (handle != NULL)
+    {
+        delete handle->decoder;
+        handle->decoder = NULL;
+        nuodb_handle_abandon_inherited(handle);
+        if (handle->pointer != NULL)
+        {
+            try
+            {
+                track_ref_count("CLOSE RESULT", handle);
+                log(INFO, "closing result");
+                handle->pointer->close();
+                handle->pointer = NULL;
+            }
+            catch (SQLException & e)
+            {
+                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close result: %s", e.getText());
+            }
+        }
+    }
+    return Qnil;
+}
+
+static
+void nuodb_result_free(void * ptr)
+{
+    trace("nuodb_result_free");
+    if (ptr != NULL)
+    {
+        int exception = 0;
+        rb_protect(nuodb_result_free_protect, reinterpret_cast<VALUE>(ptr), &exception);
+        if (exception)
+        {
+            rb_jump_tag(exception);
+        }
+    }
+}
+
+static
+void nuodb_result_mark(void * ptr)
+{
+    trace("nuodb_result_mark");
+    nuodb_result_handle * handle = static_cast<nuodb_result_handle *>(ptr);
     rb_gc_mark(handle->parent);
 }
 
 static
-void nuodb_statement_decr_reference_count(void * ptr)
+void nuodb_result_decr_reference_count(nuodb_handle * handle)
 {
-    trace("nuodb_statement_decr_reference_count");
-    decr_reference_count(static_cast<nuodb_statement_handle *>(ptr));
+    trace("nuodb_result_decr_reference_count");
+    decr_reference_count(handle);
 }
 
 /*
  * call-seq:
  *  finish()
  *
- * Releases the statement and any associated resources.
+ * Releases the result set and any associated resources.
  */
 static
-VALUE nuodb_statement_finish(VALUE self)
+VALUE nuodb_result_finish(VALUE self)
 {
-    trace("nuodb_statement_finish");
-    nuodb_statement_handle * handle = cast_handle<nuodb_statement_handle>(self);//reinterpret_cast<nuodb_statement_handle*>(value);
-    nuodb_statement_free(handle);
+    trace("nuodb_result_free_protect");
+    nuodb_result_handle * handle = cast_handle<nuodb_result_handle>(self);//reinterpret_cast<nuodb_result_handle *>(value);
+    nuodb_result_free(handle);
 //    if (handle != NULL)
 //    {
 //        if (handle->pointer != NULL)
 //        {
 //            try
 //            {
-//                log(INFO, "closing statement");
-//                handle->pointer->close();
-//                handle->pointer = NULL;
+//                //handle->pointer->close();
+//                //handle->pointer = NULL;
 //            }
 //            catch (SQLException & e)
 //            {
-//                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close statement: %s", e.getText());
+//                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close result: %s", e.getText());
 //            }
 //        }
 //    }
     return Qnil;
 //
+//
+//
+//    trace("nuodb_result_finish");
 //    if (ENABLE_CLOSE_HOOK)
 //    {
-//        nuodb_statement_handle * handle = cast_handle<nuodb_statement_handle>(self);
-//        if (handle != NULL && handle->pointer != NULL)
-//        {
-//            nuodb_statement_decr_reference_count(handle);
-//        }
-//        else
+//        //nuodb_result_decr_reference_count(cast_handle<nuodb_result_handle>(self));
+//    }
+//    nuodb_result_handle * handle = ;
+//    if (handle != NULL && handle->pointer != NULL)
+//    {
+//        if (ATOMIC_DEC(handle->atomic) == 0)
 //        {
-//            rb_raise(rb_eArgError, "invalid state: statement handle nil");
+//            try
+//            {
+//                //handle->pointer->close();
+//                //handle->pointer = NULL;
+//            }
+//            catch (SQLException & e)
+//            {
+//                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close result set: %s", e.getText());
+//            }
 //        }
 //    }
 //    return Qnil;
 }
 
 static
-VALUE nuodb_statement_initialize(VALUE parent)
+VALUE nuodb_map_sql_type(int type)
 {
-    trace("nuodb_statement_initialize");
+    VALUE symbol = Qnil;
+    switch(type)
+    {
+    case NUOSQL_TINYINT:
+    case NUOSQL_SMALLINT:
+    case NUOSQL_INTEGER:
+    case NUOSQL_BIGINT:
+        symbol = ID2SYM(rb_intern("integer"));
+        break;
 
-    nuodb_connection_handle * parent_handle = cast_handle<nuodb_connection_handle>(parent);
-    if (parent_handle != NULL && parent_handle->pointer != NULL)
+    case NUOSQL_BINARY:
+    case NUOSQL_LONGVARBINARY:
+	symbol = ID2SYM(rb_intern("binary"));
+	break;
+    
+    case NUOSQL_FLOAT:
+    case NUOSQL_DOUBLE:
+        symbol = ID2SYM(rb_intern("float"));
+        break;
+
+    case NUOSQL_CHAR:
+    case NUOSQL_VARCHAR:
+    case NUOSQL_LONGVARCHAR:
+        symbol = ID2SYM(rb_intern("string"));
+        break;
+
+    case NUOSQL_BIT:
+    case NUOSQL_BOOLEAN:
+        symbol = ID2SYM(rb_intern("boolean"));
+        break;
+
+    case NUOSQL_DATE:
+        symbol = ID2SYM(rb_intern("date"));
+        break;
+
+    case NUOSQL_TIMESTAMP:
+        symbol = ID2SYM(rb_intern("timestamp"));
+        break;
+
+    case NUOSQL_TIME:
+        symbol = ID2SYM(rb_intern("time"));
+        break;
+
+    case NUOSQL_DECIMAL:
+        symbol = ID2SYM(rb_intern("decimal"));
+        break;
+
+    case NUOSQL_NUMERIC:
+        symbol = ID2SYM(rb_intern("numeric"));
+        break;
+
+    case NUOSQL_BLOB:
+        symbol = ID2SYM(rb_intern("blob"));
+        break;
+//    case NUOSQL_CLOB:
+//        symbol = ID2SYM(rb_intern("clob"));
+//        break;
+
+    case NUOSQL_NULL:
+    //case NUOSQL_BLOB:
+    case NUOSQL_CLOB:
+    default:
+        rb_raise(rb_eNotImpError, "Unsupported SQL type: %d", type);
+    }
+    return symbol;
+}
+/*
+ * Maps the SQL type to the abstract type of a NuoDB::Column, e.g. :integer or
+ * :string; returns nil for types without an abstract type.
+ */
+static
+VALUE nuodb_map_column_type(int type, int scale)
+{
+    switch(type)
+    {
+    case NUOSQL_TINYINT:
+    case NUOSQL_SMALLINT:
+    case NUOSQL_INTEGER:
+    case NUOSQL_BIGINT:
+        return ID2SYM(rb_intern("integer"));
+
+    case NUOSQL_FLOAT:
+    case NUOSQL_DOUBLE:
+        return ID2SYM(rb_intern("float"));
+
+    case NUOSQL_DECIMAL:
+    case NUOSQL_NUMERIC:
+        return ID2SYM(rb_intern(scale == 0 ? "integer" : "decimal"));
+
+    case NUOSQL_CHAR:
+    case NUOSQL_VARCHAR:
+    case NUOSQL_LONGVARCHAR:
+        return ID2SYM(rb_intern("string"));
+
+    case NUOSQL_CLOB:
+        return ID2SYM(rb_intern("text"));
+
+    case NUOSQL_BLOB:
+    case NUOSQL_BINARY:
+    case NUOSQL_LONGVARBINARY:
+        return ID2SYM(rb_intern("binary"));
+
+    case NUOSQL_BIT:
+    case NUOSQL_BOOLEAN:
+        return ID2SYM(rb_intern("boolean"));
+
+    case NUOSQL_DATE:
+        return ID2SYM(rb_intern("date"));
+
+    case NUOSQL_TIME:
+        return ID2SYM(rb_intern("time"));
+
+    case NUOSQL_TIMESTAMP:
+        return ID2SYM(rb_intern("timestamp"));
+
+    default:
+        return Qnil;
+    }
+}
+
+/*
+ * Creates a NuoDB::Column directly from the column's type information, rather
+ * than by calling Column.new which sniffs the type information out of the sql
+ * type using regular expressions. Limit applies to character and binary types,
+ * precision and scale to exact numeric types.
+ */
+static
+VALUE nuodb_column_new(VALUE name, VALUE default_value, int type, int precision, int scale, int limit, bool nullable)
+{
+    VALUE column = rb_obj_alloc(nuodb_registry_class(&c_column, m_nuodb, "nuodb/column", id_column));
+
+    VALUE column_limit = Qnil;
+    VALUE column_precision = Qnil;
+    VALUE column_scale = Qnil;
+    switch (type)
+    {
+    case NUOSQL_CHAR:
+    case NUOSQL_VARCHAR:
+    case NUOSQL_LONGVARCHAR:
+    case NUOSQL_BINARY:
+    case NUOSQL_LONGVARBINARY:
+        column_limit = INT2NUM(limit);
+        break;
+    case NUOSQL_DECIMAL:
+    case NUOSQL_NUMERIC:
+        column_precision = INT2NUM(precision);
+        column_scale = INT2NUM(scale);
+        break;
+    default:
+        break;
+    }
+
+    rb_iv_set(column, "@name", name);
+    rb_iv_set(column, "@sql_type", nuodb_map_sql_type(type));
+    rb_iv_set(column, "@null", AS_QBOOL(nullable));
+    rb_iv_set(column, "@limit", column_limit);
+    rb_iv_set(column, "@precision", column_precision);
+    rb_iv_set(column, "@scale", column_scale);
+    rb_iv_set(column, "@type", nuodb_map_column_type(type, scale));
+    rb_iv_set(column, "@default", default_value);
+    rb_iv_set(column, "@primary", Qnil);
+    rb_iv_set(column, "@coder", Qnil);
+    return column;
+}
+
+static
+VALUE nuodb_result_alloc(VALUE parent, NuoDB::ResultSet * results, NuoDB::Statement * statement)
+{
+    trace("nuodb_result_alloc");
+    nuodb_handle * parent_handle = cast_handle<nuodb_handle>(parent);
+    if (parent_handle != NULL)
+    {
+        int fetch_size = 0;
+        try
+        {
+            fetch_size = results->getFetchSize();
+        }
+        catch (SQLException & e)
+        {
+            // unknown, see Result#estimated_round_trips
+        }
+
+        nuodb_result_handle * handle = ALLOC(struct nuodb_result_handle);
+        handle->free_func = RUBY_DATA_FUNC(nuodb_result_free);
+        handle->atomic = 0;
+        handle->pid = nuodb_current_pid;
+        handle->parent = parent;
+        handle->parent_handle = parent_handle;
+        handle->pointer = results;
+        handle->statement = statement;
+        handle->connection = statement->getConnection();
+        handle->decoder = NULL;
+        handle->prefetch = 0;
+        handle->fetched = 0;
+        handle->fetch_size = fetch_size;
+        handle->session = static_cast<nuodb_connection_handle *>(parent_handle->parent_handle)->session;
+        incr_reference_count(handle);
+        VALUE self = Data_Wrap_Struct(nuodb_result_klass, nuodb_result_mark, nuodb_result_decr_reference_count, handle);
+
+        rb_iv_set(self, "@columns", Qnil);
+        rb_iv_set(self, "@rows", Qnil);
+
+        if (!rb_block_given_p()) {
+            trace("nuodb_result_alloc: no block");
+
+            return self;
+        }
+
+        trace("nuodb_result_alloc: begin block");
+
+        int exception = 0;
+        VALUE result = rb_protect(rb_yield, self, &exception);
+
+        trace("nuodb_result_alloc: end block");
+
+        //nuodb_result_finish(self);
+
+        trace("nuodb_result_alloc: auto finish");
+
+        if (exception)
+        {
+            rb_jump_tag(exception);
+        }
+        else
+        {
+            return result;
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+    }
+    return Qnil;
+}
+
+static int64_t
+nuodb_floor_div(int64_t value, int64_t divisor)
+{
+    return value / divisor - (value % divisor < 0 ? 1 : 0);
+}
+
+/*
+ * Returns the offset of the local timezone from UTC at the instant, in
+ * seconds, as Time#utc_offset does.
+ */
+static long
+nuodb_local_utc_offset(int64_t instant)
+{
+    time_t time = (time_t) instant;
+    struct tm local;
+    if (localtime_r(&time, &local) == NULL)
+    {
+        return 0;
+    }
+    return local.tm_gmtoff;
+}
+
+static nuodb_timezone_cache *
+nuodb_connection_timezone_cache(nuodb_connection_handle * handle)
+{
+    if (handle->timezone_cache == NULL)
+    {
+        nuodb_timezone_cache * cache = new nuodb_timezone_cache();
+        cache->epoch_offset = nuodb_local_utc_offset(0);
+        for (size_t i = 0; i < NUODB_TIMEZONE_CACHE_SIZE; ++i)
+        {
+            cache->valid[i] = false;
+        }
+        handle->timezone_cache = cache;
+    }
+    return handle->timezone_cache;
+}
+
+static nuodb_decode_context
+nuodb_connection_decode_context(nuodb_connection_handle * handle)
+{
+    nuodb_decode_context context;
+    context.timezone = nuodb_connection_timezone_cache(handle);
+    context.encoding = handle->encoding;
+    return context;
+}
+
+static long
+nuodb_timezone_cache_offset(nuodb_timezone_cache * cache, int64_t instant)
+{
+    size_t slot = (size_t) ((uint64_t) nuodb_floor_div(instant, 86400) % NUODB_TIMEZONE_CACHE_SIZE);
+    if (!cache->valid[slot] || cache->instants[slot] != instant)
+    {
+        cache->offsets[slot] = nuodb_local_utc_offset(instant);
+        cache->instants[slot] = instant;
+        cache->valid[slot] = true;
+    }
+    return cache->offsets[slot];
+}
+
+/*
+ * Conversions of raw column values to Ruby values, shared by the fetch
+ * functions and the prefetched rows of Result#each.
+ *
+ * A date is the local date at its seconds, shifted by the offset of the local
+ * timezone at the epoch; it is built from its Julian day number, with no Time
+ * in between.
+ */
+static VALUE
+nuodb_date_to_rb(int64_t seconds, nuodb_timezone_cache * zone)
+{
+    static const int64_t NUODB_EPOCH_JULIAN_DAY = 2440588;
+
+    long epoch_offset = zone != NULL ? zone->epoch_offset : nuodb_local_utc_offset(0);
+    int64_t instant = seconds - epoch_offset;
+    long offset = zone != NULL ? nuodb_timezone_cache_offset(zone, instant) : nuodb_local_utc_offset(instant);
+    int64_t day = nuodb_floor_div(instant + offset, 86400) + NUODB_EPOCH_JULIAN_DAY;
+
+    VALUE klass = nuodb_registry_class(&c_date, rb_cObject, "date", id_date);
+    return rb_funcall(klass, id_jd, 1, LL2NUM(day));
+}
+
+static VALUE
+nuodb_timestamp_to_rb(int64_t seconds, int32_t nanos)
+{
+    return rb_time_nano_new((time_t) seconds, (long) nanos);
+}
+
+/*
+ * Returns the length of the leading run of ASCII bytes, scanning 32 bytes at
+ * a time on processors with AVX2 and 16 bytes at a time with SSE2; the tail
+ * is scanned byte by byte.
+ */
+#ifdef HAVE_GCC_TARGET_AVX2
+static bool nuodb_have_avx2 = false;
+
+__attribute__((target("avx2")))
+static size_t
+nuodb_ascii_prefix_avx2(unsigned char const * bytes, size_t length)
+{
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(bytes + i));
+        if (_mm256_movemask_epi8(chunk) != 0)
+        {
+            break;
+        }
+    }
+    return i;
+}
+#endif
+
+static size_t
+nuodb_ascii_prefix(unsigned char const * bytes, size_t length)
+{
+    size_t i = 0;
+#ifdef HAVE_GCC_TARGET_AVX2
+    if (nuodb_have_avx2)
+    {
+        i = nuodb_ascii_prefix_avx2(bytes, length);
+    }
+#endif
+#ifdef __SSE2__
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<__m128i const *>(bytes + i));
+        if (_mm_movemask_epi8(chunk) != 0)
+        {
+            break;
+        }
+    }
+#endif
+    while (i < length && bytes[i] < 0x80)
+    {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * Returns the width of the well-formed UTF-8 sequence the bytes start with,
+ * 0 if ill-formed: overlong, a surrogate, beyond U+10FFFF or truncated.
+ */
+static size_t
+nuodb_utf8_sequence(unsigned char const * bytes, size_t length)
+{
+    unsigned char lead = bytes[0];
+    size_t width;
+    unsigned char low = 0x80;
+    unsigned char high = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF)
+    {
+        width = 2;
+    }
+    else if (lead >= 0xE0 && lead <= 0xEF)
+    {
+        width = 3;
+        low = lead == 0xE0 ? 0xA0 : 0x80;
+        high = lead == 0xED ? 0x9F : 0xBF;
+    }
+    else if (lead >= 0xF0 && lead <= 0xF4)
+    {
+        width = 4;
+        low = lead == 0xF0 ? 0x90 : 0x80;
+        high = lead == 0xF4 ? 0x8F : 0xBF;
+    }
+    else
+    {
+        return 0;
+    }
+    if (length < width || bytes[1] < low || bytes[1] > high)
+    {
+        return 0;
+    }
+    for (size_t i = 2; i < width; ++i)
+    {
+        if ((bytes[i] & 0xC0) != 0x80)
+        {
+            return 0;
+        }
+    }
+    return width;
+}
+
+/*
+ * Determines the code range of text in the encoding, so that Ruby need not
+ * scan it again on first use: UTF-8 text is validated, text in other ASCII
+ * compatible encodings is only told apart as 7-bit or not.
+ */
+static int
+nuodb_text_coderange(unsigned char const * bytes, size_t length, int encoding)
+{
+    size_t i = nuodb_ascii_prefix(bytes, length);
+    if (i == length)
+    {
+        return ENC_CODERANGE_7BIT;
+    }
+    if (encoding != rb_utf8_encindex())
+    {
+        return ENC_CODERANGE_UNKNOWN;
+    }
+    while (i < length)
+    {
+        size_t width = nuodb_utf8_sequence(bytes + i, length - i);
+        if (width == 0)
+        {
+            return ENC_CODERANGE_BROKEN;
+        }
+        i += width;
+        i += nuodb_ascii_prefix(bytes + i, length - i);
+    }
+    return ENC_CODERANGE_VALID;
+}
+
+static bool
+nuodb_sql_type_binary(SqlType type)
+{
+    return type == NUOSQL_BLOB || type == NUOSQL_BINARY || type == NUOSQL_LONGVARBINARY;
+}
+
+/*
+ * Creates the string for a character or binary value: binary values are
+ * ASCII-8BIT, character values are in the encoding with their code range set.
+ */
+static VALUE
+nuodb_string_to_rb(char const * bytes, long length, SqlType type, int encoding)
+{
+    if (nuodb_sql_type_binary(type))
+    {
+        return rb_str_new(bytes, length);
+    }
+    VALUE text = rb_enc_str_new(bytes, length, rb_enc_from_index(encoding));
+    if (rb_enc_asciicompat(rb_enc_from_index(encoding)))
+    {
+        // set case by case, as the type of code ranges differs across rubies
+        switch (nuodb_text_coderange(reinterpret_cast<unsigned char const *>(bytes), (size_t) length, encoding))
+        {
+            case ENC_CODERANGE_7BIT:
+                ENC_CODERANGE_SET(text, ENC_CODERANGE_7BIT);
+                break;
+            case ENC_CODERANGE_VALID:
+                ENC_CODERANGE_SET(text, ENC_CODERANGE_VALID);
+                break;
+            case ENC_CODERANGE_BROKEN:
+                ENC_CODERANGE_SET(text, ENC_CODERANGE_BROKEN);
+                break;
+            default:
+                break;
+        }
+    }
+    return text;
+}
+
+/*
+ * Returns 10 ** -scale as a BigDecimal, created once per scale.
+ */
+static VALUE
+nuodb_bigdecimal_unit(int scale)
+{
+    if (NIL_P(c_bigdecimal_units[scale]))
+    {
+        char text[8];
+        snprintf(text, sizeof(text), "1e-%d", scale);
+        c_bigdecimal_units[scale] = rb_obj_freeze(rb_funcall(rb_mKernel, id_bigdecimal, 1, rb_str_new2(text)));
+    }
+    return c_bigdecimal_units[scale];
+}
+
+/*
+ * Converts the decimal text of a NUMERIC or DECIMAL value, to an Integer for
+ * columns declared with a scale of 0 and per the decimal mode otherwise, so
+ * that all values of a column have the same class. Up to 18
+ * significant digits with up to 18 fraction digits are accumulated into a
+ * scaled 64-bit integer as they are scanned, so that Integer, Rational and
+ * BigDecimal results are built from it without parsing the text again, a
+ * BigDecimal as the integer times the unit of its scale; longer values, and
+ * text not in plain decimal notation, are handed to Ruby to parse. Empty
+ * text converts to nil.
+ */
+static VALUE
+nuodb_numeric_to_rb(char const * field, size_t length, nuodb_decimal_mode mode, bool integral)
+{
+    static const int64_t POWERS_OF_TEN[19] = {
+        1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL, 100000000LL,
+        1000000000LL, 10000000000LL, 100000000000LL, 1000000000000LL, 10000000000000LL,
+        100000000000000LL, 1000000000000000LL, 10000000000000000LL, 100000000000000000LL,
+        1000000000000000000LL
+    };
+
+    if (mode == NUODB_DECIMAL_STRING)
+    {
+        return rb_str_new(field, length);
+    }
+    if (length == 0)
+    {
+        return Qnil;
+    }
+
+    char const * end = field + length;
+    char const * p = field;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        p++;
+    }
+    int64_t unscaled = 0;
+    int digits = 0;
+    int scale = 0;
+    bool point = false;
+    bool plain = p < end;
+    for (; p < end && plain; ++p)
+    {
+        if (*p >= '0' && *p <= '9')
+        {
+            if (digits > 0 || *p != '0')
+            {
+                if (digits < 18)
+                {
+                    unscaled = unscaled * 10 + (*p - '0');
+                }
+                digits++;
+            }
+            if (point)
+            {
+                scale++;
+            }
+        }
+        else if (*p == '.' && !point)
+        {
+            point = true;
+        }
+        else
+        {
+            plain = false;
+        }
+    }
+
+    if (integral && plain && scale == 0)
+    {
+        if (digits <= 18)
+        {
+            return LL2NUM(negative ? -unscaled : unscaled);
+        }
+        return rb_str_to_inum(rb_str_new(field, length), 10, Qfalse);
+    }
+    if (mode == NUODB_DECIMAL_RATIONAL)
+    {
+        if (plain && digits <= 18 && scale <= 18)
+        {
+            return rb_rational_new(LL2NUM(negative ? -unscaled : unscaled), LL2NUM(POWERS_OF_TEN[scale]));
+        }
+        return rb_Rational(rb_str_new(field, length), INT2FIX(1));
+    }
+    nuodb_registry_class(&c_bigdecimal, rb_cObject, "bigdecimal", id_bigdecimal);
+    if (plain && digits <= 18 && scale <= 18)
+    {
+        VALUE value = rb_funcall(rb_mKernel, id_bigdecimal, 1, LL2NUM(negative ? -unscaled : unscaled));
+        return scale > 0 ? rb_funcall(value, id_mult, 1, nuodb_bigdecimal_unit(scale)) : value;
+    }
+    return rb_funcall(rb_mKernel, id_bigdecimal, 1, rb_str_new(field, length));
+}
+
+/*
+ * Type-specialized fetch functions; one instantiation per SqlType family.
+ * Fetch functions return nil for SQL NULL values.
+ */
+template<SqlType sql_type>
+VALUE nuodb_fetch_value(int column, SqlType type, ResultSet * results, nuodb_decode_context const * context);
+
+template<>
+VALUE nuodb_fetch_value<NUOSQL_BOOLEAN>(int column, SqlType, ResultSet * results, nuodb_decode_context const *)
+{
+    VALUE value = Qnil;
+    // try-catch b.c. http://tools/jira/browse/DB-2379
+    try
+    {
+        bool field = results->getBoolean(column);
+        if (!results->wasNull())
+        {
+            value = AS_QBOOL(field);
+        }
+    }
+    catch (SQLException & e)
+    {
+         // see JDBC spec, DB-2379, however, according to RoR rules this
+         // should return nil. See the following test case:
+         // test_default_values_on_empty_strings(BasicsTest) [test/cases/base_test.rb:]
+    }
+    return value;
+}
+
+template<>
+VALUE nuodb_fetch_value<NUOSQL_DOUBLE>(int column, SqlType, ResultSet * results, nuodb_decode_context const *)
+{
+    double field = results->getDouble(column);
+    if (!results->wasNull())
+    {
+        return rb_float_new(field);
+    }
+    return Qnil;
+}
+
+template<>
+VALUE nuodb_fetch_value<NUOSQL_INTEGER>(int column, SqlType, ResultSet * results, nuodb_decode_context const *)
+{
+    int field = results->getInt(column);
+    if (!results->wasNull())
+    {
+        return INT2NUM(field);
+    }
+    return Qnil;
+}
+
+template<>
+VALUE nuodb_fetch_value<NUOSQL_BIGINT>(int column, SqlType, ResultSet * results, nuodb_decode_context const *)
+{
+    int64_t field = results->getLong(column);
+    if (!results->wasNull())
+    {
+        return LONG2NUM(field);
+    }
+    return Qnil;
+}
+
+/*
+ * Character and binary values are fetched with their length, so that values
+ * holding NUL bytes come through whole, and copied once into the new string.
+ * See nuodb_string_to_rb for their encoding.
+ */
+template<>
+VALUE nuodb_fetch_value<NUOSQL_VARCHAR>(int column, SqlType type, ResultSet * results, nuodb_decode_context const * context)
+{
+    Bytes field = results->getBytes(column);
+    if (!results->wasNull())
+    {
+        return nuodb_string_to_rb(reinterpret_cast<char const *>(field.data), field.length, type, context->encoding);
+    }
+    return Qnil;
+}
+
+template<>
+VALUE nuodb_fetch_value<NUOSQL_DATE>(int column, SqlType, ResultSet * results, nuodb_decode_context const * context)
+{
+    NuoDB::Date * field = results->getDate(column);
+    if (!results->wasNull())
+    {
+        return nuodb_date_to_rb(field->getSeconds(), context->timezone);
+    }
+    return Qnil;
+}
+
+template<>
+VALUE nuodb_fetch_value<NUOSQL_TIMESTAMP>(int column, SqlType, ResultSet * results, nuodb_decode_context const *)
+{
+    NuoDB::Timestamp * field = results->getTimestamp(column);
+    if (!results->wasNull())
+    {
+        return nuodb_timestamp_to_rb(field->getSeconds(), field->getNanos());
+    }
+    return Qnil;
+}
+
+/*
+ * NUMERIC and DECIMAL values are fetched as text, one instantiation per
+ * decimal mode and per whether the column is declared with a scale of 0.
+ */
+template<nuodb_decimal_mode mode, bool integral>
+VALUE nuodb_fetch_numeric(int column, SqlType, ResultSet * results, nuodb_decode_context const *)
+{
+    char const * field = results->getString(column);
+    if (!results->wasNull())
+    {
+        return nuodb_numeric_to_rb(field, strlen(field), mode, integral);
+    }
+    return Qnil;
+}
+
+template<>
+VALUE nuodb_fetch_value<NUOSQL_NULL>(int, SqlType type, ResultSet *, nuodb_decode_context const *)
+{
+    rb_raise(rb_eTypeError, "Not a supported ruby type: %d", type);
+    return Qnil;
+}
+
+/*
+ * Maps the SQL type to the family of types sharing its Ruby mapping; types
+ * without a Ruby mapping map to NUOSQL_NULL.
+ */
+static SqlType
+nuodb_sql_type_family(SqlType type)
+{
+    switch (type)
+    {
+        case NUOSQL_BIT:
+        case NUOSQL_BOOLEAN:
+            return NUOSQL_BOOLEAN;
+        case NUOSQL_FLOAT:
+        case NUOSQL_DOUBLE:
+            return NUOSQL_DOUBLE;
+        case NUOSQL_TINYINT:
+        case NUOSQL_SMALLINT:
+        case NUOSQL_INTEGER:
+            return NUOSQL_INTEGER;
+        case NUOSQL_BIGINT:
+            return NUOSQL_BIGINT;
+        case NUOSQL_BLOB:
+        case NUOSQL_BINARY:
+        case NUOSQL_LONGVARBINARY:
+        case NUOSQL_VARCHAR:
+        case NUOSQL_LONGVARCHAR:
+            return NUOSQL_VARCHAR;
+        case NUOSQL_DATE:
+            return NUOSQL_DATE;
+        case NUOSQL_TIME:
+        case NUOSQL_TIMESTAMP:
+            return NUOSQL_TIMESTAMP;
+        case NUOSQL_NUMERIC:
+        case NUOSQL_DECIMAL:
+            return NUOSQL_NUMERIC;
+        default:
+            return NUOSQL_NULL;
+    }
+}
+
+/*
+ * Resolves the fetch function for the SQL type, and for exact numeric types
+ * the decimal mode and declared scale; types without a Ruby mapping resolve
+ * to a function that raises a TypeError when it is called.
+ */
+static nuodb_fetch_func
+nuodb_fetch_func_for(SqlType type, nuodb_decimal_mode decimal, int32_t scale)
+{
+    switch (nuodb_sql_type_family(type))
+    {
+        case NUOSQL_BOOLEAN:
+            return &nuodb_fetch_value<NUOSQL_BOOLEAN>;
+        case NUOSQL_DOUBLE:
+            return &nuodb_fetch_value<NUOSQL_DOUBLE>;
+        case NUOSQL_INTEGER:
+            return &nuodb_fetch_value<NUOSQL_INTEGER>;
+        case NUOSQL_BIGINT:
+            return &nuodb_fetch_value<NUOSQL_BIGINT>;
+        case NUOSQL_VARCHAR:
+            return &nuodb_fetch_value<NUOSQL_VARCHAR>;
+        case NUOSQL_DATE:
+            return &nuodb_fetch_value<NUOSQL_DATE>;
+        case NUOSQL_TIMESTAMP:
+            return &nuodb_fetch_value<NUOSQL_TIMESTAMP>;
+        case NUOSQL_NUMERIC:
+            if (decimal == NUODB_DECIMAL_STRING)
+            {
+                return &nuodb_fetch_numeric<NUODB_DECIMAL_STRING, false>;
+            }
+            if (scale == 0)
+            {
+                return decimal == NUODB_DECIMAL_RATIONAL ? &nuodb_fetch_numeric<NUODB_DECIMAL_RATIONAL, true> :
+                    &nuodb_fetch_numeric<NUODB_DECIMAL_BIGDECIMAL, true>;
+            }
+            return decimal == NUODB_DECIMAL_RATIONAL ? &nuodb_fetch_numeric<NUODB_DECIMAL_RATIONAL, false> :
+                &nuodb_fetch_numeric<NUODB_DECIMAL_BIGDECIMAL, false>;
+        default:
+            return &nuodb_fetch_value<NUOSQL_NULL>;
+    }
+}
+
+static VALUE
+nuodb_get_rb_value(int column, SqlType type, ResultSet * results, nuodb_decode_context const * context,
+    nuodb_decimal_mode decimal, int32_t scale)
+{
+    return (*nuodb_fetch_func_for(type, decimal, scale))(column, type, results, context);
+}
+
+/*
+ * Results hang off a statement or prepared statement, which in turn hang off
+ * the connection.
+ */
+static nuodb_connection_handle *
+nuodb_result_connection_handle(nuodb_result_handle * handle)
+{
+    return static_cast<nuodb_connection_handle *>(handle->parent_handle->parent_handle);
+}
+
+/*
+ * Returns the result's handle; raises if the session the result set belongs
+ * to is gone, closed by a reconnect or left to the parent process by a fork,
+ * as its client objects are then freed or not ours to use.
+ */
+static nuodb_result_handle *
+nuodb_result_get(VALUE self)
+{
+    nuodb_result_handle * handle = cast_handle<nuodb_result_handle>(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_handle_check_owner(handle, "result");
+        nuodb_connection_handle * connection_handle = nuodb_result_connection_handle(handle);
+        if (connection_handle->deferred || connection_handle->session != handle->session)
+        {
+            rb_raise(rb_eArgError, "invalid state: result of a session closed by reconnecting");
+        }
+    }
+    return handle;
+}
+
+/*
+ * Returns the row decoder for the result, building it from the result set
+ * metadata on first use.
+ */
+static nuodb_row_decoder *
+nuodb_result_decoder(nuodb_result_handle * handle)
+{
+    if (handle->decoder == NULL)
+    {
+        NuoDB::ResultSetMetaData * metadata = handle->pointer->getMetaData();
+        int32_t column_count = metadata->getColumnCount();
+
+        nuodb_decimal_mode decimal = nuodb_result_connection_handle(handle)->decimal_mode;
+        nuodb_row_decoder * decoder = new nuodb_row_decoder();
+        decoder->columns.resize(column_count);
+        for (int32_t column = 1; column < column_count + 1; column++)
+        {
+            SqlType type = (SqlType) metadata->getColumnType(column);
+            int32_t scale = metadata->getScale(column);
+            decoder->columns[column - 1].type = type;
+            decoder->columns[column - 1].family = nuodb_sql_type_family(type);
+            decoder->columns[column - 1].decimal = decimal;
+            decoder->columns[column - 1].integral = scale == 0;
+            decoder->columns[column - 1].fetch = nuodb_fetch_func_for(type, decimal, scale);
+        }
+        handle->decoder = decoder;
+    }
+    return handle->decoder;
+}
+
+//------------------------------------------------------------------------------
+// staged values
+
+/*
+ * A staged value is the raw value of a column of the current row, read from
+ * the result set without creating Ruby objects so that it can be read with
+ * the GVL released, and converted to a Ruby value once the GVL is held again;
+ * see Result#prefetch= and the column defaults of the schema cache.
+ * Character, binary and decimal values are kept in a shared byte buffer.
+ */
+struct nuodb_staged_value
+{
+    bool null;
+    int64_t integer;
+    int32_t nanos;
+    double real;
+    size_t offset;
+    size_t length;
+};
+
+/*
+ * Stages the value of the column of the current row; called with the GVL
+ * released or on a worker thread, hence must not use the Ruby API.
+ */
+static void
+nuodb_stage_value(nuodb_column_decoder const & column, int index, ResultSet * results,
+    nuodb_staged_value & value, std::string & bytes)
+{
+    value.null = true;
+    switch (column.family)
+    {
+        case NUOSQL_BOOLEAN:
+            // see nuodb_fetch_value<NUOSQL_BOOLEAN>
+            try
+            {
+                value.integer = results->getBoolean(index) ? 1 : 0;
+                value.null = results->wasNull();
+            }
+            catch (SQLException & e)
+            {
+            }
+            break;
+        case NUOSQL_DOUBLE:
+            value.real = results->getDouble(index);
+            value.null = results->wasNull();
+            break;
+        case NUOSQL_INTEGER:
+            value.integer = results->getInt(index);
+            value.null = results->wasNull();
+            break;
+        case NUOSQL_BIGINT:
+            value.integer = results->getLong(index);
+            value.null = results->wasNull();
+            break;
+        case NUOSQL_VARCHAR:
+        {
+            Bytes field = results->getBytes(index);
+            value.null = results->wasNull();
+            if (!value.null)
+            {
+                value.offset = bytes.size();
+                value.length = field.length;
+                bytes.append(reinterpret_cast<char const *>(field.data), value.length);
+            }
+            break;
+        }
+        case NUOSQL_NUMERIC:
+        {
+            char const * field = results->getString(index);
+            value.null = results->wasNull();
+            if (!value.null)
+            {
+                value.offset = bytes.size();
+                value.length = strlen(field);
+                bytes.append(field, value.length);
+            }
+            break;
+        }
+        case NUOSQL_DATE:
+        {
+            NuoDB::Date * field = results->getDate(index);
+            value.null = results->wasNull();
+            if (!value.null)
+            {
+                value.integer = field->getSeconds();
+            }
+            break;
+        }
+        case NUOSQL_TIMESTAMP:
+        {
+            NuoDB::Timestamp * field = results->getTimestamp(index);
+            value.null = results->wasNull();
+            if (!value.null)
+            {
+                value.integer = field->getSeconds();
+                value.nanos = field->getNanos();
+            }
+            break;
+        }
+        default:
+            // raises once converted, see nuodb_fetch_value<NUOSQL_NULL>
+            break;
+    }
+}
+
+static VALUE
+nuodb_staged_value_to_rb(nuodb_column_decoder const & column, nuodb_staged_value const & value, std::string const & bytes,
+    nuodb_decode_context const * context)
+{
+    if (column.family == NUOSQL_NULL)
+    {
+        rb_raise(rb_eTypeError, "Not a supported ruby type: %d", column.type);
+    }
+    if (value.null)
+    {
+        return Qnil;
+    }
+    switch (column.family)
+    {
+        case NUOSQL_BOOLEAN:
+            return AS_QBOOL(value.integer != 0);
+        case NUOSQL_DOUBLE:
+            return rb_float_new(value.real);
+        case NUOSQL_INTEGER:
+            return INT2NUM((int) value.integer);
+        case NUOSQL_BIGINT:
+            return LONG2NUM(value.integer);
+        case NUOSQL_VARCHAR:
+            return nuodb_string_to_rb(bytes.data() + value.offset, value.length, column.type, context->encoding);
+        case NUOSQL_NUMERIC:
+            return nuodb_numeric_to_rb(bytes.data() + value.offset, value.length, column.decimal, column.integral);
+        case NUOSQL_DATE:
+            return nuodb_date_to_rb(value.integer, context->timezone);
+        case NUOSQL_TIMESTAMP:
+            return nuodb_timestamp_to_rb(value.integer, value.nanos);
+        default:
+            return Qnil;
+    }
+}
+
+//------------------------------------------------------------------------------
+// schema cache
+
+static nuodb_schema_cache *
+nuodb_connection_schema_cache(nuodb_connection_handle * handle)
+{
+    if (handle->schema_cache == NULL)
+    {
+        handle->schema_cache = new nuodb_schema_cache();
+    }
+    return handle->schema_cache;
+}
+
+static void
+nuodb_schema_cache_mark(nuodb_schema_cache * cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    std::map<nuodb_table_key, nuodb_table_definition>::const_iterator table;
+    for (table = cache->tables.begin(); table != cache->tables.end(); ++table)
+    {
+        std::vector<nuodb_column_definition> const & columns = table->second.columns;
+        for (size_t i = 0; i < columns.size(); ++i)
+        {
+            rb_gc_mark(columns[i].default_value);
+        }
+    }
+    std::map<std::string, VALUE>::const_iterator names;
+    for (names = cache->table_names.begin(); names != cache->table_names.end(); ++names)
+    {
+        rb_gc_mark(names->second);
+    }
+    nuodb_result_shapes::entry_list::const_iterator shapes;
+    for (shapes = cache->result_columns.entries.begin(); shapes != cache->result_columns.entries.end(); ++shapes)
+    {
+        rb_gc_mark(shapes->second);
+    }
+}
+
+/*
+ * Returns the columns cached for the result shape, marked most recently used,
+ * or nil on a miss.
+ */
+static VALUE
+nuodb_result_shapes_lookup(nuodb_result_shapes & shapes, std::string const & shape)
+{
+    std::map<std::string, nuodb_result_shapes::entry_list::iterator>::iterator found = shapes.index.find(shape);
+    if (found == shapes.index.end())
+    {
+        return Qnil;
+    }
+    shapes.entries.splice(shapes.entries.begin(), shapes.entries, found->second);
+    return found->second->second;
+}
+
+/*
+ * Caches the columns of the result shape as most recently used, evicting the
+ * least recently used shape when full.
+ */
+static void
+nuodb_result_shapes_insert(nuodb_result_shapes & shapes, std::string const & shape, VALUE columns)
+{
+    shapes.entries.push_front(std::make_pair(shape, columns));
+    shapes.index[shape] = shapes.entries.begin();
+    if (shapes.entries.size() > NUODB_RESULT_SHAPES)
+    {
+        shapes.index.erase(shapes.entries.back().first);
+        shapes.entries.pop_back();
+    }
+}
+
+static void
+nuodb_result_shapes_clear(nuodb_result_shapes & shapes)
+{
+    shapes.index.clear();
+    shapes.entries.clear();
+}
+
+/*
+ * Reads the column definitions of a table, staging the defaults to be
+ * converted by the type of their column once the GVL is held again; lives on
+ * the heap, see nuodb_schema_cache_table.
+ */
+struct nuodb_get_columns_call : nuodb_blocking_call
+{
+    Connection * connection;
+    char const * schema;
+    char const * table;
+    nuodb_decimal_mode decimal;
+    std::vector<nuodb_column_definition> columns;
+    std::vector<nuodb_column_decoder> decoders;
+    std::vector<nuodb_staged_value> defaults;
+    std::string bytes;
+    nuodb_connection_handle * handle;
+
+    void run()
+    {
+        ResultSet * results = connection->getMetaData()->getColumns(NULL, schema, table, NULL);
+        int name_index = results->findColumn("COLUMN_NAME");
+        int type_index = results->findColumn("DATA_TYPE");
+        int size_index = results->findColumn("COLUMN_SIZE");
+        int digits_index = results->findColumn("DECIMAL_DIGITS");
+        int nullable_index = results->findColumn("NULLABLE");
+        int default_index = results->findColumn("COLUMN_DEF");
+        while (results->next())
+        {
+            nuodb_column_definition column;
+            column.name = results->getString(name_index);
+            column.type = (SqlType) results->getInt(type_index);
+            column.precision = results->getInt(size_index);
+            column.scale = results->getInt(digits_index);
+            column.nullable = results->getInt(nullable_index) != 0;
+            column.default_value = Qnil;
+            columns.push_back(column);
+
+            nuodb_column_decoder decoder;
+            decoder.fetch = NULL;
+            decoder.type = column.type;
+            decoder.family = nuodb_sql_type_family(column.type);
+            decoder.decimal = decimal;
+            decoder.integral = column.scale == 0;
+            decoders.push_back(decoder);
+
+            nuodb_staged_value value;
+            value.null = true;
+            if (decoder.family != NUOSQL_NULL)
+            {
+                try
+                {
+                    nuodb_stage_value(decoder, default_index, results, value, bytes);
+                }
+                catch (SQLException & e)
+                {
+                    // a default not of the column type, e.g. an expression
+                    value.null = true;
+                }
+            }
+            defaults.push_back(value);
+        }
+        results->close();
+    }
+};
+
+static
+VALUE nuodb_schema_cache_table_read(VALUE data)
+{
+    nuodb_get_columns_call * call = reinterpret_cast<nuodb_get_columns_call *>(data);
+    nuodb_call_without_gvl(call->handle, *call);
+    if (call->failed)
+    {
+        rb_raise_nuodb_error(call->error_code, "Failed to get the columns for the table: %s", call->error_text);
+    }
+    if (call->columns.empty())
+    {
+        return Qnil;
+    }
+
+    // the array keeps the defaults alive until the cache marks them
+    nuodb_decode_context context = nuodb_connection_decode_context(call->handle);
+    VALUE defaults = rb_ary_new2(call->columns.size());
+    for (size_t i = 0; i < call->columns.size(); ++i)
+    {
+        VALUE default_value = Qnil;
+        if (call->decoders[i].family != NUOSQL_NULL)
+        {
+            default_value = nuodb_staged_value_to_rb(call->decoders[i], call->defaults[i], call->bytes, &context);
+        }
+        rb_ary_push(defaults, default_value);
+        call->columns[i].default_value = default_value;
+    }
+
+    nuodb_schema_cache * cache = nuodb_connection_schema_cache(call->handle);
+    nuodb_table_definition & entry = cache->tables[nuodb_table_key(call->schema != NULL ? call->schema : "", call->table)];
+    entry.columns.swap(call->columns);
+    RB_GC_GUARD(defaults);
+    return Qnil;
+}
+
+static
+VALUE nuodb_schema_cache_table_free(VALUE data)
+{
+    delete reinterpret_cast<nuodb_get_columns_call *>(data);
+    return Qnil;
+}
+
+/*
+ * Returns the cached definition of the table, loading all of its columns from
+ * the database metadata with a single query on a cache miss. Returns NULL if
+ * the table has no columns, i.e. it does not exist; such misses are not cached.
+ */
+static nuodb_table_definition const *
+nuodb_schema_cache_table(nuodb_connection_handle * handle, char const * schema_name, char const * table_name)
+{
+    nuodb_schema_cache * cache = nuodb_connection_schema_cache(handle);
+    std::map<nuodb_table_key, nuodb_table_definition>::const_iterator cached =
+        cache->tables.find(nuodb_table_key(schema_name != NULL ? schema_name : "", table_name));
+    if (cached != cache->tables.end())
+    {
+        return &cached->second;
+    }
+
+    nuodb_get_columns_call * call = new nuodb_get_columns_call();
+    call->connection = handle->pointer;
+    call->schema = schema_name;
+    call->table = table_name;
+    call->decimal = handle->decimal_mode;
+    call->handle = handle;
+    rb_ensure(nuodb_schema_cache_table_read, reinterpret_cast<VALUE>(call),
+            nuodb_schema_cache_table_free, reinterpret_cast<VALUE>(call));
+
+    cached = cache->tables.find(nuodb_table_key(schema_name != NULL ? schema_name : "", table_name));
+    return cached != cache->tables.end() ? &cached->second : NULL;
+}
+
+static nuodb_column_definition const *
+nuodb_table_definition_column(nuodb_table_definition const * table, char const * column_name)
+{
+    if (table != NULL && column_name != NULL)
+    {
+        for (size_t i = 0; i < table->columns.size(); ++i)
+        {
+            if (table->columns[i].name == column_name)
+            {
+                return &table->columns[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The metadata of the columns of a result, and the shape made of it, read
+ * before any Ruby objects are created; lives on the heap, see Result#columns.
+ */
+struct nuodb_result_column_metadata
+{
+    std::string label;
+    std::string schema;
+    std::string table;
+    std::string name;
+    int type;
+    int precision;
+    int scale;
+    int limit;
+    bool nullable;
+};
+
+struct nuodb_result_columns_state
+{
+    nuodb_result_handle * handle;
+    std::string shape;
+    std::vector<nuodb_result_column_metadata> columns;
+};
+
+static void
+nuodb_result_columns_read(nuodb_result_columns_state * state)
+{
+    ResultSetMetaData * result_metadata = state->handle->pointer->getMetaData();
+    int column_count = result_metadata->getColumnCount();
+    state->columns.resize(column_count);
+    for (int column_index = 1; column_index < column_count + 1; ++column_index)
+    {
+        nuodb_result_column_metadata & column = state->columns[column_index - 1];
+        char const * label = result_metadata->getColumnLabel(column_index);
+        char const * schema = result_metadata->getSchemaName(column_index);
+        char const * table = result_metadata->getTableName(column_index);
+        char const * name = result_metadata->getColumnName(column_index);
+        column.label = label != NULL ? label : "";
+        column.schema = schema != NULL ? schema : "";
+        column.table = table != NULL ? table : "";
+        column.name = name != NULL ? name : "";
+        column.type = result_metadata->getColumnType(column_index);
+        column.precision = result_metadata->getPrecision(column_index);
+        column.scale = result_metadata->getScale(column_index);
+        column.limit = result_metadata->getColumnDisplaySize(column_index);
+        column.nullable = result_metadata->isNullable(column_index);
+
+        std::string const * parts[] = { &column.label, &column.schema, &column.table, &column.name };
+        for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i)
+        {
+            state->shape.append(*parts[i]);
+            state->shape.push_back('\0');
+        }
+        char attributes[64];
+        snprintf(attributes, sizeof(attributes), "%d,%d,%d,%d,%d",
+            column.type, column.precision, column.scale, column.limit, column.nullable ? 1 : 0);
+        state->shape.append(attributes);
+        state->shape.push_back('\n');
+    }
+}
+
+static
+VALUE nuodb_result_columns_build(VALUE data)
+{
+    nuodb_result_columns_state * state = reinterpret_cast<nuodb_result_columns_state *>(data);
+    nuodb_connection_handle * connection_handle = nuodb_result_connection_handle(state->handle);
+    nuodb_schema_cache * cache = nuodb_connection_schema_cache(connection_handle);
+    try
+    {
+        nuodb_result_columns_read(state);
+    }
+    catch (SQLException & e)
+    {
+        rb_raise_nuodb_error(e.getSqlcode(), "Failed to create column info: %s", e.getText());
+    }
+
+    // results of the same shape share their column objects
+    VALUE cached = nuodb_result_shapes_lookup(cache->result_columns, state->shape);
+    if (!NIL_P(cached))
+    {
+        return rb_ary_dup(cached);
+    }
+
+    VALUE array = rb_ary_new2(state->columns.size());
+    for (size_t i = 0; i < state->columns.size(); ++i)
+    {
+        nuodb_result_column_metadata const & metadata = state->columns[i];
+        VALUE default_value = Qnil;
+        if (!metadata.table.empty())
+        {
+            nuodb_table_definition const * table = nuodb_schema_cache_table(connection_handle,
+                metadata.schema.empty() ? NULL : metadata.schema.c_str(), metadata.table.c_str());
+            nuodb_column_definition const * definition = nuodb_table_definition_column(table, metadata.name.c_str());
+            if (definition != NULL)
+            {
+                default_value = definition->default_value;
+            }
+        }
+
+        VALUE column = nuodb_column_new(rb_obj_freeze(rb_str_new(metadata.label.data(), metadata.label.size())),
+            default_value, metadata.type, metadata.precision, metadata.scale, metadata.limit, metadata.nullable);
+        rb_ary_push(array, rb_obj_freeze(column));
+    }
+
+    // n.b. the cached columns are frozen, results share them in arrays of their own
+    rb_obj_freeze(array);
+    nuodb_result_shapes_insert(cache->result_columns, state->shape, array);
+    return rb_ary_dup(array);
+}
+
+static
+VALUE nuodb_result_columns_free(VALUE data)
+{
+    delete reinterpret_cast<nuodb_result_columns_state *>(data);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *      result.columns -> ary
+ *
+ * Returns an array of Column objects. Results of the same shape share their
+ * Column objects, which are frozen; dup a column to set its primary or coder.
+ *
+ *      results = statement.results
+ *      ...
+ *      results.columns.each do |column|
+ *          puts "#{column.name}, #{column.default}, #{column.type}, #{column.null}"
+ *      end
+ */
+static VALUE
+nuodb_result_columns(VALUE self)
+{
+    trace("nuodb_result_columns");
+    nuodb_result_handle * handle = nuodb_result_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        VALUE columns = rb_iv_get(self, "@columns");
+        if (NIL_P(columns))
+        {
+            nuodb_result_columns_state * state = new nuodb_result_columns_state();
+            state->handle = handle;
+            columns = rb_ensure(nuodb_result_columns_build, reinterpret_cast<VALUE>(state),
+                    nuodb_result_columns_free, reinterpret_cast<VALUE>(state));
+            rb_iv_set(self, "@columns", columns);
+        }
+        return columns;
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: result handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * Advances the cursor to the next row, with the GVL released; returns false
+ * once the rows are exhausted.
+ */
+static bool
+nuodb_result_next(nuodb_result_handle * handle)
+{
+    nuodb_handle_check_owner(handle, "result");
+
+    nuodb_next_call call;
+    call.results = handle->pointer;
+    call.statement = handle->statement;
+    call.result = false;
+    nuodb_call_without_gvl(nuodb_result_connection_handle(handle), call);
+    handle->fetched++;
+    if (call.failed)
+    {
+        internal_connection_recover(nuodb_result_connection_handle(handle), call.error_code);
+        rb_raise_nuodb_error(call.error_code, "Failed to fetch the next row: %s", call.error_text);
+    }
+    return call.result;
+}
+
+/*
+ * Decodes the row the cursor is currently positioned on into a new array of
+ * values.
+ */
+static VALUE
+nuodb_result_current_row(nuodb_result_handle * handle)
+{
+    nuodb_row_decoder * decoder = nuodb_result_decoder(handle);
+    ResultSet * results = handle->pointer;
+    nuodb_decode_context context = nuodb_connection_decode_context(nuodb_result_connection_handle(handle));
+    size_t column_count = decoder->columns.size();
+    nuodb_column_decoder const * columns = column_count > 0 ? &decoder->columns[0] : NULL;
+
+    VALUE row = rb_ary_new2(column_count);
+    for (size_t i = 0; i < column_count; ++i)
+    {
+        rb_ary_push(row, (*columns[i].fetch)((int) i + 1, columns[i].type, results, &context));
+    }
+    return row;
+}
+
+/*
+ * Prefetching, see Result#prefetch=: a native worker thread advances the
+ * cursor and stages the raw column values of the next batch of rows, with
+ * no Ruby objects involved, while the Ruby thread converts the rows of the
+ * previous batch. Two batches are staged at most.
+ */
+struct nuodb_row_batch
+{
+    std::vector<nuodb_staged_value> values;
+    std::string bytes;
+    size_t rows;
+    size_t fetched;
+};
+
+struct nuodb_result_prefetch
+{
+    nuodb_result_handle * handle;
+    nuodb_connection_handle * connection_handle;
+    std::vector<nuodb_column_decoder> const * columns;
+    size_t batch_size;
+    nuodb_row_batch batches[2];
+    unsigned long produced;
+    unsigned long consumed;
+    bool done;
+    bool stopped;
+    bool failed;
+    int error_code;
+    char error_text[BUFSIZ];
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+};
+
+/*
+ * Fills the batch with up to batch_size rows, unless stopped meanwhile;
+ * returns false once the rows are exhausted.
+ */
+static bool
+nuodb_result_prefetch_fill(nuodb_result_prefetch * prefetch, nuodb_row_batch & batch)
+{
+    ResultSet * results = prefetch->handle->pointer;
+    std::vector<nuodb_column_decoder> const & columns = *prefetch->columns;
+    size_t column_count = columns.size();
+
+    batch.rows = 0;
+    batch.fetched = 0;
+    batch.bytes.clear();
+    batch.values.resize(prefetch->batch_size * column_count);
+    while (batch.rows < prefetch->batch_size)
+    {
+        pthread_mutex_lock(&prefetch->mutex);
+        bool stopped = prefetch->stopped;
+        pthread_mutex_unlock(&prefetch->mutex);
+        if (stopped)
+        {
+            return false;
+        }
+        batch.fetched++;
+        if (!results->next())
+        {
+            return false;
+        }
+        nuodb_staged_value * values = column_count > 0 ? &batch.values[batch.rows * column_count] : NULL;
+        for (size_t i = 0; i < column_count; ++i)
+        {
+            nuodb_stage_value(columns[i], (int) i + 1, results, values[i], batch.bytes);
+        }
+        batch.rows++;
+    }
+    return true;
+}
+
+static
+void * nuodb_result_prefetch_work(void * data)
+{
+    nuodb_result_prefetch * prefetch = static_cast<nuodb_result_prefetch *>(data);
+    for (;;)
+    {
+        pthread_mutex_lock(&prefetch->mutex);
+        while (!prefetch->stopped && prefetch->produced - prefetch->consumed == 2)
+        {
+            pthread_cond_wait(&prefetch->changed, &prefetch->mutex);
+        }
+        bool stopped = prefetch->stopped;
+        nuodb_row_batch & batch = prefetch->batches[prefetch->produced % 2];
+        pthread_mutex_unlock(&prefetch->mutex);
+        if (stopped)
+        {
+            break;
+        }
+
+        bool more = false;
+        try
+        {
+            more = nuodb_result_prefetch_fill(prefetch, batch);
+        }
+        catch (SQLException & e)
+        {
+            prefetch->failed = true;
+            prefetch->error_code = e.getSqlcode();
+            snprintf(prefetch->error_text, sizeof(prefetch->error_text), "%s", e.getText());
+        }
+        catch (...)
+        {
+            prefetch->failed = true;
+            snprintf(prefetch->error_text, sizeof(prefetch->error_text), "%s", "unexpected error in the NuoDB client");
+        }
+
+        pthread_mutex_lock(&prefetch->mutex);
+        prefetch->produced++;
+        prefetch->done = !more;
+        pthread_cond_broadcast(&prefetch->changed);
+        pthread_mutex_unlock(&prefetch->mutex);
+        if (!more)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Waits until a batch is staged or the worker is done.
+ */
+struct nuodb_prefetch_wait_call : nuodb_blocking_call
+{
+    nuodb_result_prefetch * prefetch;
+    bool cancelled;
+    bool ready;
+    bool finished;
+
+    virtual void run()
+    {
+        pthread_mutex_lock(&prefetch->mutex);
+        while (!cancelled && prefetch->consumed == prefetch->produced && !prefetch->done)
+        {
+            pthread_cond_wait(&prefetch->changed, &prefetch->mutex);
+        }
+        ready = prefetch->consumed < prefetch->produced;
+        finished = prefetch->done;
+        pthread_mutex_unlock(&prefetch->mutex);
+    }
+
+    virtual void cancel()
+    {
+        pthread_mutex_lock(&prefetch->mutex);
+        cancelled = true;
+        pthread_cond_broadcast(&prefetch->changed);
+        pthread_mutex_unlock(&prefetch->mutex);
+    }
+};
+
+static
+VALUE nuodb_result_each_prefetched(VALUE data)
+{
+    nuodb_result_prefetch * prefetch = reinterpret_cast<nuodb_result_prefetch *>(data);
+    std::vector<nuodb_column_decoder> const & columns = *prefetch->columns;
+    size_t column_count = columns.size();
+    nuodb_decode_context context = nuodb_connection_decode_context(prefetch->connection_handle);
+
+    for (;;)
+    {
+        // n.b. the wait returns early when interrupted
+        nuodb_prefetch_wait_call call;
+        call.prefetch = prefetch;
+        call.ready = false;
+        call.finished = false;
+        while (!call.ready && !call.finished)
+        {
+            call.completed = false;
+            call.cancelled = false;
+            nuodb_call_without_gvl(NULL, call);
+        }
+        if (!call.ready)
+        {
+            break;
+        }
+
+        // n.b. the batch is converted first and handed back to the worker
+        // before any row is yielded, the worker refills it meanwhile
+        nuodb_row_batch const & batch = prefetch->batches[prefetch->consumed % 2];
+        VALUE rows = rb_ary_new2(batch.rows);
+        for (size_t r = 0; r < batch.rows; ++r)
+        {
+            nuodb_staged_value const * values = &batch.values[r * column_count];
+            VALUE row = rb_ary_new2(column_count);
+            for (size_t i = 0; i < column_count; ++i)
+            {
+                rb_ary_push(row, nuodb_staged_value_to_rb(columns[i], values[i], batch.bytes, &context));
+            }
+            rb_ary_push(rows, row);
+        }
+
+        prefetch->handle->fetched += batch.fetched;
+
+        pthread_mutex_lock(&prefetch->mutex);
+        prefetch->consumed++;
+        pthread_cond_broadcast(&prefetch->changed);
+        pthread_mutex_unlock(&prefetch->mutex);
+
+        for (long i = 0; i < RARRAY_LEN(rows); ++i)
+        {
+            rb_yield(rb_ary_entry(rows, i));
+        }
+        RB_GC_GUARD(rows);
+    }
+
+    if (prefetch->failed)
+    {
+        internal_connection_recover(prefetch->connection_handle, prefetch->error_code);
+        rb_raise_nuodb_error(prefetch->error_code, "Failed to fetch the next row: %s", prefetch->error_text);
+    }
+    return Qnil;
+}
+
+/*
+ * Stops the worker: a worker still fetching has its statement cancelled so
+ * that the join need not wait for the round trip to end.
+ */
+struct nuodb_prefetch_join_call : nuodb_blocking_call
+{
+    nuodb_result_prefetch * prefetch;
+    bool finished;
+
+    virtual void run()
+    {
+        if (!finished && prefetch->handle->statement != NULL)
+        {
+            try
+            {
+                prefetch->handle->statement->cancel();
+            }
+            catch (SQLException & e)
+            {
+                // the worker stops once its fetch ends
+            }
+        }
+        pthread_join(prefetch->thread, NULL);
+    }
+};
+
+static
+VALUE nuodb_result_each_prefetched_ensure(VALUE data)
+{
+    nuodb_result_prefetch * prefetch = reinterpret_cast<nuodb_result_prefetch *>(data);
+
+    nuodb_prefetch_join_call call;
+    call.prefetch = prefetch;
+    pthread_mutex_lock(&prefetch->mutex);
+    prefetch->stopped = true;
+    call.finished = prefetch->done;
+    pthread_cond_broadcast(&prefetch->changed);
+    pthread_mutex_unlock(&prefetch->mutex);
+
+    // n.b. the join is not interruptible so that an interrupt cannot leave
+    // the worker running; it holds the GVL only if an interrupt is pending,
+    // as the ensure function must not raise
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    rb_thread_call_without_gvl2(nuodb_blocking_call_run, &call, NULL, NULL);
+#endif
+    if (!call.completed)
+    {
+        nuodb_blocking_call_run(&call);
+    }
+
+    pthread_cond_destroy(&prefetch->changed);
+    pthread_mutex_destroy(&prefetch->mutex);
+    nuodb_connection_release(prefetch->connection_handle);
+    delete prefetch;
+    return Qnil;
+}
+
+/*
+ * Iterates the rows with a prefetching worker thread, see Result#prefetch=;
+ * returns false, leaving the rows to the caller, if the thread cannot be
+ * started.
+ */
+static bool
+nuodb_result_each_prefetch(nuodb_result_handle * handle)
+{
+    nuodb_handle_check_owner(handle, "result");
+
+    nuodb_row_decoder * decoder = NULL;
+    try
+    {
+        decoder = nuodb_result_decoder(handle);
+    }
+    catch (SQLException & e)
+    {
+        rb_raise_nuodb_error(e.getSqlcode(), "Failed to describe the rows: %s", e.getText());
+    }
+
+    nuodb_connection_handle * connection_handle = nuodb_result_connection_handle(handle);
+    nuodb_connection_acquire(connection_handle);
+
+    nuodb_result_prefetch * prefetch = new nuodb_result_prefetch();
+    prefetch->handle = handle;
+    prefetch->connection_handle = connection_handle;
+    prefetch->columns = &decoder->columns;
+    prefetch->batch_size = handle->prefetch;
+    prefetch->produced = 0;
+    prefetch->consumed = 0;
+    prefetch->done = false;
+    prefetch->stopped = false;
+    prefetch->failed = false;
+    prefetch->error_code = 0;
+    prefetch->error_text[0] = '\0';
+    pthread_mutex_init(&prefetch->mutex, NULL);
+    pthread_cond_init(&prefetch->changed, NULL);
+    if (pthread_create(&prefetch->thread, NULL, nuodb_result_prefetch_work, prefetch) != 0)
+    {
+        pthread_cond_destroy(&prefetch->changed);
+        pthread_mutex_destroy(&prefetch->mutex);
+        delete prefetch;
+        nuodb_connection_release(connection_handle);
+        return false;
+    }
+
+    rb_ensure(nuodb_result_each_prefetched, reinterpret_cast<VALUE>(prefetch),
+            nuodb_result_each_prefetched_ensure, reinterpret_cast<VALUE>(prefetch));
+    return true;
+}
+
+/*
+ * call-seq:
+ *      result.rows -> ary
+ *
+ * Returns an array of rows, each of which is an array of values.
+ *
+ * Note that calling #rows for large result sets is sub-optimal as it will load
+ * the entire dataset into memory. Users should prefer calling #each over #rows.
+ *
+ *      results = statement.results
+ *      ...
+ *      results.rows.each do |row|
+ *          row.each do |value|
+ *              puts value
+ *          end
+ *      end
+ */
+static VALUE
+nuodb_result_rows(VALUE self)
+{
+    trace("nuodb_result_rows");
+    nuodb_result_handle * handle = nuodb_result_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        VALUE rows = rb_iv_get(self, "@rows");
+        if (NIL_P(rows))
+        {
+            try
+            {
+                rows = rb_ary_new();
+
+                while (nuodb_result_next(handle))
+                {
+                    rb_ary_push(rows, nuodb_result_current_row(handle));
+                }
+
+                rb_iv_set(self, "@rows", rows);
+            }
+            catch (SQLException & e)
+            {
+                rb_raise_nuodb_error(e.getSqlcode(), "Failed to create a rows array: %s", e.getText());
+            }
+        }
+        return rows;
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: result handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * A column vector being built by Result#columnar; the buffers are also held
+ * by the NuoDB::ColumnVector object, which keeps them from being collected.
+ */
+struct nuodb_column_builder
+{
+    SqlType family;
+    nuodb_fetch_func fetch;
+    SqlType type;
+    nuodb_decode_context context;
+    VALUE data;
+    VALUE offsets;
+    VALUE validity;
+    VALUE values;
+    size_t length;
+    size_t null_count;
+};
+
+static
+void nuodb_bitmap_append(VALUE bitmap, size_t index, bool bit)
+{
+    if (index % 8 == 0)
+    {
+        rb_str_cat(bitmap, "", 1);
+    }
+    if (bit)
+    {
+        RSTRING_PTR(bitmap)[index / 8] |= (char) (1 << (index % 8));
+    }
+}
+
+static
+void nuodb_column_builder_append_null(nuodb_column_builder * builder)
+{
+    static char const zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    switch (builder->family)
+    {
+        case NUOSQL_INTEGER:
+        case NUOSQL_BIGINT:
+        case NUOSQL_DOUBLE:
+            rb_str_cat(builder->data, zeros, sizeof(zeros));
+            break;
+        case NUOSQL_BOOLEAN:
+            nuodb_bitmap_append(builder->data, builder->length, false);
+            break;
+        case NUOSQL_VARCHAR:
+        {
+            int32_t offset = (int32_t) RSTRING_LEN(builder->data);
+            rb_str_cat(builder->offsets, reinterpret_cast<char const *>(&offset), sizeof(offset));
+            break;
+        }
+        default:
+            rb_ary_push(builder->values, Qnil);
+            break;
+    }
+    nuodb_bitmap_append(builder->validity, builder->length, false);
+    builder->null_count++;
+    builder->length++;
+}
+
+/*
+ * Appends the string value and its end offset; raises, appending nothing, if
+ * the values would exceed the 2 GiB that the int32 offsets address.
+ */
+static
+void nuodb_column_builder_append_bytes(nuodb_column_builder * builder, char const * bytes, long length)
+{
+    if (length > (long) INT32_MAX - RSTRING_LEN(builder->data))
+    {
+        rb_raise(rb_eRangeError, "string values of a column exceed 2 GiB");
+    }
+    rb_str_cat(builder->data, bytes, length);
+    int32_t offset = (int32_t) RSTRING_LEN(builder->data);
+    rb_str_cat(builder->offsets, reinterpret_cast<char const *>(&offset), sizeof(offset));
+    nuodb_bitmap_append(builder->validity, builder->length, true);
+    builder->length++;
+}
+
+/*
+ * Appends the value of the column of the current row, read with the getter
+ * of its type, without creating a Ruby object but for :object columns.
+ */
+static
+void nuodb_column_builder_append_column(nuodb_column_builder * builder, int column, ResultSet * results)
+{
+    switch (builder->family)
+    {
+        case NUOSQL_INTEGER:
+        case NUOSQL_BIGINT:
+        {
+            int64_t field = builder->family == NUOSQL_INTEGER ? results->getInt(column) : results->getLong(column);
+            if (results->wasNull())
+            {
+                nuodb_column_builder_append_null(builder);
+                return;
+            }
+            rb_str_cat(builder->data, reinterpret_cast<char const *>(&field), sizeof(field));
+            break;
+        }
+        case NUOSQL_DOUBLE:
+        {
+            double field = results->getDouble(column);
+            if (results->wasNull())
+            {
+                nuodb_column_builder_append_null(builder);
+                return;
+            }
+            rb_str_cat(builder->data, reinterpret_cast<char const *>(&field), sizeof(field));
+            break;
+        }
+        case NUOSQL_BOOLEAN:
+        {
+            VALUE field = nuodb_fetch_value<NUOSQL_BOOLEAN>(column, builder->type, results, NULL);
+            if (NIL_P(field))
+            {
+                nuodb_column_builder_append_null(builder);
+                return;
+            }
+            nuodb_bitmap_append(builder->data, builder->length, RTEST(field));
+            break;
+        }
+        case NUOSQL_VARCHAR:
+        {
+            Bytes field = results->getBytes(column);
+            if (results->wasNull())
+            {
+                nuodb_column_builder_append_null(builder);
+                return;
+            }
+            nuodb_column_builder_append_bytes(builder, reinterpret_cast<char const *>(field.data), field.length);
+            return;
+        }
+        default:
+        {
+            VALUE field = (*builder->fetch)(column, builder->type, results, &builder->context);
+            if (NIL_P(field))
+            {
+                nuodb_column_builder_append_null(builder);
+                return;
+            }
+            rb_ary_push(builder->values, field);
+            break;
+        }
+    }
+    nuodb_bitmap_append(builder->validity, builder->length, true);
+    builder->length++;
+}
+
+/*
+ * Appends a value already decoded, as by Result#rows.
+ */
+static
+void nuodb_column_builder_append_value(nuodb_column_builder * builder, VALUE value)
+{
+    if (NIL_P(value))
+    {
+        nuodb_column_builder_append_null(builder);
+        return;
+    }
+    switch (builder->family)
+    {
+        case NUOSQL_INTEGER:
+        case NUOSQL_BIGINT:
+        {
+            int64_t field = NUM2LL(value);
+            rb_str_cat(builder->data, reinterpret_cast<char const *>(&field), sizeof(field));
+            break;
+        }
+        case NUOSQL_DOUBLE:
+        {
+            double field = NUM2DBL(value);
+            rb_str_cat(builder->data, reinterpret_cast<char const *>(&field), sizeof(field));
+            break;
+        }
+        case NUOSQL_BOOLEAN:
+            nuodb_bitmap_append(builder->data, builder->length, RTEST(value));
+            break;
+        case NUOSQL_VARCHAR:
+            StringValue(value);
+            nuodb_column_builder_append_bytes(builder, RSTRING_PTR(value), RSTRING_LEN(value));
+            return;
+        default:
+            rb_ary_push(builder->values, value);
+            break;
+    }
+    nuodb_bitmap_append(builder->validity, builder->length, true);
+    builder->length++;
+}
+
+static
+VALUE nuodb_column_vector_type(SqlType family)
+{
+    switch (family)
+    {
+        case NUOSQL_INTEGER:
+        case NUOSQL_BIGINT:
+            return ID2SYM(rb_intern("int64"));
+        case NUOSQL_DOUBLE:
+            return ID2SYM(rb_intern("double"));
+        case NUOSQL_BOOLEAN:
+            return ID2SYM(rb_intern("boolean"));
+        case NUOSQL_VARCHAR:
+            return ID2SYM(rb_intern("string"));
+        default:
+            return ID2SYM(rb_intern("object"));
+    }
+}
+
+/*
+ * call-seq:
+ *      result.columnar -> ary
+ *
+ * Returns the rows column by column, as an array of NuoDB::ColumnVector
+ * objects in column order. Integers, doubles, booleans and strings are
+ * packed in binary buffers as they are fetched, without creating a Ruby
+ * object per value; values of other types, such as dates, are decoded as by
+ * #rows. As the string offsets are int32, a RangeError is raised should the
+ * strings of a column exceed 2 GiB.
+ *
+ * Like #each this fetches the remaining rows from the cursor, unless #rows
+ * was called beforehand in which case the rows it returned are packed.
+ *
+ *      vectors = statement.results.columnar
+ *      totals = vectors[1]
+ *      totals.type     #=> :double
+ *      Numo::DFloat.from_binary(totals.data)
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE
+nuodb_result_columnar(VALUE self)
+{
+    trace("nuodb_result_columnar");
+    nuodb_result_handle * handle = nuodb_result_get(self);
+    if (handle == NULL || handle->pointer == NULL)
+    {
+        rb_raise(rb_eArgError, "invalid state: result handle nil");
+    }
+
+    nuodb_row_decoder * decoder = NULL;
+    VALUE names = Qnil;
+    try
+    {
+        decoder = nuodb_result_decoder(handle);
+        ResultSetMetaData * metadata = handle->pointer->getMetaData();
+        names = rb_ary_new2(decoder->columns.size());
+        for (size_t i = 0; i < decoder->columns.size(); ++i)
+        {
+            rb_ary_push(names, rb_str_new2(metadata->getColumnLabel((int) i + 1)));
+        }
+    }
+    catch (SQLException & e)
+    {
+        rb_raise_nuodb_error(e.getSqlcode(), "Failed to describe the columns: %s", e.getText());
+    }
+
+    VALUE klass = nuodb_registry_class(&c_column_vector, m_nuodb, "nuodb/column_vector", id_column_vector);
+
+    size_t column_count = decoder->columns.size();
+    nuodb_decode_context context = nuodb_connection_decode_context(nuodb_result_connection_handle(handle));
+    VALUE vectors = rb_ary_new2(column_count);
+    VALUE builders_buffer = 0;
+    nuodb_column_builder * builders = ALLOCV_N(nuodb_column_builder, builders_buffer, column_count);
+    for (size_t i = 0; i < column_count; ++i)
+    {
+        nuodb_column_builder * builder = &builders[i];
+        builder->family = decoder->columns[i].family;
+        builder->fetch = decoder->columns[i].fetch;
+        builder->type = decoder->columns[i].type;
+        builder->context = context;
+        builder->data = rb_str_buf_new(0);
+        builder->offsets = Qnil;
+        builder->validity = rb_str_buf_new(0);
+        builder->values = Qnil;
+        builder->length = 0;
+        builder->null_count = 0;
+        if (builder->family == NUOSQL_VARCHAR)
+        {
+            int32_t offset = 0;
+            if (!nuodb_sql_type_binary(builder->type))
+            {
+                rb_enc_associate_index(builder->data, context.encoding);
+            }
+            builder->offsets = rb_str_buf_new(0);
+            rb_str_cat(builder->offsets, reinterpret_cast<char const *>(&offset), sizeof(offset));
+        }
+        else if (builder->family != NUOSQL_INTEGER && builder->family != NUOSQL_BIGINT &&
+            builder->family != NUOSQL_DOUBLE && builder->family != NUOSQL_BOOLEAN)
+        {
+            builder->data = Qnil;
+            builder->values = rb_ary_new();
+        }
+
+        VALUE vector = rb_obj_alloc(klass);
+        rb_iv_set(vector, "@name", rb_ary_entry(names, i));
+        rb_iv_set(vector, "@type", nuodb_column_vector_type(builder->family));
+        rb_iv_set(vector, "@data", builder->data);
+        rb_iv_set(vector, "@offsets", builder->offsets);
+        rb_iv_set(vector, "@validity", builder->validity);
+        rb_iv_set(vector, "@values", builder->values);
+        rb_ary_push(vectors, vector);
+    }
+
+    VALUE rows = rb_iv_get(self, "@rows");
+    if (!NIL_P(rows))
+    {
+        for (long r = 0; r < RARRAY_LEN(rows); ++r)
+        {
+            VALUE row = rb_ary_entry(rows, r);
+            for (size_t i = 0; i < column_count; ++i)
+            {
+                nuodb_column_builder_append_value(&builders[i], rb_ary_entry(row, i));
+            }
+        }
+    }
+    else
+    {
+        ResultSet * results = handle->pointer;
+        while (nuodb_result_next(handle))
+        {
+            try
+            {
+                for (size_t i = 0; i < column_count; ++i)
+                {
+                    nuodb_column_builder_append_column(&builders[i], (int) i + 1, results);
+                }
+            }
+            catch (SQLException & e)
+            {
+                rb_raise_nuodb_error(e.getSqlcode(), "Failed to decode the row: %s", e.getText());
+            }
+        }
+    }
+
+    for (size_t i = 0; i < column_count; ++i)
+    {
+        VALUE vector = rb_ary_entry(vectors, i);
+        rb_iv_set(vector, "@length", ULONG2NUM(builders[i].length));
+        rb_iv_set(vector, "@null_count", ULONG2NUM(builders[i].null_count));
+        if (!NIL_P(builders[i].data))
+        {
+            rb_obj_freeze(builders[i].data);
+        }
+        if (!NIL_P(builders[i].offsets))
+        {
+            rb_obj_freeze(builders[i].offsets);
+        }
+        rb_obj_freeze(builders[i].validity);
+    }
+    ALLOCV_END(builders_buffer);
+
+    RB_GC_GUARD(names);
+    RB_GC_GUARD(vectors);
+    return vectors;
+}
+
+/*
+ * call-seq:
+ *      result.each { |tuple| ... }
+ *      result.each_row { |tuple| ... }
+ *      result.each_row -> enumerator
+ *
+ * Invokes the block for each tuple in the result set.
+ *
+ * Tuples are fetched from the cursor and yielded one at a time as they arrive,
+ * they are not retained by the result; memory use therefore stays flat however
+ * large the result set is. As the cursor is forward-only the result may only
+ * be iterated once, unless #rows was called beforehand in which case the rows
+ * it returned are iterated instead.
+ *
+ * With #prefetch set the rows are fetched in batches by a background thread,
+ * see #prefetch=.
+ *
+ *      connection.prepare select_dml do |select|
+ *          ...
+ *          if select.execute
+ *              select.results.each do |row|
+ *                  ...
+ *              end
+ *          end
+ *      end
+ */
+static VALUE
+nuodb_result_each(VALUE self)
+{
+    trace("nuodb_result_each");
+
+    RETURN_ENUMERATOR(self, 0, 0);
+
+    nuodb_result_handle * handle = nuodb_result_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        VALUE rows = rb_iv_get(self, "@rows");
+        if (!NIL_P(rows))
+        {
+            for (int i = 0; i < RARRAY_LEN(rows); i++)
+            {
+                rb_yield(rb_ary_entry(rows, i));
+            }
+            return self;
+        }
+
+        if (handle->prefetch > 0 && nuodb_result_each_prefetch(handle))
+        {
+            return self;
+        }
+
+        // n.b. rb_yield must never be called from within the try block, a
+        // non-local exit from the block would otherwise unwind past the C++
+        // frames without running their destructors.
+        while (nuodb_result_next(handle))
+        {
+            VALUE row = Qnil;
+            try
+            {
+                row = nuodb_result_current_row(handle);
+            }
+            catch (SQLException & e)
+            {
+                rb_raise_nuodb_error(e.getSqlcode(), "Failed to decode the row: %s", e.getText());
+            }
+            rb_yield(row);
+        }
+        return self;
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: result handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *      result.prefetch = rows
+ *
+ * Sets the number of rows fetched per batch by #each, or disables
+ * prefetching if +nil+ or 0, which is the default.
+ *
+ * When prefetching, a background thread advances the cursor and stages the
+ * next batch of rows while the block is run for the rows of the previous
+ * batch, overlapping the network round trips with the work of the block.
+ * The connection is in use for the whole iteration: the block must not use
+ * it, nor this result, or an ArgumentError is raised, and other threads
+ * using the connection wait until the iteration ends. Rows already fetched
+ * are discarded if the iteration stops early.
+ *
+ *      results = statement.results
+ *      results.prefetch = 500
+ *      results.each do |row|
+ *          ...
+ *      end
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE
+nuodb_result_set_prefetch(VALUE self, VALUE rows)
+{
+    trace("nuodb_result_set_prefetch");
+    nuodb_result_handle * handle = nuodb_result_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        if (NIL_P(rows))
+        {
+            handle->prefetch = 0;
+        }
+        else
+        {
+            if (TYPE(rows) != T_FIXNUM)
+            {
+                rb_raise(rb_eTypeError, "wrong prefetch argument type %s (Integer expected)", rb_class2name(CLASS_OF(rows)));
+            }
+            long size = FIX2LONG(rows);
+            if (size < 0)
+            {
+                rb_raise(rb_eArgError, "prefetch must not be negative");
+            }
+            handle->prefetch = (size_t) size;
+        }
+        return rows;
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: result handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *      result.prefetch -> int or nil
+ *
+ * Returns the number of rows fetched per batch by #each, or +nil+ if
+ * prefetching is disabled.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE
+nuodb_result_prefetch_get(VALUE self)
+{
+    trace("nuodb_result_prefetch_get");
+    nuodb_result_handle * handle = nuodb_result_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        return handle->prefetch > 0 ? ULONG2NUM(handle->prefetch) : Qnil;
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: result handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *      result.estimated_round_trips -> int or nil
+ *
+ * Returns an estimate of the round trips to the transaction engine taken to
+ * fetch the rows so far, or +nil+ if the fetch size is left to the client;
+ * see Statement#fetch_size=. The client neither reports its round trips nor
+ * when it refills its cursor, so this is not an observed count: it is the
+ * number of cursor advances so far, including the last one finding no more
+ * rows, divided by the fetch size and rounded up. It matches the round trips
+ * taken when the transaction engine fills every batch to the fetch size.
+ *
+ *      statement.fetch_size = 100
+ *      statement.execute 'select * from players'
+ *      results = statement.results
+ *      results.each { |row| ... }
+ *      results.estimated_round_trips #=> 3, for 250 rows
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE
+nuodb_result_estimated_round_trips(VALUE self)
+{
+    trace("nuodb_result_estimated_round_trips");
+    nuodb_result_handle * handle = nuodb_result_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        if (handle->fetch_size <= 0)
+        {
+            return Qnil;
+        }
+        size_t fetch_size = (size_t) handle->fetch_size;
+        return ULONG2NUM((handle->fetched + fetch_size - 1) / fetch_size);
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: result handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *      result.fetch_size -> int
+ *
+ * Returns the number of rows the client fetches per round trip, 0 if left to
+ * the client.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE
+nuodb_result_fetch_size(VALUE self)
+{
+    trace("nuodb_result_fetch_size");
+    nuodb_result_handle * handle = nuodb_result_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        return INT2NUM(handle->fetch_size);
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: result handle nil");
+    }
+    return Qnil;
+}
+
+//------------------------------------------------------------------------------
+// arrow IPC
+
+/*
+ * A minimal FlatBuffers builder for the Arrow IPC metadata. Like the reference
+ * builder it assembles the buffer back to front, children before parents, so
+ * objects are referred to by their offset from the end of the buffer. Scalars
+ * are written in host byte order, which the schema records.
+ */
+class nuodb_flatbuffer
+{
+public:
+    nuodb_flatbuffer() : max_align(1), table_start(0)
+    {
+    }
+
+    void clear()
+    {
+        bytes.clear();
+        max_align = 1;
+    }
+
+    size_t size() const
+    {
+        return bytes.size();
+    }
+
+    template<typename T>
+    size_t prepend(T value)
+    {
+        prealign(sizeof(T), sizeof(T));
+        bytes.insert(0, reinterpret_cast<char const *>(&value), sizeof(T));
+        return size();
+    }
+
+    size_t prepend_offset(size_t ref)
+    {
+        prealign(4, 4);
+        return prepend<uint32_t>((uint32_t) (size() + 4 - ref));
+    }
+
+    size_t create_string(char const * text, size_t length)
+    {
+        prealign(length + 1, 4);
+        bytes.insert(0, 1, '\0');
+        bytes.insert(0, text, length);
+        return prepend<uint32_t>((uint32_t) length);
+    }
+
+    size_t create_offset_vector(std::vector<size_t> const & refs)
+    {
+        for (size_t i = refs.size(); i-- > 0;)
+        {
+            prepend_offset(refs[i]);
+        }
+        return prepend<uint32_t>((uint32_t) refs.size());
+    }
+
+    // a vector of structs of two longs, as FieldNode and Buffer are
+    size_t create_pair_vector(std::vector<std::pair<int64_t, int64_t> > const & pairs)
+    {
+        prealign(pairs.size() * 16, 4);
+        prealign(pairs.size() * 16, 8);
+        for (size_t i = pairs.size(); i-- > 0;)
+        {
+            prepend<int64_t>(pairs[i].second);
+            prepend<int64_t>(pairs[i].first);
+        }
+        return prepend<uint32_t>((uint32_t) pairs.size());
+    }
+
+    void start_table()
+    {
+        fields.clear();
+        table_start = size();
+    }
+
+    template<typename T>
+    void add_scalar(int id, T value)
+    {
+        fields.push_back(std::make_pair(id, prepend(value)));
+    }
+
+    void add_offset(int id, size_t ref)
+    {
+        fields.push_back(std::make_pair(id, prepend_offset(ref)));
+    }
+
+    size_t end_table()
+    {
+        size_t table = prepend<int32_t>(0);
+        int field_count = 0;
+        for (size_t i = 0; i < fields.size(); ++i)
+        {
+            field_count = fields[i].first + 1 > field_count ? fields[i].first + 1 : field_count;
+        }
+        std::vector<uint16_t> vtable(field_count, 0);
+        for (size_t i = 0; i < fields.size(); ++i)
+        {
+            vtable[fields[i].first] = (uint16_t) (table - fields[i].second);
+        }
+        for (int i = field_count; i-- > 0;)
+        {
+            prepend<uint16_t>(vtable[i]);
+        }
+        prepend<uint16_t>((uint16_t) (table - table_start));
+        size_t vtable_offset = prepend<uint16_t>((uint16_t) (4 + 2 * field_count));
+
+        // the table refers to its vtable, which precedes it
+        int32_t relative = (int32_t) (vtable_offset - table);
+        memcpy(&bytes[size() - table], &relative, sizeof(relative));
+        return table;
+    }
+
+    std::string const & finish(size_t root)
+    {
+        prealign(4, max_align < 8 ? 8 : max_align);
+        prepend_offset(root);
+        return bytes;
+    }
+
+    std::string const & finished() const
+    {
+        return bytes;
+    }
+
+private:
+    // pads so that the size is aligned once length more bytes are prepended
+    void prealign(size_t length, size_t alignment)
+    {
+        size_t misalignment = (size() + length) % alignment;
+        if (misalignment != 0)
+        {
+            bytes.insert(0, alignment - misalignment, '\0');
+        }
+        max_align = alignment > max_align ? alignment : max_align;
+    }
+
+    std::string bytes;
+    size_t max_align;
+    size_t table_start;
+    std::vector<std::pair<int, size_t> > fields;
+};
+
+// from Schema.fbs and Message.fbs, format version 1.x
+static const short NUODB_ARROW_METADATA_V5 = 4;
+static const unsigned char NUODB_ARROW_HEADER_SCHEMA = 1;
+static const unsigned char NUODB_ARROW_HEADER_RECORD_BATCH = 3;
+
+enum nuodb_arrow_type
+{
+    NUODB_ARROW_INT = 2,
+    NUODB_ARROW_FLOATING_POINT = 3,
+    NUODB_ARROW_BINARY = 4,
+    NUODB_ARROW_UTF8 = 5,
+    NUODB_ARROW_BOOL = 6,
+    NUODB_ARROW_DECIMAL = 7,
+    NUODB_ARROW_DATE = 8,
+    NUODB_ARROW_TIMESTAMP = 10
+};
+
+/*
+ * The buffers of one column of the record batch being written: the validity
+ * bitmap, the offsets of variable length values and the values.
+ */
+struct nuodb_arrow_column
+{
+    SqlType type;
+    nuodb_arrow_type arrow_type;
+    int bit_width;
+    int precision;
+    int scale;
+    bool nullable;
+    std::string name;
+
+    std::string validity;
+    std::string offsets;
+    std::string data;
+    int64_t null_count;
+};
+
+struct nuodb_arrow_writer
+{
+    nuodb_result_handle * handle;
+    VALUE io;
+    size_t batch_size;
+    std::vector<nuodb_arrow_column> columns;
+    size_t batch_rows;
+    size_t rows;
+    nuodb_flatbuffer metadata;
+};
+
+/*
+ * The outcome of appending a value to the buffers of a column.
+ */
+enum nuodb_arrow_append_result
+{
+    NUODB_ARROW_APPENDED,
+    NUODB_ARROW_NOT_A_NUMBER,
+    NUODB_ARROW_DECIMAL_OVERFLOW,
+    NUODB_ARROW_OFFSET_OVERFLOW
+};
+
+static
+void nuodb_arrow_column_describe(nuodb_arrow_column & column)
+{
+    column.bit_width = 0;
+    switch (column.type)
+    {
+        case NUOSQL_TINYINT:
+            column.arrow_type = NUODB_ARROW_INT;
+            column.bit_width = 8;
+            break;
+        case NUOSQL_SMALLINT:
+            column.arrow_type = NUODB_ARROW_INT;
+            column.bit_width = 16;
+            break;
+        case NUOSQL_INTEGER:
+            column.arrow_type = NUODB_ARROW_INT;
+            column.bit_width = 32;
+            break;
+        case NUOSQL_BIGINT:
+            column.arrow_type = NUODB_ARROW_INT;
+            column.bit_width = 64;
+            break;
+        case NUOSQL_FLOAT:
+        case NUOSQL_DOUBLE:
+            column.arrow_type = NUODB_ARROW_FLOATING_POINT;
+            column.bit_width = 64;
+            break;
+        case NUOSQL_BIT:
+        case NUOSQL_BOOLEAN:
+            column.arrow_type = NUODB_ARROW_BOOL;
+            break;
+        case NUOSQL_BLOB:
+        case NUOSQL_BINARY:
+        case NUOSQL_LONGVARBINARY:
+            column.arrow_type = NUODB_ARROW_BINARY;
+            break;
+        case NUOSQL_DATE:
+            column.arrow_type = NUODB_ARROW_DATE;
+            column.bit_width = 32;
+            break;
+        case NUOSQL_TIME:
+        case NUOSQL_TIMESTAMP:
+            column.arrow_type = NUODB_ARROW_TIMESTAMP;
+            column.bit_width = 64;
+            break;
+        case NUOSQL_NUMERIC:
+        case NUOSQL_DECIMAL:
+            column.arrow_type = NUODB_ARROW_DECIMAL;
+            column.bit_width = 128;
+            if (column.precision <= 0 || column.precision > 38)
+            {
+                column.precision = 38;
+            }
+            break;
+        default:
+            // as text, which every type converts to
+            column.arrow_type = NUODB_ARROW_UTF8;
+            break;
+    }
+}
+
+/*
+ * Parses the decimal text into the 128-bit two's complement integer scaled by
+ * 10^scale, truncating excess fraction digits; fails if the text is not a
+ * number or the value exceeds 38 digits.
+ */
+static nuodb_arrow_append_result
+nuodb_decimal128_parse(char const * text, int scale, uint64_t & low, uint64_t & high)
+{
+    while (isspace((unsigned char) *text))
+    {
+        text++;
+    }
+    bool negative = *text == '-';
+    if (*text == '-' || *text == '+')
+    {
+        text++;
+    }
+
+    std::string digits;
+    long exponent = 0;
+    bool fraction = false;
+    for (; *text != '\0'; ++text)
+    {
+        if (isdigit((unsigned char) *text))
+        {
+            digits.push_back(*text);
+            exponent -= fraction ? 1 : 0;
+        }
+        else if (*text == '.' && !fraction)
+        {
+            fraction = true;
+        }
+        else if (*text == 'e' || *text == 'E')
+        {
+            char * end = NULL;
+            exponent += strtol(text + 1, &end, 10);
+            text = end;
+            break;
+        }
+        else
+        {
+            break;
+        }
+    }
+    while (isspace((unsigned char) *text))
+    {
+        text++;
+    }
+    if (digits.empty() || *text != '\0')
+    {
+        return NUODB_ARROW_NOT_A_NUMBER;
+    }
+
+    long shift = exponent + scale;
+    if (shift < 0)
+    {
+        digits.resize(-shift < (long) digits.size() ? digits.size() + shift : 0);
+    }
+    else
+    {
+        digits.append(shift, '0');
+    }
+    size_t first = digits.find_first_not_of('0');
+    if (first != std::string::npos && digits.size() - first > 38)
+    {
+        return NUODB_ARROW_DECIMAL_OVERFLOW;
+    }
+
+    low = 0;
+    high = 0;
+    for (size_t i = 0; i < digits.size(); ++i)
+    {
+        // (high, low) = (high, low) * 10 + digit, in 32-bit halves
+        uint64_t lower = (low & 0xffffffffULL) * 10 + (digits[i] - '0');
+        uint64_t upper = (low >> 32) * 10 + (lower >> 32);
+        low = (upper << 32) | (lower & 0xffffffffULL);
+        high = high * 10 + (upper >> 32);
+    }
+    if (negative)
+    {
+        low = ~low + 1;
+        high = ~high + (low == 0 ? 1 : 0);
+    }
+    return NUODB_ARROW_APPENDED;
+}
+
+static
+void nuodb_arrow_append_bit(std::string & bitmap, size_t index, bool bit)
+{
+    if (index % 8 == 0)
+    {
+        bitmap.push_back('\0');
+    }
+    if (bit)
+    {
+        bitmap[index / 8] |= (char) (1 << (index % 8));
+    }
+}
+
+template<typename T>
+void nuodb_arrow_append(std::string & buffer, T value)
+{
+    buffer.append(reinterpret_cast<char const *>(&value), sizeof(value));
+}
+
+/*
+ * Appends the variable length value and its end offset; returns false,
+ * appending nothing, if the values would exceed the 2 GiB that the int32
+ * offsets address.
+ */
+static bool
+nuodb_arrow_append_variable(nuodb_arrow_column & column, char const * data, size_t length)
+{
+    if (length > (size_t) INT32_MAX - column.data.size())
+    {
+        return false;
+    }
+    if (length > 0)
+    {
+        column.data.append(data, length);
+    }
+    nuodb_arrow_append<int32_t>(column.offsets, (int32_t) column.data.size());
+    return true;
+}
+
+/*
+ * Appends the value of the column of the current row to the buffers, read
+ * with the getter of its type; fails, appending nothing, if a decimal does
+ * not parse or fit, or if variable length values exceed the 2 GiB that the
+ * int32 offsets address.
+ */
+static nuodb_arrow_append_result
+nuodb_arrow_column_append(nuodb_arrow_column & column, int index, ResultSet * results, size_t row)
+{
+    bool valid = false;
+    switch (column.arrow_type)
+    {
+        case NUODB_ARROW_INT:
+        {
+            int64_t field = column.bit_width == 64 ? results->getLong(index) : results->getInt(index);
+            valid = !results->wasNull();
+            switch (column.bit_width)
+            {
+                case 8:
+                    nuodb_arrow_append<int8_t>(column.data, valid ? (int8_t) field : 0);
+                    break;
+                case 16:
+                    nuodb_arrow_append<int16_t>(column.data, valid ? (int16_t) field : 0);
+                    break;
+                case 32:
+                    nuodb_arrow_append<int32_t>(column.data, valid ? (int32_t) field : 0);
+                    break;
+                default:
+                    nuodb_arrow_append<int64_t>(column.data, valid ? field : 0);
+                    break;
+            }
+            break;
+        }
+        case NUODB_ARROW_FLOATING_POINT:
+        {
+            double field = results->getDouble(index);
+            valid = !results->wasNull();
+            nuodb_arrow_append<double>(column.data, valid ? field : 0);
+            break;
+        }
+        case NUODB_ARROW_BOOL:
+        {
+            bool field = false;
+            // see nuodb_fetch_value<NUOSQL_BOOLEAN>
+            try
+            {
+                field = results->getBoolean(index);
+                valid = !results->wasNull();
+            }
+            catch (SQLException & e)
+            {
+            }
+            nuodb_arrow_append_bit(column.data, row, valid && field);
+            break;
+        }
+        case NUODB_ARROW_BINARY:
+        {
+            Bytes field = results->getBytes(index);
+            valid = !results->wasNull();
+            if (!nuodb_arrow_append_variable(column, reinterpret_cast<char const *>(field.data), valid ? field.length : 0))
+            {
+                return NUODB_ARROW_OFFSET_OVERFLOW;
+            }
+            break;
+        }
+        case NUODB_ARROW_UTF8:
+        {
+            bool appended = false;
+            if (nuodb_sql_type_family(column.type) == NUOSQL_VARCHAR)
+            {
+                Bytes field = results->getBytes(index);
+                valid = !results->wasNull();
+                appended = nuodb_arrow_append_variable(column, reinterpret_cast<char const *>(field.data), valid ? field.length : 0);
+            }
+            else
+            {
+                char const * field = results->getString(index);
+                valid = !results->wasNull();
+                appended = nuodb_arrow_append_variable(column, field, valid ? strlen(field) : 0);
+            }
+            if (!appended)
+            {
+                return NUODB_ARROW_OFFSET_OVERFLOW;
+            }
+            break;
+        }
+        case NUODB_ARROW_DATE:
+        {
+            NuoDB::Date * field = results->getDate(index);
+            valid = !results->wasNull();
+            int64_t seconds = valid ? field->getSeconds() : 0;
+            int64_t days = seconds / 86400 - (seconds % 86400 < 0 ? 1 : 0);
+            nuodb_arrow_append<int32_t>(column.data, (int32_t) days);
+            break;
+        }
+        case NUODB_ARROW_TIMESTAMP:
+        {
+            NuoDB::Timestamp * field = results->getTimestamp(index);
+            valid = !results->wasNull();
+            nuodb_arrow_append<int64_t>(column.data, valid ? field->getSeconds() * 1000000000LL + field->getNanos() : 0);
+            break;
+        }
+        case NUODB_ARROW_DECIMAL:
+        {
+            char const * field = results->getString(index);
+            valid = !results->wasNull();
+            uint64_t low = 0;
+            uint64_t high = 0;
+            if (valid)
+            {
+                nuodb_arrow_append_result parsed = nuodb_decimal128_parse(field, column.scale, low, high);
+                if (parsed != NUODB_ARROW_APPENDED)
+                {
+                    return parsed;
+                }
+            }
+            nuodb_arrow_append<uint64_t>(column.data, low);
+            nuodb_arrow_append<uint64_t>(column.data, high);
+            break;
+        }
+    }
+    nuodb_arrow_append_bit(column.validity, row, valid);
+    column.null_count += valid ? 0 : 1;
+    return NUODB_ARROW_APPENDED;
+}
+
+static
+void nuodb_arrow_column_reset(nuodb_arrow_column & column)
+{
+    column.validity.clear();
+    column.offsets.clear();
+    column.data.clear();
+    column.null_count = 0;
+    if (column.arrow_type == NUODB_ARROW_BINARY || column.arrow_type == NUODB_ARROW_UTF8)
+    {
+        nuodb_arrow_append<int32_t>(column.offsets, 0);
+    }
+}
+
+static char const nuodb_arrow_padding[8] = { 0 };
+
+/*
+ * Returns the encapsulated message for the metadata just built, padded to 8
+ * bytes, with room for the body of that length to be appended in place.
+ */
+static
+VALUE nuodb_arrow_message_new(nuodb_arrow_writer * writer, size_t body_length)
+{
+    std::string const & metadata = writer->metadata.finished();
+    size_t padded = (metadata.size() + 7) & ~((size_t) 7);
+    uint32_t continuation = 0xFFFFFFFFU;
+    int32_t length = (int32_t) padded;
+    VALUE message = rb_str_buf_new((long) (8 + padded + body_length));
+    rb_str_buf_cat(message, reinterpret_cast<char const *>(&continuation), sizeof(continuation));
+    rb_str_buf_cat(message, reinterpret_cast<char const *>(&length), sizeof(length));
+    rb_str_buf_cat(message, metadata.data(), (long) metadata.size());
+    rb_str_buf_cat(message, nuodb_arrow_padding, (long) (padded - metadata.size()));
+    return message;
+}
+
+/*
+ * Appends the buffer to the body of the message, padded to 8 bytes.
+ */
+static
+void nuodb_arrow_message_append(VALUE message, std::string const & buffer)
+{
+    rb_str_buf_cat(message, buffer.data(), (long) buffer.size());
+    rb_str_buf_cat(message, nuodb_arrow_padding, (long) (((buffer.size() + 7) & ~((size_t) 7)) - buffer.size()));
+}
+
+static
+size_t nuodb_arrow_type_table(nuodb_flatbuffer & fb, nuodb_arrow_column const & column)
+{
+    size_t utc = column.arrow_type == NUODB_ARROW_TIMESTAMP ? fb.create_string("UTC", 3) : 0;
+    fb.start_table();
+    switch (column.arrow_type)
+    {
+        case NUODB_ARROW_INT:
+            fb.add_scalar<int32_t>(0, column.bit_width);
+            fb.add_scalar<uint8_t>(1, 1);
+            break;
+        case NUODB_ARROW_FLOATING_POINT:
+            fb.add_scalar<int16_t>(0, 2);
+            break;
+        case NUODB_ARROW_DECIMAL:
+            fb.add_scalar<int32_t>(0, column.precision);
+            fb.add_scalar<int32_t>(1, column.scale);
+            fb.add_scalar<int32_t>(2, 128);
+            break;
+        case NUODB_ARROW_DATE:
+            // n.b. DAY, the default being MILLISECOND
+            fb.add_scalar<int16_t>(0, 0);
+            break;
+        case NUODB_ARROW_TIMESTAMP:
+            fb.add_scalar<int16_t>(0, 3);
+            fb.add_offset(1, utc);
+            break;
+        default:
+            break;
+    }
+    return fb.end_table();
+}
+
+static
+size_t nuodb_arrow_message_table(nuodb_flatbuffer & fb, unsigned char header_type, size_t header, int64_t body_length)
+{
+    fb.start_table();
+    fb.add_scalar<int64_t>(3, body_length);
+    fb.add_offset(2, header);
+    fb.add_scalar<int16_t>(0, NUODB_ARROW_METADATA_V5);
+    fb.add_scalar<uint8_t>(1, header_type);
+    return fb.end_table();
+}
+
+/*
+ * Builds the schema message metadata; as the message is written by the
+ * caller no Ruby call is made while the vectors here are alive.
+ */
+static
+void nuodb_arrow_build_schema(nuodb_arrow_writer * writer)
+{
+    nuodb_flatbuffer & fb = writer->metadata;
+    fb.clear();
+
+    std::vector<size_t> fields;
+    std::vector<size_t> none;
+    for (size_t i = 0; i < writer->columns.size(); ++i)
+    {
+        nuodb_arrow_column const & column = writer->columns[i];
+        size_t name = fb.create_string(column.name.data(), column.name.size());
+        size_t type = nuodb_arrow_type_table(fb, column);
+        size_t children = fb.create_offset_vector(none);
+        fb.start_table();
+        fb.add_offset(0, name);
+        fb.add_offset(3, type);
+        fb.add_offset(5, children);
+        fb.add_scalar<uint8_t>(1, column.nullable ? 1 : 0);
+        fb.add_scalar<uint8_t>(2, (uint8_t) column.arrow_type);
+        fields.push_back(fb.end_table());
+    }
+    size_t field_vector = fb.create_offset_vector(fields);
+
+    uint16_t probe = 1;
+    bool big_endian = *reinterpret_cast<unsigned char *>(&probe) == 0;
+    fb.start_table();
+    fb.add_offset(1, field_vector);
+    fb.add_scalar<int16_t>(0, big_endian ? 1 : 0);
+    size_t schema = fb.end_table();
+
+    size_t message = nuodb_arrow_message_table(fb, NUODB_ARROW_HEADER_SCHEMA, schema, 0);
+    fb.finish(message);
+}
+
+static
+void nuodb_arrow_write_schema(nuodb_arrow_writer * writer)
+{
+    nuodb_arrow_build_schema(writer);
+    rb_funcall(writer->io, id_write, 1, nuodb_arrow_message_new(writer, 0));
+}
+
+static
+void nuodb_arrow_add_buffer(size_t & body_length, std::vector<std::pair<int64_t, int64_t> > & buffers, std::string const & buffer)
+{
+    buffers.push_back(std::make_pair((int64_t) body_length, (int64_t) buffer.size()));
+    body_length += (buffer.size() + 7) & ~((size_t) 7);
+}
+
+/*
+ * Builds the record batch message metadata, laying out the column buffers
+ * in the body; returns the body length. As for the schema no Ruby call is
+ * made here.
+ */
+static
+size_t nuodb_arrow_build_batch(nuodb_arrow_writer * writer)
+{
+    std::vector<std::pair<int64_t, int64_t> > nodes;
+    std::vector<std::pair<int64_t, int64_t> > buffers;
+    size_t body_length = 0;
+    for (size_t i = 0; i < writer->columns.size(); ++i)
+    {
+        nuodb_arrow_column const & column = writer->columns[i];
+        nodes.push_back(std::make_pair((int64_t) writer->batch_rows, column.null_count));
+        nuodb_arrow_add_buffer(body_length, buffers, column.validity);
+        if (column.arrow_type == NUODB_ARROW_BINARY || column.arrow_type == NUODB_ARROW_UTF8)
+        {
+            nuodb_arrow_add_buffer(body_length, buffers, column.offsets);
+        }
+        nuodb_arrow_add_buffer(body_length, buffers, column.data);
+    }
+
+    nuodb_flatbuffer & fb = writer->metadata;
+    fb.clear();
+    size_t buffer_vector = fb.create_pair_vector(buffers);
+    size_t node_vector = fb.create_pair_vector(nodes);
+    fb.start_table();
+    fb.add_scalar<int64_t>(0, (int64_t) writer->batch_rows);
+    fb.add_offset(1, node_vector);
+    fb.add_offset(2, buffer_vector);
+    size_t batch = fb.end_table();
+
+    size_t message = nuodb_arrow_message_table(fb, NUODB_ARROW_HEADER_RECORD_BATCH, batch, (int64_t) body_length);
+    fb.finish(message);
+    return body_length;
+}
+
+/*
+ * Writes the record batch to the IO in one write, its buffers copied once,
+ * straight into the message.
+ */
+static
+void nuodb_arrow_write_batch(nuodb_arrow_writer * writer)
+{
+    VALUE message = nuodb_arrow_message_new(writer, nuodb_arrow_build_batch(writer));
+    for (size_t i = 0; i < writer->columns.size(); ++i)
+    {
+        nuodb_arrow_column & column = writer->columns[i];
+        nuodb_arrow_message_append(message, column.validity);
+        if (column.arrow_type == NUODB_ARROW_BINARY || column.arrow_type == NUODB_ARROW_UTF8)
+        {
+            nuodb_arrow_message_append(message, column.offsets);
+        }
+        nuodb_arrow_message_append(message, column.data);
+        nuodb_arrow_column_reset(column);
+    }
+    writer->batch_rows = 0;
+    rb_funcall(writer->io, id_write, 1, message);
+}
+
+static
+VALUE nuodb_arrow_write(VALUE data)
+{
+    nuodb_arrow_writer * writer = reinterpret_cast<nuodb_arrow_writer *>(data);
+    nuodb_result_handle * handle = writer->handle;
+    ResultSet * results = handle->pointer;
+
+    try
+    {
+        ResultSetMetaData * metadata = results->getMetaData();
+        int column_count = metadata->getColumnCount();
+        writer->columns.resize(column_count);
+        for (int i = 0; i < column_count; ++i)
+        {
+            nuodb_arrow_column & column = writer->columns[i];
+            column.type = (SqlType) metadata->getColumnType(i + 1);
+            column.precision = metadata->getPrecision(i + 1);
+            column.scale = metadata->getScale(i + 1);
+            column.nullable = metadata->isNullable(i + 1);
+            char const * label = metadata->getColumnLabel(i + 1);
+            column.name = label != NULL ? label : "";
+            nuodb_arrow_column_describe(column);
+            nuodb_arrow_column_reset(column);
+        }
+    }
+    catch (SQLException & e)
+    {
+        rb_raise_nuodb_error(e.getSqlcode(), "Failed to describe the columns: %s", e.getText());
+    }
+
+    nuodb_arrow_write_schema(writer);
+    while (nuodb_result_next(handle))
+    {
+        nuodb_arrow_append_result appended = NUODB_ARROW_APPENDED;
+        size_t i = 0;
+        try
+        {
+            for (; i < writer->columns.size() && appended == NUODB_ARROW_APPENDED; ++i)
+            {
+                appended = nuodb_arrow_column_append(writer->columns[i], (int) i + 1, results, writer->batch_rows);
+            }
+        }
+        catch (SQLException & e)
+        {
+            rb_raise_nuodb_error(e.getSqlcode(), "Failed to decode the row: %s", e.getText());
+        }
+        switch (appended)
+        {
+            case NUODB_ARROW_NOT_A_NUMBER:
+                rb_raise(rb_eArgError, "value of column %d does not parse as a decimal", (int) i);
+                break;
+            case NUODB_ARROW_DECIMAL_OVERFLOW:
+                rb_raise(rb_eRangeError, "value of column %d does not fit decimal128", (int) i);
+                break;
+            case NUODB_ARROW_OFFSET_OVERFLOW:
+                rb_raise(rb_eRangeError, "values of column %d exceed 2 GiB in a batch, use a smaller :batch_size", (int) i);
+                break;
+            default:
+                break;
+        }
+        writer->batch_rows++;
+        writer->rows++;
+        if (writer->batch_rows == writer->batch_size)
+        {
+            nuodb_arrow_write_batch(writer);
+        }
+    }
+    if (writer->batch_rows > 0)
+    {
+        nuodb_arrow_write_batch(writer);
+    }
+
+    // end of stream
+    static char const end_of_stream[8] = { '\xFF', '\xFF', '\xFF', '\xFF', 0, 0, 0, 0 };
+    rb_funcall(writer->io, id_write, 1, rb_str_new(end_of_stream, sizeof(end_of_stream)));
+
+    return ULONG2NUM(writer->rows);
+}
+
+static
+VALUE nuodb_arrow_write_ensure(VALUE data)
+{
+    delete reinterpret_cast<nuodb_arrow_writer *>(data);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *      result.to_arrow_ipc(io, options = {}) -> int
+ *
+ * Writes the rows to the IO in the Apache Arrow IPC streaming format and
+ * returns the number of rows written. The rows are fetched from the cursor
+ * and packed into record batches as they arrive, of up to :batch_size rows
+ * (default 65536), without creating a Ruby object per value; each message
+ * is written to the IO as soon as it is complete.
+ *
+ * Integers map to int8 through int64, doubles to float64, booleans to bool,
+ * strings to utf8, binary values to binary, dates to date32, times and
+ * timestamps to timestamp[ns, UTC] and numerics to decimal128 of the column
+ * precision and scale. Values of other types are written as utf8.
+ *
+ *      File.open('players.arrows', 'wb') do |io|
+ *          statement.results.to_arrow_ipc(io, :batch_size => 10000)
+ *      end
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE
+nuodb_result_to_arrow_ipc(int argc, VALUE * argv, VALUE self)
+{
+    trace("nuodb_result_to_arrow_ipc");
+
+    VALUE io, options;
+    rb_scan_args(argc, argv, "11", &io, &options);
+
+    size_t batch_size = 65536;
+    if (!NIL_P(options))
+    {
+        Check_Type(options, T_HASH);
+        batch_size = nuodb_size_option(options, sym_batch_size, batch_size);
+        if (batch_size == 0)
+        {
+            rb_raise(rb_eArgError, "batch_size must be positive");
+        }
+    }
+
+    nuodb_result_handle * handle = nuodb_result_get(self);
+    if (handle == NULL || handle->pointer == NULL)
+    {
+        rb_raise(rb_eArgError, "invalid state: result handle nil");
+    }
+
+    nuodb_arrow_writer * writer = new nuodb_arrow_writer();
+    writer->handle = handle;
+    writer->io = io;
+    writer->batch_size = batch_size;
+    writer->batch_rows = 0;
+    writer->rows = 0;
+    VALUE rows = rb_ensure(nuodb_arrow_write, reinterpret_cast<VALUE>(writer),
+            nuodb_arrow_write_ensure, reinterpret_cast<VALUE>(writer));
+    RB_GC_GUARD(io);
+    return rows;
+}
+
+static
+VALUE nuodb_result_write_arrow_close(VALUE file)
+{
+    return rb_funcall(file, id_close, 0);
+}
+
+struct nuodb_write_arrow_args
+{
+    VALUE self;
+    VALUE file;
+    VALUE options;
+};
+
+static
+VALUE nuodb_result_write_arrow_file(VALUE data)
+{
+    nuodb_write_arrow_args * args = reinterpret_cast<nuodb_write_arrow_args *>(data);
+    VALUE argv[2] = { args->file, args->options };
+    return nuodb_result_to_arrow_ipc(2, argv, args->self);
+}
+
+/*
+ * call-seq:
+ *      result.write_arrow(path, options = {}) -> int
+ *
+ * Writes the rows to the file at the path in the Apache Arrow IPC streaming
+ * format, see #to_arrow_ipc, and returns the number of rows written.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE
+nuodb_result_write_arrow(int argc, VALUE * argv, VALUE self)
+{
+    trace("nuodb_result_write_arrow");
+
+    VALUE path, options;
+    rb_scan_args(argc, argv, "11", &path, &options);
+
+    nuodb_write_arrow_args args;
+    args.self = self;
+    args.options = options;
+    args.file = rb_funcall(rb_cFile, id_open, 2, path, rb_str_new2("wb"));
+    return rb_ensure(nuodb_result_write_arrow_file, reinterpret_cast<VALUE>(&args),
+            nuodb_result_write_arrow_close, args.file);
+}
+
+static
+void nuodb_define_result_api()
+{
+    /*
+     * A Result object maintains a connection to a specific database. SQL
+     * statements are executed and results are returned within the context of
+     * a connection.
+     */
+    sym_batch_size = ID2SYM(rb_intern("batch_size"));
+
+    nuodb_result_klass = rb_define_class_under(m_nuodb, "Result", rb_cObject);
+    rb_include_module(nuodb_result_klass, rb_mEnumerable);
+
+    rb_define_attr(nuodb_result_klass, "columns", 1, 0);
+    rb_define_attr(nuodb_result_klass, "rows", 1, 0);
+
+    // DBI
+
+    rb_define_method(nuodb_result_klass, "each", RUBY_METHOD_FUNC(nuodb_result_each), 0);
+    rb_define_method(nuodb_result_klass, "each_row", RUBY_METHOD_FUNC(nuodb_result_each), 0);
+    rb_define_method(nuodb_result_klass, "columns", RUBY_METHOD_FUNC(nuodb_result_columns), 0);
+    rb_define_method(nuodb_result_klass, "rows", RUBY_METHOD_FUNC(nuodb_result_rows), 0);
+
+    // NUODB EXTENSIONS
+
+    rb_define_method(nuodb_result_klass, "prefetch=", RUBY_METHOD_FUNC(nuodb_result_set_prefetch), 1);
+    rb_define_method(nuodb_result_klass, "prefetch", RUBY_METHOD_FUNC(nuodb_result_prefetch_get), 0);
+    rb_define_method(nuodb_result_klass, "fetch_size", RUBY_METHOD_FUNC(nuodb_result_fetch_size), 0);
+    rb_define_method(nuodb_result_klass, "estimated_round_trips", RUBY_METHOD_FUNC(nuodb_result_estimated_round_trips), 0);
+    rb_define_method(nuodb_result_klass, "columnar", RUBY_METHOD_FUNC(nuodb_result_columnar), 0);
+    rb_define_method(nuodb_result_klass, "to_arrow_ipc", RUBY_METHOD_FUNC(nuodb_result_to_arrow_ipc), -1);
+    rb_define_method(nuodb_result_klass, "write_arrow", RUBY_METHOD_FUNC(nuodb_result_write_arrow), -1);
+    //rb_define_method(nuodb_result_klass, "finish", RUBY_METHOD_FUNC(nuodb_result_finish), 0);
+}
+
+//------------------------------------------------------------------------------
+
+static
+VALUE nuodb_statement_free_protect(VALUE value)
+{
+    trace("nuodb_statement_free_protect");
+    nuodb_statement_handle * handle = reinterpret_cast<nuodb_statement_handle*>(value);
+    if (handle != NULL)
+    {
+        nuodb_handle_abandon_inherited(handle);
+        if (handle->pointer != NULL)
+        {
+            try
+            {
+                log(INFO, "closing statement");
+                handle->pointer->close();
+                handle->pointer = NULL;
+            }
+            catch (SQLException & e)
+            {
+                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close statement: %s", e.getText());
+            }
+        }
+    }
+    return Qnil;
+}
+
+static
+void nuodb_statement_free(void * ptr)
+{
+    trace("nuodb_statement_free");
+    if (ptr != NULL)
+    {
+        int exception = 0;
+        rb_protect(nuodb_statement_free_protect, reinterpret_cast<VALUE>(ptr), &exception);
+        if (exception)
+        {
+            rb_jump_tag(exception);
+        }
+    }
+}
+
+static
+void nuodb_statement_mark(void * ptr)
+{
+    trace("nuodb_statement_mark");
+
+    nuodb_statement_handle * handle = static_cast<nuodb_statement_handle *>(ptr);
+    rb_gc_mark(handle->parent);
+}
+
+static
+void nuodb_statement_decr_reference_count(void * ptr)
+{
+    trace("nuodb_statement_decr_reference_count");
+    decr_reference_count(static_cast<nuodb_statement_handle *>(ptr));
+}
+
+/*
+ * call-seq:
+ *  finish()
+ *
+ * Releases the statement and any associated resources.
+ */
+static
+VALUE nuodb_statement_finish(VALUE self)
+{
+    trace("nuodb_statement_finish");
+    nuodb_statement_handle * handle = cast_handle<nuodb_statement_handle>(self);//reinterpret_cast<nuodb_statement_handle*>(value);
+    nuodb_statement_free(handle);
+//    if (handle != NULL)
+//    {
+//        if (handle->pointer != NULL)
+//        {
+//            try
+//            {
+//                log(INFO, "closing statement");
+//                handle->pointer->close();
+//                handle->pointer = NULL;
+//            }
+//            catch (SQLException & e)
+//            {
+//                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close statement: %s", e.getText());
+//            }
+//        }
+//    }
+    return Qnil;
+//
+//    if (ENABLE_CLOSE_HOOK)
+//    {
+//        nuodb_statement_handle * handle = cast_handle<nuodb_statement_handle>(self);
+//        if (handle != NULL && handle->pointer != NULL)
+//        {
+//            nuodb_statement_decr_reference_count(handle);
+//        }
+//        else
+//        {
+//            rb_raise(rb_eArgError, "invalid state: statement handle nil");
+//        }
+//    }
+//    return Qnil;
+}
+
+static
+NuoDB::Statement * nuodb_statement_create(nuodb_connection_handle * parent_handle)
+{
+    nuodb_create_statement_call call;
+    call.connection = parent_handle->pointer;
+    call.query_timeout = parent_handle->query_timeout;
+    call.fetch_size = parent_handle->fetch_size;
+    call.statement = NULL;
+    nuodb_call_without_gvl(parent_handle, call);
+    if (call.failed)
+    {
+        log(ERROR, "rb_raise");
+        rb_raise_nuodb_error(call.error_code, "Failed to create statement: %s", call.error_text);
+    }
+    return call.statement;
+}
+
+/*
+ * Returns the statement's handle, creating the statement afresh should its
+ * resilient connection have reconnected since.
+ */
+static
+nuodb_statement_handle * nuodb_statement_get(VALUE self)
+{
+    nuodb_statement_handle * handle = cast_handle<nuodb_statement_handle>(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_connection_handle * parent_handle = static_cast<nuodb_connection_handle *>(handle->parent_handle);
+        if (parent_handle->resilient && (parent_handle->deferred ||
+                parent_handle->session != handle->session || handle->pid != nuodb_current_pid))
+        {
+            parent_handle = nuodb_connection_get(handle->parent);
+            NuoDB::Statement * statement = nuodb_statement_create(parent_handle);
+            nuodb_handle_abandon_inherited(handle);
+            if (handle->pointer != NULL)
+            {
+                try
+                {
+                    handle->pointer->close();
+                }
+                catch (SQLException & e)
+                {
+                    // the session is gone
+                }
+            }
+            handle->pointer = statement;
+            handle->pid = nuodb_current_pid;
+            handle->session = parent_handle->session;
+            nuodb_statement_reapply_settings(handle);
+        }
+    }
+    return handle;
+}
+
+static
+VALUE nuodb_statement_initialize(VALUE parent)
+{
+    trace("nuodb_statement_initialize");
+
+    nuodb_connection_handle * parent_handle = nuodb_connection_get(parent);
+    if (parent_handle != NULL && parent_handle->pointer != NULL)
+    {
+        NuoDB::Statement * statement = nuodb_statement_create(parent_handle);
+
+        nuodb_statement_handle * handle = ALLOC(nuodb_statement_handle);
+
+        handle->free_func = RUBY_DATA_FUNC(&nuodb_statement_free);
+        handle->atomic = 0;
+        handle->pid = nuodb_current_pid;
+        handle->parent = parent;
+        handle->parent_handle = parent_handle;
+        handle->pointer = statement;
+        handle->session = parent_handle->session;
+        handle->query_timeout = -1;
+        handle->fetch_size = -1;
+        handle->max_rows = -1;
+        incr_reference_count(handle);
+        assert(handle->atomic = 1);
+        VALUE self = Data_Wrap_Struct(nuodb_statement_klass, nuodb_statement_mark, nuodb_statement_decr_reference_count, handle);
+        if (!rb_block_given_p()) {
+            trace("nuodb_statement_initialize: no block");
+            track_ref_count("ALLOC STMT S", cast_handle<nuodb_handle>(self));
+            return self;
+        }
+
+        trace("nuodb_statement_initialize: begin block");
+
+        int exception = 0;
+        VALUE result = rb_protect(rb_yield, self, &exception);
+
+        trace("nuodb_statement_initialize: end block");
+
+        // n.b. don't do this as it may introduce crashes of the ruby process !!!
+        //nuodb_statement_finish(self);
+
+        trace("nuodb_statement_initialize: auto finish");
+
+        if (exception)
+        {
+            rb_jump_tag(exception);
+        }
+        else
+        {
+            return result;
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  execute(sql) -> Bool
+ *
+ * Executes a statement.
+ *
+ * Returns true if the result is a Result object; returns false if the result is
+ * an update count or there is no result. For the latter case, count() should be
+ * called next, for the former case each() should be called.
+ */
+static
+VALUE nuodb_statement_execute(VALUE self, VALUE sql)
+{
+    if (TYPE(sql) != T_STRING)
+    {
+        rb_raise(rb_eTypeError, "wrong sql argument type %s (String expected)", rb_class2name(CLASS_OF(sql)));
+    }
+
+    nuodb_statement_handle * handle = nuodb_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        // the statement text must not change while the GVL is released
+        VALUE sql_text = rb_str_new_frozen(sql);
+
+        nuodb_handle_check_owner(handle, "statement");
+
+        nuodb_connection_handle * parent_handle = static_cast<nuodb_connection_handle *>(handle->parent_handle);
+        for (int attempt = 0; ; ++attempt)
+        {
+            nuodb_execute_call call;
+            call.statement = handle->pointer;
+            call.sql = StringValueCStr(sql_text);
+            call.result = false;
+            nuodb_call_without_gvl(parent_handle, call);
+            if (!call.failed)
+            {
+                RB_GC_GUARD(sql_text);
+                return AS_QBOOL(call.result);
+            }
+            if (internal_connection_recover(parent_handle, call.error_code) && attempt == 0 &&
+                    parent_handle->autocommit && nuodb_sql_is_read(RSTRING_PTR(sql_text), RSTRING_LEN(sql_text)))
+            {
+                // queries that only read are retried once on the new session
+                handle = nuodb_statement_get(self);
+                continue;
+            }
+            rb_raise_nuodb_error(call.error_code, "Failed to execute SQL statement: %s", call.error_text);
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  count() -> Number
+ *
+ * Returns the update count for an update statement.
+ */
+static
+VALUE nuodb_statement_update_count(VALUE self)
+{
+    trace("nuodb_statement_update_count");
+
+    nuodb_statement_handle * handle = nuodb_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        return INT2NUM(nuodb_statement_update_count_of(handle, "Failed to get the update count for the statement"));
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  results() -> Results
+ *
+ * Retrieves a result set containing rows for the related query.
+ */
+static VALUE nuodb_statement_results(VALUE self)
+{
+    trace("nuodb_statement_results");
+
+    nuodb_statement_handle * handle = nuodb_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        ResultSet * results = nuodb_statement_result_set_of(handle, false, "Failed to get the result set for the statement");
+        return nuodb_result_alloc(self, results, handle->pointer);
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  generated_keys() -> Results
+ *
+ * Retrieves a result set containing the generated keys related to the
+ * previously executed insert.
+ */
+static VALUE nuodb_statement_generated_keys(VALUE self)
+{
+    trace("nuodb_statement_generated_keys");
+
+    nuodb_statement_handle * handle = nuodb_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        ResultSet * results = nuodb_statement_result_set_of(handle, true, "Failed to get the generated keys for the statement");
+        // this hack should not have been necessary; it should never have
+        // returned null, this is a product defect.
+        if (results != NULL)
+        {
+            return nuodb_result_alloc(self, results, handle->pointer);
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+    }
+    return Qnil;
+}
+
+static
+void nuodb_define_statement_api()
+{
+    /*
+     * Document-class: NuoDB::Statement
+     *
+     * A Statement object maintains a connection to a specific database. SQL
+     * statements are executed and results are returned within the context of
+     * a connection.
+     */
+    nuodb_statement_klass = rb_define_class_under(m_nuodb, "Statement", rb_cObject);
+
+    // DBI
+
+    rb_define_method(nuodb_statement_klass, "execute", RUBY_METHOD_FUNC(nuodb_statement_execute), 1);
+    //rb_define_method(nuodb_statement_klass, "finish", RUBY_METHOD_FUNC(nuodb_statement_finish), 0);
+
+    // NUODB EXTENSIONS
+
+    rb_define_method(nuodb_statement_klass, "cancel", RUBY_METHOD_FUNC(nuodb_statement_cancel<nuodb_statement_handle>), 0);
+    rb_define_method(nuodb_statement_klass, "count", RUBY_METHOD_FUNC(nuodb_statement_update_count), 0);
+    rb_define_method(nuodb_statement_klass, "generated_keys", RUBY_METHOD_FUNC(nuodb_statement_generated_keys), 0);
+    rb_define_method(nuodb_statement_klass, "results", RUBY_METHOD_FUNC(nuodb_statement_results), 0);
+    rb_define_method(nuodb_statement_klass, "timeout", RUBY_METHOD_FUNC(nuodb_statement_timeout_get<nuodb_statement_handle>), 0);
+    rb_define_method(nuodb_statement_klass, "timeout=", RUBY_METHOD_FUNC(nuodb_statement_timeout_set<nuodb_statement_handle>), 1);
+    rb_define_method(nuodb_statement_klass, "fetch_size", RUBY_METHOD_FUNC(nuodb_statement_fetch_size_get<nuodb_statement_handle>), 0);
+    rb_define_method(nuodb_statement_klass, "fetch_size=", RUBY_METHOD_FUNC(nuodb_statement_fetch_size_set<nuodb_statement_handle>), 1);
+    rb_define_method(nuodb_statement_klass, "max_rows", RUBY_METHOD_FUNC(nuodb_statement_max_rows_get<nuodb_statement_handle>), 0);
+    rb_define_method(nuodb_statement_klass, "max_rows=", RUBY_METHOD_FUNC(nuodb_statement_max_rows_set<nuodb_statement_handle>), 1);
+}
+
+//------------------------------------------------------------------------------
+
+static
+VALUE nuodb_prepared_statement_free_protect(VALUE value)
+{
+    trace("nuodb_prepared_statement_free_protect");
+    nuodb_prepared_statement_handle * handle = reinterpret_cast<nuodb_prepared_statement_handle *>(value);
+    track_ref_count("PS FREE PROTECT", handle);
+    if (handle != NULL)
+    {
+        delete handle->parameter_plan;
+        handle->parameter_plan = NULL;
+        nuodb_handle_abandon_inherited(handle);
+        if (handle->pointer != NULL)
+        {
+            try
+            {
+                log(INFO, "closing prepared statement");
+                handle->pointer->close();
+                handle->pointer = NULL;
+            }
+            catch (SQLException & e)
+            {
+                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close statement: %s", e.getText());
+            }
+        }
+    }
+    return Qnil;
+}
+
+static
+void nuodb_prepared_statement_free(void * ptr)
+{
+    trace("nuodb_prepared_statement_free");
+
+    if (ptr != NULL)
+    {
+        int exception = 0;
+        rb_protect(nuodb_prepared_statement_free_protect, reinterpret_cast<VALUE>(ptr), &exception);
+        if (exception)
+        {
+            rb_jump_tag(exception);
+        }
+    }
+}
+
+static
+void nuodb_prepared_statement_mark(void * ptr)
+{
+    trace("nuodb_prepared_statement_mark");
+
+    nuodb_prepared_statement_handle * handle = static_cast<nuodb_prepared_statement_handle *>(ptr);
+    rb_gc_mark(handle->parent);
+    rb_gc_mark(handle->sql);
+    rb_gc_mark(handle->bindings);
+}
+
+static
+void nuodb_prepared_statement_decr_reference_count(nuodb_handle * handle)
+{
+    trace("nuodb_prepared_statement_decr_reference_count");
+    decr_reference_count(handle);
+}
+
+/*
+ * call-seq:
+ *  finish()
+ *
+ * Releases the prepared statement and any associated resources.
+ */
+static
+VALUE nuodb_prepared_statement_finish(VALUE self)
+{
+    trace("nuodb_prepared_statement_finish");
+    nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(self);//reinterpret_cast<nuodb_prepared_statement_handle *>(value);
+    track_ref_count("FINISH PSTMT", handle);
+    nuodb_prepared_statement_free(handle);
+//    if (handle != NULL)
+//    {
+//        if (handle->pointer != NULL)
+//        {
+//            try
+//            {
+//                track_ref_count("CLOSE PSTMT", handle);
+//                log(INFO, "closing prepared statement");
+//                handle->pointer->close();
+//                handle->pointer = NULL;
+//            }
+//            catch (SQLException & e)
+//            {
+//                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close statement: %s", e.getText());
+//            }
+//        }
+//    }
+    return Qnil;
+//
+//    if (ENABLE_CLOSE_HOOK)
+//    {
+//        nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(self);
+//        if (handle != NULL && handle->pointer != NULL)
+//        {
+//            nuodb_prepared_statement_decr_reference_count(handle);
+//        }
+//        else
+//        {
+//            rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+//        }
+//    }
+//    return Qnil;
+}
+
+static
+NuoDB::PreparedStatement * nuodb_prepared_statement_create(nuodb_connection_handle * parent_handle, VALUE sql, bool generated_keys)
+{
+    nuodb_prepare_call call;
+    call.connection = parent_handle->pointer;
+    call.sql = StringValueCStr(sql);
+    call.generated_keys = generated_keys;
+    call.query_timeout = parent_handle->query_timeout;
+    call.fetch_size = parent_handle->fetch_size;
+    call.statement = NULL;
+    nuodb_call_without_gvl(parent_handle, call);
+    if (call.failed)
+    {
+        rb_raise_nuodb_error(call.error_code, "Failed to create prepared statement (%s): %s", StringValueCStr(sql), call.error_text);
+    }
+    RB_GC_GUARD(sql);
+    return call.statement;
+}
+
+static
+VALUE nuodb_prepared_statement_alloc(VALUE parent, nuodb_connection_handle * parent_handle, VALUE sql, bool generated_keys)
+{
+    trace("nuodb_prepared_statement_alloc");
+
+    VALUE sql_text = rb_str_new_frozen(sql);
+    NuoDB::PreparedStatement * statement = nuodb_prepared_statement_create(parent_handle, sql_text, generated_keys);
+
+    nuodb_prepared_statement_handle * handle = ALLOC(struct nuodb_prepared_statement_handle);
+    handle->free_func = RUBY_DATA_FUNC(&nuodb_prepared_statement_free);
+    handle->atomic = 0;
+    handle->pid = nuodb_current_pid;
+    handle->parent = parent;
+    handle->parent_handle = parent_handle;
+    handle->pointer = statement;
+    handle->parameter_plan = NULL;
+    handle->batch_size = 0;
+    handle->session = parent_handle->session;
+    handle->sql = sql_text;
+    handle->generated_keys = generated_keys;
+    handle->read_only = nuodb_sql_is_read(RSTRING_PTR(sql_text), RSTRING_LEN(sql_text));
+    handle->bindings = Qnil;
+    handle->query_timeout = -1;
+    handle->fetch_size = -1;
+    handle->max_rows = -1;
+    incr_reference_count(handle);
+    assert(handle->atomic == 1);
+    return Data_Wrap_Struct(nuodb_prepared_statement_klass, nuodb_prepared_statement_mark, nuodb_prepared_statement_decr_reference_count, handle);
+}
+
+/*
+ * Readies a cached prepared statement for reuse; returns false if the
+ * statement is no longer usable.
+ */
+static
+bool nuodb_prepared_statement_reset(VALUE statement)
+{
+    nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(statement);
+    if (handle == NULL || handle->pointer == NULL)
+    {
+        return false;
+    }
+    nuodb_connection_handle * parent_handle = static_cast<nuodb_connection_handle *>(handle->parent_handle);
+    bool settings = handle->query_timeout >= 0 || handle->fetch_size >= 0 || handle->max_rows >= 0;
+    handle->query_timeout = -1;
+    handle->fetch_size = -1;
+    handle->max_rows = -1;
+    handle->bindings = Qnil;
+    if (parent_handle->session != handle->session || handle->pid != nuodb_current_pid)
+    {
+        // the statement is prepared again, unbound and with the connection
+        // defaults, on next use
+        handle->batch_size = 0;
+        return true;
+    }
+    nuodb_prepared_reset_call call;
+    call.statement = handle->pointer;
+    call.clear_batch = handle->batch_size > 0;
+    call.query_timeout = settings ? parent_handle->query_timeout : -1;
+    call.fetch_size = parent_handle->fetch_size;
+    call.max_rows = 0;
+    handle->batch_size = 0;
+    nuodb_call_without_gvl(parent_handle, call);
+    return !call.failed;
+}
+
+/*
+ * Looks the statement up in the connection's statement cache and, on a hit,
+ * returns the reset statement marked most recently used; returns nil on a
+ * miss, or if the cached statement is lent out to a prepare block.
+ */
+static
+VALUE nuodb_statement_cache_lookup(nuodb_statement_cache * cache, std::string const & key)
+{
+    std::map<std::string, nuodb_statement_cache::entry_list::iterator>::iterator found = cache->index.find(key);
+    if (found != cache->index.end())
+    {
+        nuodb_statement_cache::entry_list::iterator entry = found->second;
+        if (!entry->in_use)
+        {
+            if (nuodb_prepared_statement_reset(entry->statement))
+            {
+                cache->entries.splice(cache->entries.begin(), cache->entries, entry);
+                cache->hits++;
+                return entry->statement;
+            }
+            cache->index.erase(found);
+            cache->entries.erase(entry);
+        }
+    }
+    cache->misses++;
+    return Qnil;
+}
+
+/*
+ * Adds the statement to the connection's statement cache as most recently
+ * used, evicting least recently used statements not in use while over
+ * capacity. Evicted statements are released once no longer referenced.
+ */
+static
+void nuodb_statement_cache_insert(nuodb_statement_cache * cache, std::string const & key, VALUE statement)
+{
+    if (cache->index.find(key) != cache->index.end())
+    {
+        // the cached statement is lent out, keep it
+        return;
+    }
+
+    nuodb_statement_cache_entry entry;
+    entry.key = key;
+    entry.statement = statement;
+    entry.in_use = false;
+    cache->entries.push_front(entry);
+    cache->index[key] = cache->entries.begin();
+
+    nuodb_statement_cache::entry_list::iterator candidate = cache->entries.end();
+    while (cache->entries.size() > cache->capacity && candidate != cache->entries.begin())
+    {
+        --candidate;
+        if (!candidate->in_use)
+        {
+            cache->index.erase(candidate->key);
+            candidate = cache->entries.erase(candidate);
+            cache->evictions++;
+        }
+    }
+}
+
+static
+void nuodb_statement_cache_lend(nuodb_statement_cache * cache, std::string const & key, VALUE statement, bool in_use)
+{
+    std::map<std::string, nuodb_statement_cache::entry_list::iterator>::iterator found = cache->index.find(key);
+    if (found != cache->index.end() && found->second->statement == statement)
+    {
+        found->second->in_use = in_use;
+    }
+}
+
+static
+VALUE nuodb_prepared_statement_initialize(VALUE parent, VALUE sql, bool generated_keys)
+{
+    trace("nuodb_prepared_statement_initialize");
+
+    if (TYPE(sql) != T_STRING)
+    {
+        rb_raise(rb_eTypeError, "wrong sql argument type %s (String expected)", rb_class2name(CLASS_OF(sql)));
+    }
+
+    nuodb_connection_handle * parent_handle = nuodb_connection_get(parent);
+    if (parent_handle != NULL && parent_handle->pointer != NULL)
+    {
+        // only statements lent to a block are cached, as the cache cannot
+        // tell when the caller is done with a statement returned to it
+        nuodb_statement_cache * cache = rb_block_given_p() ? parent_handle->statement_cache : NULL;
+        std::string key;
+        VALUE self = Qnil;
+        if (cache != NULL)
+        {
+            key.assign(RSTRING_PTR(sql), RSTRING_LEN(sql));
+            key.push_back('\0');
+            key.push_back(generated_keys ? '1' : '0');
+            self = nuodb_statement_cache_lookup(cache, key);
+        }
+        if (NIL_P(self))
+        {
+            self = nuodb_prepared_statement_alloc(parent, parent_handle, sql, generated_keys);
+            if (cache != NULL)
+            {
+                nuodb_statement_cache_insert(cache, key, self);
+            }
+        }
+
+        if (!rb_block_given_p()) {
+            trace("nuodb_prepared_statement_initialize: no block");
+
+            return self;
+        }
+
+        trace("nuodb_prepared_statement_initialize: begin block");
+
+        if (cache != NULL)
+        {
+            nuodb_statement_cache_lend(cache, key, self, true);
+        }
+
+        int exception = 0;
+        VALUE result = rb_protect(rb_yield, self, &exception);
+
+        trace("nuodb_prepared_statement_initialize: end block");
+
+        // the cache may have been cleared, or the connection closed, meanwhile
+        cache = parent_handle->statement_cache;
+        if (cache != NULL)
+        {
+            nuodb_statement_cache_lend(cache, key, self, false);
+        }
+
+        // n.b. don't do this as it may introduce crashes of the ruby process !!!
+        //nuodb_prepared_statement_finish(self);
+
+        trace("nuodb_prepared_statement_initialize: auto finish");
+
+        if (exception)
+        {
+            rb_jump_tag(exception);
+        }
+        else
+        {
+            return result;
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    return Qnil;
+}
+
+static
+void raise_unsupported_type_at_index(char const * type_name, int32_t index)
+{
+    rb_raise(rb_eTypeError, "unsupported type %s at %d", type_name, index);
+}
+
+/*
+ * Returns the parameter plan for the prepared statement, building it from the
+ * parameter metadata on first use. Parameters whose type the client does not
+ * report are planned as NUOSQL_NULL and bound by their Ruby type alone.
+ */
+static nuodb_parameter_plan *
+nuodb_prepared_statement_parameter_plan(nuodb_prepared_statement_handle * handle)
+{
+    if (handle->parameter_plan == NULL)
+    {
+        // n.b. the plan hangs off the handle before the call, which may raise
+        nuodb_parameter_plan * plan = new nuodb_parameter_plan();
+        handle->parameter_plan = plan;
+        nuodb_parameter_types_call call;
+        call.statement = handle->pointer;
+        call.types = &plan->types;
+        nuodb_call_without_gvl(static_cast<nuodb_connection_handle *>(handle->parent_handle), call);
+        if (call.failed)
+        {
+            plan->types.clear();
+        }
+    }
+    return handle->parameter_plan;
+}
+
+static inline SqlType
+nuodb_parameter_plan_type(nuodb_parameter_plan const * plan, int32_t index)
+{
+    if (index > 0 && (size_t) index <= plan->types.size())
+    {
+        return plan->types[index - 1];
+    }
+    return NUOSQL_NULL;
+}
+
+/*
+ * Binds the value to the parameter using the setter appropriate for both the
+ * value's Ruby type and the parameter's planned SQL type. May throw an
+ * SQLException.
+ */
+static
+void nuodb_bind_value(NuoDB::PreparedStatement * statement, SqlType type, int32_t index, VALUE value)
+{
+    switch (TYPE(value))
+    {
+    case T_FLOAT: // 0x04
+        {
+            statement->setDouble(index, NUM2DBL(value));
+        }
+        break;
+    case T_STRING: // 0x05
+        {
+            // binary parameters and strings holding NUL bytes are bound with
+            // their length, lest they be cut at the first NUL
+            char const * real_value = RSTRING_PTR(value);
+            long length = RSTRING_LEN(value);
+            if (nuodb_sql_type_binary(type) || memchr(real_value, '\0', length) != NULL)
+            {
+                statement->setBytes(index, (int) length, real_value);
+            }
+            else
+            {
+                statement->setString(index, StringValueCStr(value));
+            }
+        }
+        break;
+    case T_NIL: // 0x11
+        {
+            statement->setNull(index, type);
+        }
+        break;
+    case T_TRUE: // 0x12
+        {
+            statement->setBoolean(index, true);
+        }
+        break;
+    case T_FALSE: // 0x13
+        {
+            statement->setBoolean(index, false);
+        }
+        break;
+    case T_FIXNUM: // 0x15
+        {
+            switch (type)
+            {
+            case NUOSQL_TINYINT:
+            case NUOSQL_SMALLINT:
+            case NUOSQL_INTEGER:
+                {
+                    long real_value = FIX2LONG(value);
+                    if (real_value >= INT_MIN && real_value <= INT_MAX)
+                    {
+                        statement->setInt(index, (int) real_value);
+                    }
+                    else
+                    {
+                        // let the database report the overflow
+                        statement->setLong(index, real_value);
+                    }
+                }
+                break;
+            case NUOSQL_FLOAT:
+            case NUOSQL_DOUBLE:
+                statement->setDouble(index, (double) FIX2LONG(value));
+                break;
+            default:
+                statement->setLong(index, FIX2LONG(value));
+                break;
+            }
+        }
+        break;
+    case T_DATA: // 0x22
+        {
+            if (rb_obj_is_instance_of(value, rb_cTime))
+            {
+                VALUE sec = rb_funcall(value, id_tv_sec, 0);
+                //VALUE offset = rb_funcall(value, rb_intern("utc_offset"), 0);
+                VALUE usec = rb_funcall(value, id_tv_usec, 0);
+                SqlTimestamp sqlTimestamp(NUM2INT(sec), NUM2INT(usec) * 1000); //  + NUM2INT(offset)
+                statement->setTimestamp(index, &sqlTimestamp);
+                break;
+            }
+            // a Date can only be bound once the date library is loaded
+            if ((!NIL_P(c_date) || rb_const_defined(rb_cObject, id_date))
+                && rb_obj_is_instance_of(value, nuodb_registry_class(&c_date, rb_cObject, "date", id_date)))
+            {
+                VALUE time = rb_funcall(value, id_to_time, 0);
+                VALUE sec = rb_funcall(time, id_tv_sec, 0);
+                //VALUE offset = rb_funcall(time, rb_intern("utc_offset"), 0);
+                VALUE usec = rb_funcall(time, id_tv_usec, 0);
+                SqlTimestamp sqlTimestamp(NUM2LONG(sec), NUM2INT(usec) * 1000);//  + NUM2INT(offset)
+                statement->setTimestamp(index, &sqlTimestamp);
+                break;
+            }
+            break;
+        }
+    case T_OBJECT: // 0x01
+        {
+            log(WARN, "unsupported: T_OBJECT");
+            raise_unsupported_type_at_index("T_OBJECT", index);
+        }
+        break;
+    case T_BIGNUM: // 0x0a
+        {
+            int64_t real_value = NUM2LL(value);
+            statement->setLong(index, real_value);
+        }
+        break;
+    case T_ARRAY: // 0x07
+        {
+            log(WARN, "unsupported: T_ARRAY");
+            raise_unsupported_type_at_index("T_ARRAY", index);
+        }
+        break;
+    case T_HASH: // 0x08
+        {
+            log(WARN, "unsupported: T_HASH");
+            raise_unsupported_type_at_index("T_HASH", index);
+        }
+        break;
+    case T_STRUCT: // 0x09
+        {
+            log(WARN, "unsupported: T_STRUCT");
+            raise_unsupported_type_at_index("T_STRUCT", index);
+        }
+        break;
+    case T_FILE: // 0x0e
+        {
+            log(WARN, "unsupported: T_FILE");
+            raise_unsupported_type_at_index("T_FILE", index);
+        }
+        break;
+    case T_MATCH: // 0x23
+        {
+            log(WARN, "unsupported: T_MATCH");
+            raise_unsupported_type_at_index("T_MATCH", index);
+        }
+        break;
+    case T_SYMBOL: // 0x24
+        {
+            log(WARN, "unsupported: T_SYMBOL");
+            raise_unsupported_type_at_index("T_SYMBOL", index);
+            break;
+        }
+        break;
+    default:
+        rb_raise(rb_eTypeError, "unsupported type: %d", TYPE(value));
+        break;
+    }
+}
+
+/*
+ * Records the value bound on a resilient connection, to bind it again should
+ * the statement be prepared again.
+ */
+static void
+nuodb_prepared_statement_record(nuodb_prepared_statement_handle * handle, int32_t index, VALUE value)
+{
+    if (static_cast<nuodb_connection_handle *>(handle->parent_handle)->resilient && index > 0)
+    {
+        if (NIL_P(handle->bindings))
+        {
+            handle->bindings = rb_ary_new();
+        }
+        rb_ary_store(handle->bindings, index - 1, value);
+    }
+}
+
+/*
+ * Returns the prepared statement's handle, preparing the statement again, and
+ * binding its recorded values again, should its resilient connection have
+ * reconnected since. Batched values are lost with the session.
+ */
+static
+nuodb_prepared_statement_handle * nuodb_prepared_statement_get(VALUE self)
+{
+    nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_connection_handle * parent_handle = static_cast<nuodb_connection_handle *>(handle->parent_handle);
+        if (parent_handle->resilient && (parent_handle->deferred ||
+                parent_handle->session != handle->session || handle->pid != nuodb_current_pid))
+        {
+            parent_handle = nuodb_connection_get(handle->parent);
+            NuoDB::PreparedStatement * statement = nuodb_prepared_statement_create(parent_handle, handle->sql, handle->generated_keys);
+            nuodb_handle_abandon_inherited(handle);
+            if (handle->pointer != NULL)
+            {
+                try
+                {
+                    handle->pointer->close();
+                }
+                catch (SQLException & e)
+                {
+                    // the session is gone
+                }
+            }
+            handle->pointer = statement;
+            handle->pid = nuodb_current_pid;
+            handle->session = parent_handle->session;
+            handle->batch_size = 0;
+            delete handle->parameter_plan;
+            handle->parameter_plan = NULL;
+            nuodb_statement_reapply_settings(handle);
+
+            if (!NIL_P(handle->bindings))
+            {
+                nuodb_parameter_plan * plan = nuodb_prepared_statement_parameter_plan(handle);
+                int32_t index = 0;
+                try
+                {
+                    for (index = 1; index < RARRAY_LEN(handle->bindings) + 1; ++index)
+                    {
+                        nuodb_bind_value(statement, nuodb_parameter_plan_type(plan, index), index,
+                                rb_ary_entry(handle->bindings, index - 1));
+                    }
+                }
+                catch (SQLException & e)
+                {
+                    rb_raise_nuodb_error(e.getSqlcode(), "Failed to set prepared statement parameter %d: %s",
+                                         index, e.getText());
+                }
+            }
+        }
+    }
+    return handle;
+}
+
+/*
+ * call-seq:
+ *  bind_param(param, value)
+ *
+ * Attempts to bind the value to this statement as the parameter number specified.
+ *
+ *  connection.prepare insert_dml do |statement|
+ *      statement.bind_param(1, "Joe Smith")
+ *      statement.execute
+ *  end  #=> implicit statement.finish
+ */
+static
+VALUE nuodb_prepared_statement_bind_param(VALUE self, VALUE param, VALUE value)
+{
+    trace("nuodb_prepared_statement_bind_param");
+
+    if (TYPE(param) != T_FIXNUM)
+    {
+        rb_raise(rb_eTypeError, "index must be a number");
+    }
+    int32_t index = NUM2UINT(param);
+
+    nuodb_prepared_statement_handle * handle = nuodb_prepared_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_parameter_plan * plan = nuodb_prepared_statement_parameter_plan(handle);
+        try
+        {
+            nuodb_bind_value(handle->pointer, nuodb_parameter_plan_type(plan, index), index, value);
+            nuodb_prepared_statement_record(handle, index, value);
+        }
+        catch (SQLException & e)
+        {
+            rb_raise_nuodb_error(e.getSqlcode(), "Failed to set prepared statement parameter %d: %s",
+                                 index, e.getText());
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  bind_params(binds)
+ *  bind_params(*binds)
+ *
+ * Binds the list of values successively, starting with the first parameter.
+ * The values may be given either as a single array or as separate arguments.
+ *
+ *  connection.prepare insert_dml do |statement|
+ *      statement.bind_params([56, 6.7, "String", Date.new(2001, 12, 3), Time.new])
+ *      statement.execute
+ *  end  #=> implicit statement.finish
+ */
+static
+VALUE nuodb_prepared_statement_bind_params(int argc, VALUE * argv, VALUE self)
+{
+    trace("nuodb_prepared_statement_bind_params");
+
+    long count = argc;
+    VALUE const * values = argv;
+    VALUE array = Qnil;
+    if (argc == 1 && TYPE(argv[0]) == T_ARRAY)
+    {
+        array = argv[0];
+        count = RARRAY_LEN(array);
+        values = RARRAY_PTR(array);
+    }
+
+    nuodb_prepared_statement_handle * handle = nuodb_prepared_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_parameter_plan * plan = nuodb_prepared_statement_parameter_plan(handle);
+        PreparedStatement * statement = handle->pointer;
+        int32_t index = 0;
+        try
+        {
+            for (index = 1; index < count + 1; ++index)
+            {
+                nuodb_bind_value(statement, nuodb_parameter_plan_type(plan, index), index, values[index - 1]);
+                nuodb_prepared_statement_record(handle, index, values[index - 1]);
+            }
+        }
+        catch (SQLException & e)
+        {
+            rb_raise_nuodb_error(e.getSqlcode(), "Failed to set prepared statement parameter %d: %s",
+                                 index, e.getText());
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    RB_GC_GUARD(array);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  execute() -> Bool
+ *
+ * Executes a prepared statement. Returns true if the result is a Result object;
+ * returns false if the result is an update count or there is no result. For the
+ * latter case, count() should be called next, for the former case each() should
+ * be called.
+ */
+static
+VALUE nuodb_prepared_statement_execute(VALUE self)
+{
+    trace("nuodb_prepared_statement_execute");
+
+    nuodb_prepared_statement_handle * handle = nuodb_prepared_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_handle_check_owner(handle, "prepared statement");
+
+        nuodb_connection_handle * parent_handle = static_cast<nuodb_connection_handle *>(handle->parent_handle);
+        for (int attempt = 0; ; ++attempt)
+        {
+            nuodb_prepared_execute_call call;
+            call.statement = handle->pointer;
+            call.result = false;
+            nuodb_call_without_gvl(parent_handle, call);
+            if (!call.failed)
+            {
+                return AS_QBOOL(call.result);
+            }
+            if (internal_connection_recover(parent_handle, call.error_code) && attempt == 0 &&
+                    parent_handle->autocommit && handle->read_only)
+            {
+                // queries that only read are retried once on the new session
+                handle = nuodb_prepared_statement_get(self);
+                continue;
+            }
+            rb_raise_nuodb_error(call.error_code, "Failed to execute SQL prepared statement: %s", call.error_text);
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  count() -> Number
+ *
+ * Returns the update count for an update statement.
+ */
+static
+VALUE nuodb_prepared_statement_update_count(VALUE self)
+{
+    trace("nuodb_prepared_statement_update_count");
+
+    nuodb_prepared_statement_handle * handle = nuodb_prepared_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        return INT2NUM(nuodb_statement_update_count_of(handle, "Failed to get the update count for the prepared statement"));
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  results() -> Results
+ *
+ * Retrieves a result set containing rows for the related query.
+ */
+static VALUE nuodb_prepared_statement_results(VALUE self)
+{
+    trace("nuodb_prepared_statement_results");
+
+    nuodb_prepared_statement_handle * handle = nuodb_prepared_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        ResultSet * results = nuodb_statement_result_set_of(handle, false, "Failed to get the result set for the prepared statement");
+        return nuodb_result_alloc(self, results, handle->pointer);
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  generated_keys() -> Results
+ *
+ * Retrieves a result set containing the generated keys related to the
+ * previously executed insert.
+ */
+static VALUE nuodb_prepared_statement_generated_keys(VALUE self)
+{
+    trace("nuodb_prepared_statement_generated_keys");
+
+    nuodb_prepared_statement_handle * handle = nuodb_prepared_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        ResultSet * results = nuodb_statement_result_set_of(handle, true, "Failed to get the generated keys for the prepared statement");
+        // this hack should not have been necessary; it should never have
+        // returned null, this is a product defect.
+        if (results != NULL)
+        {
+            return nuodb_result_alloc(self, results, handle->pointer);
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  add_batch()
+ *
+ * Adds the currently bound parameters to the statement's batch of commands.
+ *
+ *  connection.prepare insert_dml do |statement|
+ *      rows.each do |row|
+ *          statement.bind_params(row)
+ *          statement.add_batch
+ *      end
+ *      statement.execute_batch  #=> [1, 1, ...]
+ *  end
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static
+VALUE nuodb_prepared_statement_add_batch(VALUE self)
+{
+    trace("nuodb_prepared_statement_add_batch");
+
+    nuodb_prepared_statement_handle * handle = nuodb_prepared_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        try
+        {
+            handle->pointer->addBatch();
+            handle->batch_size++;
+        }
+        catch (SQLException & e)
+        {
+            rb_raise_nuodb_error(e.getSqlcode(), "Failed to add the parameters to the batch: %s", e.getText());
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  clear_batch()
+ *
+ * Discards the statement's batch of commands.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static
+VALUE nuodb_prepared_statement_clear_batch(VALUE self)
+{
+    trace("nuodb_prepared_statement_clear_batch");
+
+    nuodb_prepared_statement_handle * handle = nuodb_prepared_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        try
+        {
+            handle->batch_size = 0;
+            handle->pointer->clearBatch();
+        }
+        catch (SQLException & e)
+        {
+            rb_raise_nuodb_error(e.getSqlcode(), "Failed to clear the batch: %s", e.getText());
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    return Qnil;
+}
+
+static
+VALUE nuodb_prepared_statement_run_batch(VALUE self, nuodb_prepared_statement_handle * handle, VALUE generated_keys)
+{
+    nuodb_handle_check_owner(handle, "prepared statement");
+
+    int batch_size = handle->batch_size;
+    handle->batch_size = 0;
+
+    nuodb_execute_batch_call call;
+    call.statement = handle->pointer;
+    call.counts = NULL;
+    nuodb_call_without_gvl(static_cast<nuodb_connection_handle *>(handle->parent_handle), call);
+    if (call.failed)
+    {
+        try
+        {
+            handle->pointer->clearBatch();
+        }
+        catch (SQLException & e)
+        {
+            // the batch failure is the one reported
+        }
+        internal_connection_recover(static_cast<nuodb_connection_handle *>(handle->parent_handle), call.error_code);
+        rb_raise_nuodb_error(call.error_code, "Failed to execute the batch: %s", call.error_text);
+    }
+
+    VALUE counts = rb_ary_new2(batch_size);
+    for (int i = 0; call.counts != NULL && i < batch_size; ++i)
+    {
+        rb_ary_push(counts, INT2NUM(call.counts[i]));
+    }
+
+    if (!RTEST(generated_keys))
+    {
+        return counts;
+    }
+
+    VALUE keys = rb_ary_new();
+    // this hack should not have been necessary; it should never have
+    // returned null, this is a product defect.
+    ResultSet * results = nuodb_statement_result_set_of(handle, true, "Failed to get the generated keys for the batch");
+    if (results != NULL)
+    {
+        keys = nuodb_result_rows(nuodb_result_alloc(self, results, handle->pointer));
+    }
+    return rb_assoc_new(counts, keys);
+}
+
+/*
+ * call-seq:
+ *  execute_batch(generated_keys = false) -> ary
+ *
+ * Executes the statement's batch of commands and returns an array of update
+ * counts, one per command in the order they were added. If generated_keys is
+ * true, returns a two element array of the update counts and the rows of
+ * generated keys for the whole batch.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static
+VALUE nuodb_prepared_statement_execute_batch(int argc, VALUE * argv, VALUE self)
+{
+    trace("nuodb_prepared_statement_execute_batch");
+
+    VALUE generated_keys;
+    rb_scan_args(argc, argv, "01", &generated_keys);
+
+    nuodb_prepared_statement_handle * handle = nuodb_prepared_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        return nuodb_prepared_statement_run_batch(self, handle, generated_keys);
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    return Qnil;
+}
+
+static
+VALUE nuodb_prepared_statement_add_rows(VALUE args)
+{
+    VALUE self = rb_ary_entry(args, 0);
+    VALUE rows = rb_ary_entry(args, 1);
+    for (long i = 0; i < RARRAY_LEN(rows); ++i)
+    {
+        VALUE row = rb_ary_entry(rows, i);
+        if (TYPE(row) != T_ARRAY)
+        {
+            rb_raise(rb_eTypeError, "wrong row type %s at %ld (Array expected)", rb_class2name(CLASS_OF(row)), i);
+        }
+        nuodb_prepared_statement_bind_params(1, &row, self);
+        nuodb_prepared_statement_add_batch(self);
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  execute_many(rows, generated_keys = false) -> ary
+ *
+ * Binds each array of values in rows, adds it to the statement's batch, and
+ * executes the batch; returns what execute_batch returns.
+ *
+ *  connection.prepare 'insert into foo (f1,f2) values (?, ?)' do |statement|
+ *      statement.execute_many([[1, 'one'], [2, 'two']])  #=> [1, 1]
+ *  end
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static
+VALUE nuodb_prepared_statement_execute_many(int argc, VALUE * argv, VALUE self)
+{
+    trace("nuodb_prepared_statement_execute_many");
+
+    VALUE rows, generated_keys;
+    rb_scan_args(argc, argv, "11", &rows, &generated_keys);
+
+    if (TYPE(rows) != T_ARRAY)
+    {
+        rb_raise(rb_eTypeError, "wrong rows argument type %s (Array expected)", rb_class2name(CLASS_OF(rows)));
+    }
+
+    nuodb_prepared_statement_handle * handle = nuodb_prepared_statement_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        // a partially bound batch is discarded rather than left behind
+        int exception = 0;
+        rb_protect(nuodb_prepared_statement_add_rows, rb_assoc_new(self, rows), &exception);
+        if (exception)
+        {
+            nuodb_prepared_statement_clear_batch(self);
+            rb_jump_tag(exception);
+        }
+        return nuodb_prepared_statement_run_batch(self, handle, generated_keys);
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+    }
+    return Qnil;
+}
+
+static
+void nuodb_define_prepared_statement_api()
+{
+    /*
+     * Document-class: NuoDB::PreparedStatement
+     *
+     * A PreparedStatement object maintains a connection to a specific database.
+     * SQL statements are executed and results are returned within the context of a
+     * connection.
+     */
+    nuodb_prepared_statement_klass = rb_define_class_under(m_nuodb, "PreparedStatement", rb_cObject);
+
+    // DBI
+
+    rb_define_method(nuodb_prepared_statement_klass, "bind_param", RUBY_METHOD_FUNC(nuodb_prepared_statement_bind_param), 2);
+    rb_define_method(nuodb_prepared_statement_klass, "bind_params", RUBY_METHOD_FUNC(nuodb_prepared_statement_bind_params), -1);
+    rb_define_method(nuodb_prepared_statement_klass, "execute", RUBY_METHOD_FUNC(nuodb_prepared_statement_execute), 0);
+    //rb_define_method(nuodb_prepared_statement_klass, "finish", RUBY_METHOD_FUNC(nuodb_prepared_statement_finish), 0);
+
+    // NUODB EXTENSIONS
+
+    rb_define_method(nuodb_prepared_statement_klass, "add_batch", RUBY_METHOD_FUNC(nuodb_prepared_statement_add_batch), 0);
+    rb_define_method(nuodb_prepared_statement_klass, "cancel", RUBY_METHOD_FUNC(nuodb_statement_cancel<nuodb_prepared_statement_handle>), 0);
+    rb_define_method(nuodb_prepared_statement_klass, "clear_batch", RUBY_METHOD_FUNC(nuodb_prepared_statement_clear_batch), 0);
+    rb_define_method(nuodb_prepared_statement_klass, "count", RUBY_METHOD_FUNC(nuodb_prepared_statement_update_count), 0);
+    rb_define_method(nuodb_prepared_statement_klass, "execute_batch", RUBY_METHOD_FUNC(nuodb_prepared_statement_execute_batch), -1);
+    rb_define_method(nuodb_prepared_statement_klass, "execute_many", RUBY_METHOD_FUNC(nuodb_prepared_statement_execute_many), -1);
+    rb_define_method(nuodb_prepared_statement_klass, "generated_keys", RUBY_METHOD_FUNC(nuodb_prepared_statement_generated_keys), 0);
+    rb_define_method(nuodb_prepared_statement_klass, "results", RUBY_METHOD_FUNC(nuodb_prepared_statement_results), 0);
+    rb_define_method(nuodb_prepared_statement_klass, "timeout", RUBY_METHOD_FUNC(nuodb_statement_timeout_get<nuodb_prepared_statement_handle>), 0);
+    rb_define_method(nuodb_prepared_statement_klass, "timeout=", RUBY_METHOD_FUNC(nuodb_statement_timeout_set<nuodb_prepared_statement_handle>), 1);
+    rb_define_method(nuodb_prepared_statement_klass, "fetch_size", RUBY_METHOD_FUNC(nuodb_statement_fetch_size_get<nuodb_prepared_statement_handle>), 0);
+    rb_define_method(nuodb_prepared_statement_klass, "fetch_size=", RUBY_METHOD_FUNC(nuodb_statement_fetch_size_set<nuodb_prepared_statement_handle>), 1);
+    rb_define_method(nuodb_prepared_statement_klass, "max_rows", RUBY_METHOD_FUNC(nuodb_statement_max_rows_get<nuodb_prepared_statement_handle>), 0);
+    rb_define_method(nuodb_prepared_statement_klass, "max_rows=", RUBY_METHOD_FUNC(nuodb_statement_max_rows_set<nuodb_prepared_statement_handle>), 1);
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Class NuoDB::Connection
+ */
+
+/*
+ * Closes the client connection; the caller holds the connection, or is the
+ * GC freeing it.
+ */
+static
+VALUE nuodb_connection_close_protect(VALUE value)
+{
+    trace("nuodb_connection_close_protect");
+
+    nuodb_connection_handle * handle = reinterpret_cast<nuodb_connection_handle *>(value);
+    nuodb_handle_abandon_inherited(handle);
+    if (handle->pointer != NULL)
+    {
+        try
+        {
+            track_ref_count("CLOSE CONN", handle);
+            log(INFO, "closing connection");
+            handle->pointer->close();
+            handle->pointer = NULL;
+        }
+        catch (SQLException & e)
+        {
+            log(DEBUG, "rb_raise");
+            rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close connection: %s", e.getText());
+        }
+    }
+    return Qnil;
+}
+
+/*
+ * Frees the connection once nothing refers to it any longer; only then may
+ * the caches and the lock go, as a thread calling in with the GVL released,
+ * or iterating prefetched rows, still uses them.
+ */
+static
+VALUE nuodb_connection_free_protect(VALUE value)
+{
+    trace("nuodb_connection_free_protect");
+
+    nuodb_connection_handle * handle = reinterpret_cast<nuodb_connection_handle *>(value);
+    track_ref_count("FREE CONN CHECK", handle);
+    if (handle != NULL)
+    {
+        track_ref_count("FREE CONN", handle);
+        delete handle->schema_cache;
+        handle->schema_cache = NULL;
+        delete handle->statement_cache;
+        handle->statement_cache = NULL;
+        delete handle->timezone_cache;
+        handle->timezone_cache = NULL;
+        nuodb_connection_lock_destroy(handle);
+        nuodb_connection_close_protect(value);
+    }
+    return Qnil;
+}
+
+static
+void nuodb_connection_free(void * ptr)
+{
+    trace("nuodb_connection_free");
+    if (ptr != NULL)
+    {
+        int exception = 0;
+        rb_protect(nuodb_connection_free_protect, reinterpret_cast<VALUE>(ptr), &exception);
+        if (exception)
+        {
+            rb_jump_tag(exception);
+        }
+    }
+}
+
+static
+void nuodb_connection_mark(void * ptr)
+{
+    trace("nuodb_connection_mark");
+
+    nuodb_connection_handle * handle = static_cast<nuodb_connection_handle *>(ptr);
+    track_ref_count("MARK CONN", handle);
+
+    rb_gc_mark(handle->database);
+    rb_gc_mark(handle->username);
+    rb_gc_mark(handle->password);
+    rb_gc_mark(handle->schema);
+    rb_gc_mark(handle->timezone);
+    nuodb_schema_cache_mark(handle->schema_cache);
+    if (handle->statement_cache != NULL)
+    {
+        nuodb_statement_cache::entry_list::const_iterator entry;
+        for (entry = handle->statement_cache->entries.begin(); entry != handle->statement_cache->entries.end(); ++entry)
+        {
+            rb_gc_mark(entry->statement);
+        }
+    }
+}
+
+static
+void nuodb_connection_decr_reference_count(nuodb_handle * handle)
+{
+    trace("nuodb_connection_decr_reference_count");
+    decr_reference_count(handle);
+}
+
+static
+VALUE nuodb_connection_alloc(VALUE klass)
+{
+    trace("nuodb_connection_alloc");
+
+    nuodb_connection_handle * handle = ALLOC(struct nuodb_connection_handle);
+    handle->database = Qnil;
+    handle->username = Qnil;
+    handle->password = Qnil;
+    handle->schema = Qnil;
+    handle->timezone = Qnil;
+
+    handle->free_func = RUBY_DATA_FUNC(&nuodb_connection_free);
+    handle->atomic = 0;
+    handle->parent = Qnil;
+    handle->parent_handle = 0;
+    handle->pointer = 0;
+    handle->schema_cache = NULL;
+    handle->statement_cache = NULL;
+    handle->timezone_cache = NULL;
+    nuodb_connection_lock_init(handle);
+    handle->query_timeout = 0;
+    handle->fetch_size = 0;
+    handle->decimal_mode = NUODB_DECIMAL_BIGDECIMAL;
+    handle->encoding = rb_utf8_encindex();
+    handle->deferred = false;
+    handle->autocommit = true;
+    handle->resilient = false;
+    handle->reconnect_attempts = 5;
+    handle->reconnect_delay = 0.1;
+    handle->reconnect_max_delay = 5;
+    handle->session = 0;
+    handle->latency = 0;
+    handle->pid = 0;
+    incr_reference_count(handle);
+
+    print_address("[ALLOC] connection", handle);
+
+    return Data_Wrap_Struct(klass, nuodb_connection_mark, nuodb_connection_decr_reference_count, handle);
+}
+
+/*
+ * Creates the client connection and readies the call opening it, which the
+ * caller runs without the GVL; any failure is recorded in the call.
+ */
+static void internal_connection_prepare_connect(nuodb_connection_handle * handle, nuodb_open_database_call & call)
+{
+    trace("internal_connection_prepare_connect");
+
+    try
+    {
+        handle->pid = nuodb_current_pid;
+        handle->pointer = Connection::create();
+        Properties * props = handle->pointer->allocProperties();
+        props->putValue("user", StringValueCStr(handle->username));
+        props->putValue("password", StringValueCStr(handle->password));
+        if (handle->schema != Qnil)
+        {
+            props->putValue("schema", StringValueCStr(handle->schema));
+        }
+        if (!NIL_P(handle->timezone))
+        {
+            props->putValue("TimeZone", StringValueCStr(handle->timezone));
+        }
+        call.connection = handle->pointer;
+        call.database = StringValueCStr(handle->database);
+        call.properties = props;
+    }
+    catch (SQLException & e)
+    {
+        call.failed = true;
+        call.error_code = e.getSqlcode();
+        snprintf(call.error_text, sizeof(call.error_text), "%s", e.getText());
+    }
+}
+
+/*
+ * Completes the call opening the connection, discarding the client connection
+ * and raising if it failed so that a deferred connection may be retried.
+ */
+static void internal_connection_discard(nuodb_connection_handle * handle)
+{
+    if (handle->pointer != NULL)
+    {
+        try
+        {
+            handle->pointer->close();
+        }
+        catch (SQLException & e)
+        {
+            // the connection never opened
+        }
+        handle->pointer = NULL;
+    }
+}
+
+static void internal_connection_finish_connect_or_raise(nuodb_connection_handle * handle, nuodb_open_database_call & call)
+{
+    trace("internal_connection_finish_connect_or_raise");
+
+    if (!call.failed && !handle->autocommit)
+    {
+        nuodb_autocommit_call autocommit_call;
+        autocommit_call.connection = handle->pointer;
+        autocommit_call.autocommit = false;
+        nuodb_call_without_gvl(handle, autocommit_call);
+        if (autocommit_call.failed)
+        {
+            call.failed = true;
+            call.error_code = autocommit_call.error_code;
+            snprintf(call.error_text, sizeof(call.error_text), "%s", autocommit_call.error_text);
+        }
+    }
+
+    if (!call.failed)
+    {
+        handle->deferred = false;
+        handle->session++;
+        return;
+    }
+
+    internal_connection_discard(handle);
+
+    if (handle->schema != Qnil)
+    {
+        rb_raise_nuodb_error(call.error_code,
+                             "Failed to create database connection (\"%s\", \"%s\", ********, \"%s\"): %s",
+                             StringValueCStr(handle->database),
+                             StringValueCStr(handle->username),
+                             StringValueCStr(handle->schema),
+                             call.error_text);
+    }
+    else
+    {
+        rb_raise_nuodb_error(call.error_code,
+                             "Failed to create database connection (\"%s\", \"%s\", ********): %s",
+                             StringValueCStr(handle->database),
+                             StringValueCStr(handle->username),
+                             call.error_text);
+    }
+}
+
+static void internal_connection_connect_or_raise(nuodb_connection_handle * handle)
+{
+    trace("internal_connection_connect_or_raise");
+
+    nuodb_open_database_call call;
+    internal_connection_prepare_connect(handle, call);
+    if (!call.failed)
+    {
+        nuodb_call_without_gvl(handle, call);
+    }
+    internal_connection_finish_connect_or_raise(handle, call);
+}
+
+/*
+ * Forgets the connection's NuoDB session and defers connecting afresh until
+ * the connection is next used. The session is closed unless inherited across
+ * fork, in which case it is left to the parent. Cached statements are kept
+ * if the connection is resilient, as these prepare again on next use, and
+ * discarded otherwise.
+ */
+static void internal_connection_reset(nuodb_connection_handle * handle)
+{
+    trace("internal_connection_reset");
+
+    if (handle->statement_cache != NULL && !handle->resilient)
+    {
+        handle->statement_cache->index.clear();
+        handle->statement_cache->entries.clear();
+    }
+    if (handle->pid != nuodb_current_pid)
+    {
+        // the lock may have been held by a thread not forked along
+        nuodb_connection_lock_init(handle);
+    }
+    nuodb_handle_abandon_inherited(handle);
+    if (handle->pointer != NULL)
+    {
+        nuodb_connection_acquire(handle);
+        try
+        {
+            handle->pointer->close();
+        }
+        catch (SQLException & e)
+        {
+            // the session may well be broken already
+        }
+        handle->pointer = NULL;
+        nuodb_connection_release(handle);
+    }
+    handle->deferred = true;
+}
+
+/*
+ * Closes the connection's NuoDB session for good, as the pool does with the
+ * connections it releases rather than leaving them to the garbage collector;
+ * the connection raises if used afterwards. A connection in use by a thread
+ * is left to the garbage collector instead. Never raises.
+ */
+static void internal_connection_close(nuodb_connection_handle * handle)
+{
+    trace("internal_connection_close");
+
+    if (handle->statement_cache != NULL)
+    {
+        handle->statement_cache->index.clear();
+        handle->statement_cache->entries.clear();
+    }
+    nuodb_handle_abandon_inherited(handle);
+    if (handle->pointer != NULL && nuodb_connection_try_acquire(handle, rb_thread_current()))
+    {
+        try
+        {
+            handle->pointer->close();
+        }
+        catch (SQLException & e)
+        {
+            // the session may well be broken already
+        }
+        handle->pointer = NULL;
+        nuodb_connection_release(handle);
+    }
+    handle->deferred = false;
+}
+
+// the NuoDB client error codes for a lost session
+static const int NUODB_NETWORK_ERROR = -7;
+static const int NUODB_CONNECTION_ERROR = -10;
+static const int NUODB_IS_SHUTDOWN = -50;
+
+/*
+ * Tells whether the error lost the connection's session.
+ */
+static bool nuodb_session_lost(int error_code)
+{
+    return error_code == NUODB_NETWORK_ERROR || error_code == NUODB_CONNECTION_ERROR || error_code == NUODB_IS_SHUTDOWN;
+}
+
+/*
+ * Reconnects, making up to reconnect_attempts attempts with the delay between
+ * them doubling up to reconnect_max_delay; sleeping releases the GVL. Raises
+ * once the last attempt fails, leaving the connection to connect on next use.
+ */
+static void internal_connection_reconnect_with_backoff(nuodb_connection_handle * handle)
+{
+    trace("internal_connection_reconnect_with_backoff");
+
+    internal_connection_reset(handle);
+    double delay = handle->reconnect_delay;
+    for (size_t attempt = 1; ; ++attempt)
+    {
+        nuodb_open_database_call call;
+        internal_connection_prepare_connect(handle, call);
+        if (!call.failed)
+        {
+            nuodb_call_without_gvl(handle, call);
+        }
+        if (!call.failed || attempt >= handle->reconnect_attempts)
+        {
+            internal_connection_finish_connect_or_raise(handle, call);
+            return;
+        }
+        internal_connection_discard(handle);
+        log(WARN, "reconnect attempt failed, retrying");
+        rb_thread_wait_for(rb_time_interval(rb_float_new(delay)));
+        delay = delay * 2 < handle->reconnect_max_delay ? delay * 2 : handle->reconnect_max_delay;
+    }
+}
+
+static bool internal_connection_recover(nuodb_connection_handle * handle, int error_code)
+{
+    if (handle == NULL || !handle->resilient || !nuodb_session_lost(error_code))
+    {
+        return false;
+    }
+    internal_connection_reconnect_with_backoff(handle);
+    return true;
+}
+
+static nuodb_connection_handle * nuodb_connection_get(VALUE value)
+{
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(value);
+    if (handle != NULL && handle->pid != nuodb_current_pid && handle->pointer != NULL)
+    {
+        internal_connection_reset(handle);
+    }
+    if (handle != NULL && handle->deferred)
+    {
+        internal_connection_connect_or_raise(handle);
+    }
+    return handle;
+}
+
+/*
+ * call-seq:
+ *  commit()
+ *
+ * Commit the database transaction.
+ *
+ *      NuoDB::Connection.new (hash) do |connection|
+ *          ...
+ *          connection.commit
+ *      end  #=> automatically disconnected connection
+ */
+static VALUE nuodb_connection_commit(VALUE self)
+{
+    trace("nuodb_connection_commit");
+
+    nuodb_connection_handle * handle = nuodb_connection_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_commit_call call;
+        call.connection = handle->pointer;
+        nuodb_call_without_gvl(handle, call);
+        if (call.failed)
+        {
+            internal_connection_recover(handle, call.error_code);
+            rb_raise_nuodb_error(call.error_code, "Failed to commit transaction: %s", call.error_text);
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: connection handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  disconnect()
+ *
+ * Disconnects the connection, waiting for another thread using it to be done.
+ */
+static VALUE nuodb_connection_disconnect(VALUE self)
+{
+    trace("nuodb_connection_disconnect");
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);//;
+    track_ref_count("CONN DISCONNECT", handle);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_connection_acquire(handle);
+        if (handle->statement_cache != NULL)
+        {
+            handle->statement_cache->index.clear();
+            handle->statement_cache->entries.clear();
+        }
+        int exception = 0;
+        rb_protect(nuodb_connection_close_protect, reinterpret_cast<VALUE>(handle), &exception);
+        nuodb_connection_release(handle);
+        if (exception)
+        {
+            rb_jump_tag(exception);
+        }
+    }
+//    if (handle != NULL)
+//    {
+//        track_ref_count("FREE CONN", handle);
+//        if (handle->pointer != NULL)
+//        {
+//            try
+//            {
+//                track_ref_count("CLOSE CONN", handle);
+//                handle->pointer->close();
+//                handle->pointer = NULL;
+//            }
+//            catch (SQLException & e)
+//            {
+//                log(DEBUG, "rb_raise");
+//                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close connection: %s", e.getText());
+//            }
+//        }
+//    }
+    return Qnil;
+//
+//
+//
+//    if (ENABLE_CLOSE_HOOK)
+//    {
+//        nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+//        if (handle != NULL && handle->pointer != NULL)
+//        {
+//            nuodb_connection_decr_reference_count(handle);
+//        }
+//        else
+//        {
+//            rb_raise(rb_eArgError, "invalid state: connection handle nil");
+//        }
+//    }
+//    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  reconnect!  -> connection
+ *
+ * Closes the connection's session and opens a new one. Statements created
+ * beforehand are no longer usable, unless the connection is resilient (see
+ * Connection.new) and so prepares them again on next use. In a forked child the session inherited
+ * from the parent is left to the parent rather than closed; connections
+ * inherited across fork otherwise reconnect on first use in the child.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_reconnect(VALUE self)
+{
+    trace("nuodb_connection_reconnect");
+
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    if (handle != NULL && !NIL_P(handle->database))
+    {
+        internal_connection_reset(handle);
+        internal_connection_connect_or_raise(handle);
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: connection handle nil");
+    }
+    return self;
+}
+
+static
+VALUE nuodb_connection_reconnect_protect(VALUE value)
+{
+    internal_connection_reconnect_with_backoff(reinterpret_cast<nuodb_connection_handle *>(value));
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  connection.ping         -> boolean
+ *  connection.connected?   -> boolean
+ *
+ * Returns true if the connection is still alive, otherwise false. A resilient
+ * connection found dead reconnects, and returns whether it did.
+ *
+ *  connection.connected?   #=> true
+ */
+static VALUE nuodb_connection_ping(VALUE self)
+{
+    trace("nuodb_connection_ping");
+
+    nuodb_connection_handle * handle = nuodb_connection_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_ping_call call;
+        call.connection = handle->pointer;
+        nuodb_call_without_gvl(handle, call);
+        if (call.failed && handle->resilient)
+        {
+            int exception = 0;
+            rb_protect(nuodb_connection_reconnect_protect, reinterpret_cast<VALUE>(handle), &exception);
+            if (exception)
+            {
+                if (!rb_obj_is_kind_of(rb_errinfo(), c_nuodb_error))
+                {
+                    rb_jump_tag(exception);
+                }
+                rb_set_errinfo(Qnil);
+                return Qfalse;
+            }
+            return Qtrue;
+        }
+        return AS_QBOOL(!call.failed);
+    }
+    return Qfalse;
+}
+
+/*
+ * call-seq:
+ *  prepare(sql, generated_keys = true) -> PreparedStatement
+ *
+ * Creates a prepared statement. If generated_keys is false the statement does
+ * not return keys generated by inserts.
+ *
+ * If the connection has a statement cache (see Connection.new), preparing SQL
+ * text that was prepared before with a block yields the cached, reset
+ * statement rather than preparing it again. A statement cached and lent out
+ * to a prepare block is not handed out again until the block exits. Without
+ * a block a new statement is always returned, as the cache cannot tell when
+ * the caller is done with it.
+ *
+ *      NuoDB::Connection.new (hash) do |connection|
+ *          connection.prepare 'insert into foo (f1,f2) values (?, ?)' do |statement|
+ *              statement.bind_params [...]
+ *              statement.execute
+ *          end
+ *      end  #=> automatically disconnected connection
+ */
+static VALUE nuodb_connection_prepare(int argc, VALUE * argv, VALUE self)
+{
+    trace("nuodb_connection_prepare");
+
+    VALUE sql, generated_keys;
+    rb_scan_args(argc, argv, "11", &sql, &generated_keys);
+
+    return nuodb_prepared_statement_initialize(self, sql, NIL_P(generated_keys) || RTEST(generated_keys));
+}
+
+/*
+ * call-seq:
+ *  statement_cache_stats -> hash
+ *
+ * Returns the statement cache's size, capacity, and hit, miss and eviction
+ * counts.
+ *
+ *  connection.statement_cache_stats  #=> {:size=>12, :capacity=>256, :hits=>1093, :misses=>12, :evictions=>0}
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_statement_cache_stats(VALUE self)
+{
+    trace("nuodb_connection_statement_cache_stats");
+
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    nuodb_statement_cache const * cache = handle->statement_cache;
+
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("size")), SIZET2NUM(cache != NULL ? cache->entries.size() : 0));
+    rb_hash_aset(stats, ID2SYM(rb_intern("capacity")), SIZET2NUM(cache != NULL ? cache->capacity : 0));
+    rb_hash_aset(stats, ID2SYM(rb_intern("hits")), SIZET2NUM(cache != NULL ? cache->hits : 0));
+    rb_hash_aset(stats, ID2SYM(rb_intern("misses")), SIZET2NUM(cache != NULL ? cache->misses : 0));
+    rb_hash_aset(stats, ID2SYM(rb_intern("evictions")), SIZET2NUM(cache != NULL ? cache->evictions : 0));
+    return stats;
+}
+
+/*
+ * call-seq:
+ *  clear_statement_cache()
+ *
+ * Discards all cached prepared statements; they are released once no longer
+ * referenced.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_clear_statement_cache(VALUE self)
+{
+    trace("nuodb_connection_clear_statement_cache");
+
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    if (handle->statement_cache != NULL)
+    {
+        handle->statement_cache->index.clear();
+        handle->statement_cache->entries.clear();
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  statement -> Statement
+ *
+ * Creates a statement.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ *
+ *      NuoDB::Connection.new (hash) do |connection|
+ *          connection.statement do |statement|
+ *              statement.execute sql
+ *          end
+ *      end  #=> automatically disconnected connection
+ */
+static VALUE nuodb_connection_statement(VALUE self)
+{
+    trace("nuodb_connection_statement");
+
+    return nuodb_statement_initialize(self);
+}
+
+/*
+ * call-seq:
+ *  rollback()
+ *
+ * Rollback the database transaction.
+ *
+ *      NuoDB::Connection.new (hash) do |connection|
+ *          ...
+ *          connection.rollback
+ *      end  #=> automatically disconnected connection
+ */
+static VALUE nuodb_connection_rollback(VALUE self)
+{
+    trace("nuodb_connection_rollback");
+
+    nuodb_connection_handle * handle = nuodb_connection_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        nuodb_rollback_call call;
+        call.connection = handle->pointer;
+        nuodb_call_without_gvl(handle, call);
+        if (call.failed)
+        {
+            internal_connection_recover(handle, call.error_code);
+            rb_raise_nuodb_error(call.error_code, "Failed to rollback transaction: %s", call.error_text);
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: connection handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  autocommit= boolean
+ *
+ * Sets the connections autocommit state.
+ *
+ *      NuoDB::Connection.new (hash) do |connection|
+ *          connection.autocommit = false
+ *          ...
+ *          connection.commit
+ *      end  #=> automatically disconnected connection
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_autocommit_set(VALUE self, VALUE value)
+{
+    trace("nuodb_connection_autocommit_set");
+
+    nuodb_connection_handle * handle = nuodb_connection_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        bool auto_commit = !(RB_TYPE_P(value, T_FALSE) || RB_TYPE_P(value, T_NIL));
+        nuodb_autocommit_call call;
+        call.connection = handle->pointer;
+        call.autocommit = auto_commit;
+        nuodb_call_without_gvl(handle, call);
+        if (call.failed)
+        {
+            rb_raise_nuodb_error(call.error_code, "Failed to set autocommit (%d) for connection: %s", auto_commit, call.error_text);
+        }
+        handle->autocommit = auto_commit;
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: connection handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  autocommit? -> boolean
+ *
+ * Gets the connections autocommit state.
+ *
+ *  unless connection.autocommit? do    #=> false
+ *      connection.commit
+ *  end
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_autocommit_get(VALUE self)
+{
+    trace("nuodb_connection_autocommit_get");
+
+    nuodb_connection_handle * handle = nuodb_connection_get(self);
+    if (handle != NULL && handle->pointer != NULL)
+    {
+        try
+        {
+            bool current = handle->pointer->getAutoCommit();
+            return AS_QBOOL(current);
+        }
+        catch (SQLException & e)
+        {
+            rb_raise_nuodb_error(e.getSqlcode(), "Failed to determine autocommit state for connection: %s", e.getText());
+        }
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: connection handle nil");
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  timeout= seconds
+ *
+ * Sets the default number of seconds statements created by the connection may
+ * execute before they are cancelled by the database; nil or 0 removes the
+ * limit. Statements created before the change are unaffected.
+ *
+ *      NuoDB::Connection.new (hash) do |connection|
+ *          connection.timeout = 30
+ *          ...
+ *      end  #=> automatically disconnected connection
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_timeout_set(VALUE self, VALUE value)
+{
+    trace("nuodb_connection_timeout_set");
+
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    handle->query_timeout = nuodb_timeout_seconds(value);
+    return value;
+}
+
+/*
+ * call-seq:
+ *  timeout -> Number
+ *
+ * Returns the default statement timeout in seconds, 0 if unlimited.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_timeout_get(VALUE self)
+{
+    trace("nuodb_connection_timeout_get");
+
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    return INT2NUM(handle->query_timeout);
+}
+
+/*
+ * call-seq:
+ *  fetch_size= rows
+ *
+ * Sets the default number of rows fetched per round trip for the results of
+ * statements created by the connection; nil or 0 leaves it to the client.
+ * Statements created before the change are unaffected.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_fetch_size_set(VALUE self, VALUE value)
+{
+    trace("nuodb_connection_fetch_size_set");
+
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    handle->fetch_size = nuodb_row_count(value, "fetch_size");
+    return value;
+}
+
+/*
+ * call-seq:
+ *  fetch_size -> Number
+ *
+ * Returns the default fetch size of statements, 0 if left to the client.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_fetch_size_get(VALUE self)
+{
+    trace("nuodb_connection_fetch_size_get");
+
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    return INT2NUM(handle->fetch_size);
+}
+
+static nuodb_decimal_mode
+nuodb_decimal_mode_for(VALUE value)
+{
+    if (NIL_P(value) || value == sym_bigdecimal)
+    {
+        return NUODB_DECIMAL_BIGDECIMAL;
+    }
+    else if (value == sym_rational)
+    {
+        return NUODB_DECIMAL_RATIONAL;
+    }
+    else if (value == sym_string)
+    {
+        return NUODB_DECIMAL_STRING;
+    }
+    rb_raise(rb_eArgError, "unsupported decimal mode: %s", RSTRING_PTR(rb_inspect(value)));
+    return NUODB_DECIMAL_BIGDECIMAL;
+}
+
+/*
+ * call-seq:
+ *  decimal= mode
+ *
+ * Sets how NUMERIC and DECIMAL values with fraction digits are returned by
+ * results of the connection: as BigDecimal (:bigdecimal, the default), as
+ * Rational (:rational) or as the decimal text (:string). Values without
+ * fraction digits are returned as Integer, except as :string. Results
+ * created before the change are unaffected.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_decimal_set(VALUE self, VALUE value)
+{
+    trace("nuodb_connection_decimal_set");
+
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    handle->decimal_mode = nuodb_decimal_mode_for(value);
+    return value;
+}
+
+/*
+ * call-seq:
+ *  decimal -> Symbol
+ *
+ * Returns how NUMERIC and DECIMAL values with fraction digits are returned.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_decimal_get(VALUE self)
+{
+    trace("nuodb_connection_decimal_get");
+
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    switch (handle->decimal_mode)
+    {
+        case NUODB_DECIMAL_RATIONAL:
+            return sym_rational;
+        case NUODB_DECIMAL_STRING:
+            return sym_string;
+        default:
+            return sym_bigdecimal;
+    }
+}
+
+static int
+nuodb_encoding_for(VALUE value)
+{
+    if (NIL_P(value))
+    {
+        return rb_utf8_encindex();
+    }
+    int encoding = rb_to_encoding_index(value);
+    if (encoding < 0)
+    {
+        rb_raise(rb_eArgError, "unknown encoding: %s", RSTRING_PTR(rb_inspect(value)));
+    }
+    return encoding;
+}
+
+/*
+ * call-seq:
+ *  encoding= encoding
+ *
+ * Sets the encoding of the character values returned by results of the
+ * connection, as an Encoding or its name; nil restores the default, UTF-8.
+ * Binary values are always returned as ASCII-8BIT. Results created before
+ * the change are unaffected.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_encoding_set(VALUE self, VALUE value)
+{
+    trace("nuodb_connection_encoding_set");
+
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    handle->encoding = nuodb_encoding_for(value);
+    return value;
+}
+
+/*
+ * call-seq:
+ *  encoding -> Encoding
+ *
+ * Returns the encoding of the character values returned by results.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_encoding_get(VALUE self)
+{
+    trace("nuodb_connection_encoding_get");
+
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    return rb_enc_from_encoding(rb_enc_from_index(handle->encoding));
+}
+
+/*
+ * call-seq:
+ *
+ *  Connection.new(key, value, ...) -> new_connection
+ *  Connection.new(key, value, ...) { |connection| block }
+ *
+ * Creates a new connection using the specified connection parameters. In the
+ * first form a new connection is created but the caller is responsible for
+ * calling disconnect. In the second form a new connection is created but the
+ * caller is not responsible for calling disconnect; the connection is
+ * automatically closed after the block exits.
+ *
+ *      NuoDB::Connection.new (
+ *          :database => 'hockey',
+ *          :username => 'gretzky',
+ *          :password => 'goal!',
+ *          :schema   => 'players')     #=> connection
+ *      NuoDB::Connection.new (
+ *          :database => 'hockey',
+ *          :username => 'gretzky',
+ *          :password => 'goal!',
+ *          :schema   => 'players') { |connection| ... }    #=> automatically disconnected connection
+ *
+ * The optional :timeout parameter sets the default statement timeout in
+ * seconds; see timeout=. The optional :fetch_size parameter sets the default
+ * number of rows fetched per round trip; see fetch_size=. The optional :decimal
+ * parameter sets how exact numeric values are returned; see decimal=. The
+ * optional :encoding parameter sets the encoding of character values; see
+ * encoding=. The optional :statement_cache_size parameter enables
+ * caching of up to that many prepared statements for reuse by prepare blocks; the
+ * cache is disabled by default. With :lazy => true the connection is not
+ * opened until first used, so that connection errors are raised then.
+ *
+ * With :reconnect => true the connection reconnects once its session is lost,
+ * say as the transaction engine restarts, making up to :reconnect_attempts
+ * attempts (default 5) and doubling the delay between attempts from
+ * :reconnect_delay (default 0.1 seconds) up to :reconnect_max_delay (default
+ * 5 seconds). Statements created beforehand are prepared again on next use,
+ * with their parameters bound again; queries that only read, executed with
+ * autocommit on, are retried once. The statement in progress otherwise raises
+ * as the session is lost, and so does any transaction in progress.
+ */
+static VALUE nuodb_connection_initialize(VALUE self, VALUE hash)
+{
+    trace("nuodb_connection_initialize");
+
+    if (TYPE(hash) != T_HASH)
+    {
+        rb_raise(rb_eTypeError, "wrong argument type %s (Hash expected)", rb_class2name(CLASS_OF(hash)));
+    }
+
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    if (NIL_P(handle->database))
+    {
+        VALUE value = rb_hash_aref(hash, sym_database);
+        if (value == Qnil)
+        {
+            rb_raise(rb_eArgError, "missing database argument for connection: please specify :database => 'your_db_name'");
+        }
+        if (TYPE(value) != T_STRING)
+        {
+            rb_raise(rb_eTypeError, "wrong database argument type %s (String expected)", rb_class2name(CLASS_OF(value)));
+        }
+        handle->database = value;
+    }
+    if (handle->username == Qnil)
+    {
+        VALUE value = rb_hash_aref(hash, sym_username);
+        if (value == Qnil)
+        {
+            rb_raise(rb_eArgError, "missing username argument for connection: please specify :username => 'your_db_username'");
+        }
+        if (TYPE(value) != T_STRING)
+        {
+            rb_raise(rb_eTypeError, "wrong username argument type %s (String expected)", rb_class2name(CLASS_OF(value)));
+        }
+        handle->username = value;
+    }
+    if (handle->password == Qnil)
+    {
+        VALUE value = rb_hash_aref(hash, sym_password);
+        if (value == Qnil)
+        {
+            rb_raise(rb_eArgError, "missing password argument for connection: please specify :password => 'your_db_password'");
+        }
+        if (TYPE(value) != T_STRING)
+        {
+            rb_raise(rb_eTypeError, "wrong password argument type %s (String expected)", rb_class2name(CLASS_OF(value)));
+        }
+        handle->password = value;
+    }
+    if (handle->schema == Qnil)
     {
-        NuoDB::Statement * statement = NULL;
-        try
+        VALUE value = rb_hash_aref(hash, sym_schema);
+        if (TYPE(value) != T_STRING)
         {
-            statement = parent_handle->pointer->createStatement();
+            rb_raise(rb_eTypeError, "wrong schema argument type %s (String expected)", rb_class2name(CLASS_OF(value)));
         }
-        catch (SQLException & e)
+        handle->schema = value;
+    }
+    if (handle->timezone == Qnil)
+    {
+        VALUE value = rb_hash_aref(hash, sym_timezone);
+        if (value != Qnil)
+        {
+            if (TYPE(value) != T_STRING)
+            {
+                rb_raise(rb_eTypeError, "wrong timezone argument type %s (String expected)", rb_class2name(CLASS_OF(value)));
+            }
+            handle->timezone = value;
+        }
+    }
+    handle->query_timeout = nuodb_timeout_seconds(rb_hash_aref(hash, sym_timeout));
+    handle->fetch_size = nuodb_row_count(rb_hash_aref(hash, sym_fetch_size), "fetch_size");
+    handle->decimal_mode = nuodb_decimal_mode_for(rb_hash_aref(hash, sym_decimal));
+    handle->encoding = nuodb_encoding_for(rb_hash_aref(hash, sym_encoding));
+    if (handle->statement_cache == NULL)
+    {
+        VALUE value = rb_hash_aref(hash, sym_statement_cache_size);
+        if (value != Qnil)
         {
-            log(ERROR, "rb_raise");
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to create statement: %s", e.getText());
+            if (TYPE(value) != T_FIXNUM)
+            {
+                rb_raise(rb_eTypeError, "wrong statement_cache_size argument type %s (Integer expected)", rb_class2name(CLASS_OF(value)));
+            }
+            long capacity = FIX2LONG(value);
+            if (capacity < 0)
+            {
+                rb_raise(rb_eArgError, "statement_cache_size must not be negative");
+            }
+            if (capacity > 0)
+            {
+                handle->statement_cache = new nuodb_statement_cache();
+                handle->statement_cache->capacity = capacity;
+                handle->statement_cache->hits = 0;
+                handle->statement_cache->misses = 0;
+                handle->statement_cache->evictions = 0;
+            }
         }
+    }
 
-        nuodb_statement_handle * handle = ALLOC(nuodb_statement_handle);
+    handle->resilient = RTEST(rb_hash_aref(hash, sym_reconnect));
+    handle->reconnect_attempts = nuodb_size_option(hash, sym_reconnect_attempts, handle->reconnect_attempts);
+    handle->reconnect_delay = nuodb_seconds_option(hash, sym_reconnect_delay, handle->reconnect_delay);
+    handle->reconnect_max_delay = nuodb_seconds_option(hash, sym_reconnect_max_delay, handle->reconnect_max_delay);
 
-        handle->free_func = RUBY_DATA_FUNC(&nuodb_statement_free);
-        handle->atomic = 0;
-        handle->parent = parent;
-        handle->parent_handle = parent_handle;
-        handle->pointer = statement;
-        incr_reference_count(handle);
-        assert(handle->atomic = 1);
-        VALUE self = Data_Wrap_Struct(nuodb_statement_klass, nuodb_statement_mark, nuodb_statement_decr_reference_count, handle);
-        if (!rb_block_given_p()) {
-            trace("nuodb_statement_initialize: no block");
-            track_ref_count("ALLOC STMT S", cast_handle<nuodb_handle>(self));
-            return self;
-        }
+    if (RTEST(rb_hash_aref(hash, sym_lazy)))
+    {
+        handle->deferred = true;
+    }
+    else
+    {
+        internal_connection_connect_or_raise(handle);
+    }
 
-        trace("nuodb_statement_initialize: begin block");
+    if (!rb_block_given_p()) {
 
-        int exception = 0;
-        VALUE result = rb_protect(rb_yield, self, &exception);
+        trace("nuodb_connection_initialize: no block");
 
-        trace("nuodb_statement_initialize: end block");
+        return self;
+    }
 
-        // n.b. don't do this as it may introduce crashes of the ruby process !!!
-        //nuodb_statement_finish(self);
+    trace("nuodb_connection_initialize: begin block");
 
-        trace("nuodb_statement_initialize: auto finish");
+    int state = 0;
+    VALUE result = rb_protect(rb_yield, self, &state);
 
-        if (exception)
-        {
-            rb_jump_tag(exception);
-        }
-        else
-        {
-            return result;
-        }
+    trace("nuodb_connection_initialize: end block");
+
+    // n.b. don't do this as it may introduce crashes of the ruby process !!!
+    //nuodb_connection_disconnect(self);
+
+    trace("nuodb_connection_initialize: auto disconnect");
+
+    if (state)
+    {
+        rb_jump_tag(state);
     }
     else
     {
-        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+        return result;
     }
+
     return Qnil;
 }
 
 /*
- * call-seq:
- *  execute(sql) -> Bool
- *
- * Executes a statement.
- *
- * Returns true if the result is a Result object; returns false if the result is
- * an update count or there is no result. For the latter case, count() should be
- * called next, for the former case each() should be called.
+ * The state of connecting several connections, on the heap and freed by the
+ * ensure function as connecting may raise, or be interrupted, at any point.
  */
+struct nuodb_connect_all
+{
+    VALUE connections;
+    std::vector<nuodb_open_database_call> calls;
+    nuodb_parallel_call call;
+    bool connected;
+};
+
 static
-VALUE nuodb_statement_execute(VALUE self, VALUE sql)
+VALUE nuodb_connect_all_run(VALUE data)
 {
-    if (TYPE(sql) != T_STRING)
+    nuodb_connect_all * connect = reinterpret_cast<nuodb_connect_all *>(data);
+    VALUE connections = connect->connections;
+    long length = RARRAY_LEN(connections);
+    for (long i = 0; i < length; ++i)
     {
-        rb_raise(rb_eTypeError, "wrong sql argument type %s (String expected)", rb_class2name(CLASS_OF(sql)));
+        nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(rb_ary_entry(connections, i));
+        internal_connection_prepare_connect(handle, connect->calls[i]);
+        connect->call.calls.push_back(&connect->calls[i]);
     }
 
-    nuodb_statement_handle * handle = cast_handle<nuodb_statement_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+    nuodb_call_without_gvl(NULL, connect->call);
+
+    long failed = -1;
+    for (long i = 0; i < length; ++i)
     {
-        try
+        if (connect->calls[i].failed)
         {
-            return AS_QBOOL(handle->pointer->execute(StringValueCStr(sql),
-                NuoDB::RETURN_GENERATED_KEYS));
+            failed = failed < 0 ? i : failed;
         }
-        catch (SQLException & e)
+        else
         {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to execute SQL statement: %s", e.getText());
+            nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(rb_ary_entry(connections, i));
+            internal_connection_finish_connect_or_raise(handle, connect->calls[i]);
         }
     }
-    else
+    if (failed >= 0)
     {
-        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+        nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(rb_ary_entry(connections, failed));
+        internal_connection_finish_connect_or_raise(handle, connect->calls[failed]);
     }
+    connect->connected = true;
     return Qnil;
 }
 
 /*
- * call-seq:
- *  count() -> Number
- *
- * Returns the update count for an update statement.
+ * Closes every connection unless all of them connected, so that none is left
+ * open behind the raised error.
  */
 static
-VALUE nuodb_statement_update_count(VALUE self)
+VALUE nuodb_connect_all_ensure(VALUE data)
 {
-    trace("nuodb_statement_update_count");
-
-    nuodb_statement_handle * handle = cast_handle<nuodb_statement_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+    nuodb_connect_all * connect = reinterpret_cast<nuodb_connect_all *>(data);
+    if (!connect->connected)
     {
-        try
-        {
-            return INT2NUM(handle->pointer->getUpdateCount());
-        }
-        catch (SQLException & e)
+        for (long i = 0; i < RARRAY_LEN(connect->connections); ++i)
         {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to get the update count for the statement: %s", e.getText());
+            internal_connection_close(cast_handle<nuodb_connection_handle>(rb_ary_entry(connect->connections, i)));
         }
     }
-    else
-    {
-        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
-    }
+    delete connect;
     return Qnil;
 }
 
+/*
+ * Connects the deferred connections concurrently, raising the first failure
+ * once all of them are closed.
+ */
+static void nuodb_connection_connect_all(VALUE connections)
+{
+    trace("nuodb_connection_connect_all");
+
+    nuodb_connect_all * connect = new nuodb_connect_all();
+    connect->connections = connections;
+    connect->calls.resize(RARRAY_LEN(connections));
+    connect->connected = false;
+    rb_ensure(nuodb_connect_all_run, reinterpret_cast<VALUE>(connect),
+            nuodb_connect_all_ensure, reinterpret_cast<VALUE>(connect));
+    RB_GC_GUARD(connections);
+}
+
 /*
  * call-seq:
- *  results() -> Results
+ *  NuoDB::Connection.open_many(count, hash)   -> array
  *
- * Retrieves a result set containing rows for the related query.
+ * Opens count connections, given the same options as Connection.new,
+ * concurrently on native threads and without holding the GVL. Raises if any
+ * connection fails to open.
+ *
+ *  connections = NuoDB::Connection.open_many(32, :database => 'hockey',
+ *      :username => 'gretzky', :password => 'goal!', :schema => 'players')
+ *
+ * <b>This is a NuoDB-specific extension.</b>
  */
-static VALUE nuodb_statement_results(VALUE self)
+static VALUE nuodb_connection_open_many(VALUE klass, VALUE count, VALUE hash)
 {
-    trace("nuodb_statement_results");
+    trace("nuodb_connection_open_many");
 
-    nuodb_statement_handle * handle = cast_handle<nuodb_statement_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+    long length = NUM2LONG(count);
+    if (length < 0)
     {
-        try
-        {
-            return nuodb_result_alloc(self, handle->pointer->getResultSet(), handle->pointer->getConnection());
-        }
-        catch (SQLException & e)
-        {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to get the result set for the statement: %s", e.getText());
-        }
+        rb_raise(rb_eArgError, "negative connection count");
     }
-    else
+    if (TYPE(hash) != T_HASH)
     {
-        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+        rb_raise(rb_eTypeError, "wrong argument type %s (Hash expected)", rb_class2name(CLASS_OF(hash)));
+    }
+
+    VALUE config = rb_hash_dup(hash);
+    rb_hash_aset(config, sym_lazy, Qtrue);
+    VALUE connections = rb_ary_new2(length);
+    for (long i = 0; i < length; ++i)
+    {
+        rb_ary_push(connections, rb_class_new_instance(1, &config, klass));
+    }
+    nuodb_connection_connect_all(connections);
+
+    RB_GC_GUARD(config);
+    return connections;
+}
+
+static char const *
+nuodb_connection_schema_name(nuodb_connection_handle * handle, VALUE schema)
+{
+    if (NIL_P(schema))
+    {
+        schema = handle->schema;
+    }
+    if (NIL_P(schema))
+    {
+        return NULL;
+    }
+    if (TYPE(schema) != T_STRING)
+    {
+        rb_raise(rb_eTypeError, "wrong schema argument type %s (String expected)", rb_class2name(CLASS_OF(schema)));
+    }
+    return StringValueCStr(schema);
+}
+
+static
+VALUE nuodb_connection_tables_read(VALUE data)
+{
+    nuodb_get_tables_call * call = reinterpret_cast<nuodb_get_tables_call *>(data);
+    nuodb_call_without_gvl(call->handle, *call);
+    if (call->failed)
+    {
+        rb_raise_nuodb_error(call->error_code, "Failed to get the tables for the schema: %s", call->error_text);
+    }
+    VALUE names = rb_ary_new2(call->names.size());
+    for (size_t i = 0; i < call->names.size(); ++i)
+    {
+        rb_ary_push(names, rb_str_new(call->names[i].data(), call->names[i].size()));
     }
+    return names;
+}
+
+static
+VALUE nuodb_connection_tables_free(VALUE data)
+{
+    delete reinterpret_cast<nuodb_get_tables_call *>(data);
     return Qnil;
 }
 
 /*
  * call-seq:
- *  generated_keys() -> Results
+ *  tables(schema = nil) -> ary
  *
- * Retrieves a result set containing the generated keys related to the
- * previously executed insert.
+ * Retrieves the names of the tables in the specified schema, or if the
+ * specified schema is nil, the names of the tables in the schema associated
+ * with the connection. Table names are held in the connection's schema cache.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
  */
-static VALUE nuodb_statement_generated_keys(VALUE self)
+static VALUE nuodb_connection_tables(int argc, VALUE * argv, VALUE self)
 {
-    trace("nuodb_statement_generated_keys");
+    trace("nuodb_connection_tables");
 
-    nuodb_statement_handle * handle = cast_handle<nuodb_statement_handle>(self);
+    VALUE schema;
+    rb_scan_args(argc, argv, "01", &schema);
+
+    nuodb_connection_handle * handle = nuodb_connection_get(self);
     if (handle != NULL && handle->pointer != NULL)
     {
-        try
-        {
-            // this hack should not have been necessary; it should never have
-            // returned null, this is a product defect.
-            ResultSet * results = handle->pointer->getGeneratedKeys();
-            if (results != NULL)
-            {
-                return nuodb_result_alloc(self, results, handle->pointer->getConnection());
-            }
-        }
-        catch (SQLException & e)
+        char const * schema_name = nuodb_connection_schema_name(handle, schema);
+        nuodb_schema_cache * cache = nuodb_connection_schema_cache(handle);
+        std::string key(schema_name != NULL ? schema_name : "");
+
+        std::map<std::string, VALUE>::const_iterator cached = cache->table_names.find(key);
+        if (cached != cache->table_names.end())
         {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to get the generated keys for the statement: %s", e.getText());
+            return cached->second;
         }
+
+        nuodb_get_tables_call * call = new nuodb_get_tables_call();
+        call->connection = handle->pointer;
+        call->schema = schema_name;
+        call->handle = handle;
+        VALUE names = rb_ensure(nuodb_connection_tables_read, reinterpret_cast<VALUE>(call),
+                nuodb_connection_tables_free, reinterpret_cast<VALUE>(call));
+        rb_obj_freeze(names);
+        cache->table_names[key] = names;
+        return names;
     }
     else
     {
-        rb_raise(rb_eArgError, "invalid state: statement handle nil");
+        rb_raise(rb_eArgError, "invalid state: connection handle nil");
     }
     return Qnil;
 }
 
-static
-void nuodb_define_statement_api()
+/*
+ * call-seq:
+ *  columns(table, schema = nil) -> ary
+ *
+ * Returns an array of Column objects describing the columns of the specified
+ * table, in the specified schema or the schema associated with the connection.
+ * Column definitions are held in the connection's schema cache.
+ *
+ *      connection.columns('PLAYERS').each do |column|
+ *          puts "#{column.name}, #{column.default}, #{column.type}, #{column.null}"
+ *      end
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_columns(int argc, VALUE * argv, VALUE self)
 {
-    /*
-     * Document-class: NuoDB::Statement
-     *
-     * A Statement object maintains a connection to a specific database. SQL
-     * statements are executed and results are returned within the context of
-     * a connection.
-     */
-    nuodb_statement_klass = rb_define_class_under(m_nuodb, "Statement", rb_cObject);
-
-    // DBI
-
-    rb_define_method(nuodb_statement_klass, "execute", RUBY_METHOD_FUNC(nuodb_statement_execute), 1);
-    //rb_define_method(nuodb_statement_klass, "finish", RUBY_METHOD_FUNC(nuodb_statement_finish), 0);
-
-    // NUODB EXTENSIONS
+    trace("nuodb_connection_columns");
 
-    rb_define_method(nuodb_statement_klass, "count", RUBY_METHOD_FUNC(nuodb_statement_update_count), 0);
-    rb_define_method(nuodb_statement_klass, "generated_keys", RUBY_METHOD_FUNC(nuodb_statement_generated_keys), 0);
-    rb_define_method(nuodb_statement_klass, "results", RUBY_METHOD_FUNC(nuodb_statement_results), 0);
-}
+    VALUE table, schema;
+    rb_scan_args(argc, argv, "11", &table, &schema);
 
-//------------------------------------------------------------------------------
+    if (TYPE(table) != T_STRING)
+    {
+        rb_raise(rb_eTypeError, "wrong table argument type %s (String expected)", rb_class2name(CLASS_OF(table)));
+    }
 
-static
-VALUE nuodb_prepared_statement_free_protect(VALUE value)
-{
-    trace("nuodb_prepared_statement_free_protect");
-    nuodb_prepared_statement_handle * handle = reinterpret_cast<nuodb_prepared_statement_handle *>(value);
-    track_ref_count("PS FREE PROTECT", handle);
-    if (handle != NULL)
+    nuodb_connection_handle * handle = nuodb_connection_get(self);
+    if (handle != NULL && handle->pointer != NULL)
     {
-        if (handle->pointer != NULL)
+        char const * schema_name = nuodb_connection_schema_name(handle, schema);
+        nuodb_table_definition const * definition = NULL;
+        try
         {
-            try
-            {
-                log(INFO, "closing prepared statement");
-                handle->pointer->close();
-                handle->pointer = NULL;
-            }
-            catch (SQLException & e)
+            definition = nuodb_schema_cache_table(handle, schema_name, StringValueCStr(table));
+        }
+        catch (SQLException & e)
+        {
+            rb_raise_nuodb_error(e.getSqlcode(), "Failed to get the columns for the table: %s", e.getText());
+        }
+
+        VALUE array = rb_ary_new();
+        if (definition != NULL)
+        {
+            for (size_t i = 0; i < definition->columns.size(); ++i)
             {
-                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close statement: %s", e.getText());
+                nuodb_column_definition const & column = definition->columns[i];
+                rb_ary_push(array, nuodb_column_new(rb_str_new2(column.name.c_str()), column.default_value,
+                    column.type, column.precision, column.scale, column.precision, column.nullable));
             }
         }
+        return array;
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "invalid state: connection handle nil");
     }
     return Qnil;
 }
 
-static
-void nuodb_prepared_statement_free(void * ptr)
+/*
+ * call-seq:
+ *  clear_schema_cache()
+ *
+ * Discards all table and column definitions held in the connection's schema
+ * cache; they are reloaded from the database on next use. Call this after
+ * DDL that alters existing tables.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_connection_clear_schema_cache(VALUE self)
 {
-    trace("nuodb_prepared_statement_free");
+    trace("nuodb_connection_clear_schema_cache");
 
-    if (ptr != NULL)
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    if (handle != NULL && handle->schema_cache != NULL)
     {
-        int exception = 0;
-        rb_protect(nuodb_prepared_statement_free_protect, reinterpret_cast<VALUE>(ptr), &exception);
-        if (exception)
-        {
-            rb_jump_tag(exception);
-        }
+        handle->schema_cache->tables.clear();
+        handle->schema_cache->table_names.clear();
+        nuodb_result_shapes_clear(handle->schema_cache->result_columns);
     }
-}
-
-static
-void nuodb_prepared_statement_mark(void * ptr)
-{
-    trace("nuodb_prepared_statement_mark");
-
-    nuodb_prepared_statement_handle * handle = static_cast<nuodb_prepared_statement_handle *>(ptr);
-    rb_gc_mark(handle->parent);
-}
-
-static
-void nuodb_prepared_statement_decr_reference_count(nuodb_handle * handle)
-{
-    trace("nuodb_prepared_statement_decr_reference_count");
-    decr_reference_count(handle);
+    return Qnil;
 }
 
 /*
  * call-seq:
- *  finish()
+ *  evict_schema_cache(table, schema = nil)
  *
- * Releases the prepared statement and any associated resources.
+ * Discards the cached column definitions of a single table, the cached table
+ * names of its schema, and the cached result columns.
+ *
+ * <b>This is a NuoDB-specific extension.</b>
  */
-static
-VALUE nuodb_prepared_statement_finish(VALUE self)
+static VALUE nuodb_connection_evict_schema_cache(int argc, VALUE * argv, VALUE self)
 {
-    trace("nuodb_prepared_statement_finish");
-    nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(self);//reinterpret_cast<nuodb_prepared_statement_handle *>(value);
-    track_ref_count("FINISH PSTMT", handle);
-    nuodb_prepared_statement_free(handle);
-//    if (handle != NULL)
-//    {
-//        if (handle->pointer != NULL)
-//        {
-//            try
-//            {
-//                track_ref_count("CLOSE PSTMT", handle);
-//                log(INFO, "closing prepared statement");
-//                handle->pointer->close();
-//                handle->pointer = NULL;
-//            }
-//            catch (SQLException & e)
-//            {
-//                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close statement: %s", e.getText());
-//            }
-//        }
-//    }
-    return Qnil;
-//
-//    if (ENABLE_CLOSE_HOOK)
-//    {
-//        nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(self);
-//        if (handle != NULL && handle->pointer != NULL)
-//        {
-//            nuodb_prepared_statement_decr_reference_count(handle);
-//        }
-//        else
-//        {
-//            rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
-//        }
-//    }
-//    return Qnil;
-}
+    trace("nuodb_connection_evict_schema_cache");
 
-static
-VALUE nuodb_prepared_statement_initialize(VALUE parent, VALUE sql)
-{
-    trace("nuodb_prepared_statement_initialize");
+    VALUE table, schema;
+    rb_scan_args(argc, argv, "11", &table, &schema);
 
-    if (TYPE(sql) != T_STRING)
+    if (TYPE(table) != T_STRING)
     {
-        rb_raise(rb_eTypeError, "wrong sql argument type %s (String expected)", rb_class2name(CLASS_OF(sql)));
+        rb_raise(rb_eTypeError, "wrong table argument type %s (String expected)", rb_class2name(CLASS_OF(table)));
     }
 
-    nuodb_connection_handle * parent_handle = cast_handle<nuodb_connection_handle>(parent);
-    if (parent_handle != NULL && parent_handle->pointer != NULL)
+    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
+    if (handle != NULL && handle->schema_cache != NULL)
     {
-        NuoDB::PreparedStatement * statement = NULL;
-        try
-        {
-            statement = parent_handle->pointer->prepareStatement(StringValueCStr(sql),
-                    NuoDB::RETURN_GENERATED_KEYS);
-        }
-        catch (SQLException & e)
-        {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to create prepared statement (%s): %s", sql, e.getText());
-        }
+        char const * schema_name = nuodb_connection_schema_name(handle, schema);
+        std::string schema_key(schema_name != NULL ? schema_name : "");
+        handle->schema_cache->tables.erase(nuodb_table_key(schema_key, StringValueCStr(table)));
+        handle->schema_cache->table_names.erase(schema_key);
+        nuodb_result_shapes_clear(handle->schema_cache->result_columns);
+    }
+    return Qnil;
+}
 
-        nuodb_prepared_statement_handle * handle = ALLOC(struct nuodb_prepared_statement_handle);
-        handle->free_func = RUBY_DATA_FUNC(&nuodb_prepared_statement_free);
-        handle->atomic = 0;
-        handle->parent = parent;
-        handle->parent_handle = parent_handle;
-        handle->pointer = statement;
-        incr_reference_count(handle);
-        assert(handle->atomic == 1);
-        VALUE self = Data_Wrap_Struct(nuodb_prepared_statement_klass, nuodb_prepared_statement_mark, nuodb_prepared_statement_decr_reference_count, handle);
+void nuodb_define_connection_api()
+{
+    /*
+     * Document-class: NuoDB::Connection
+     *
+     * A Connection object maintains a connection to a specific database.
+     * SQL statements are executed and results are returned within the context of a
+     * connection.
+     */
+    nuodb_connection_klass = rb_define_class_under(m_nuodb, "Connection", rb_cObject);
 
-        if (!rb_block_given_p()) {
-            trace("nuodb_prepared_statement_initialize: no block");
+    rb_define_alloc_func(nuodb_connection_klass, nuodb_connection_alloc);
+    rb_define_method(nuodb_connection_klass, "initialize", RUBY_METHOD_FUNC(nuodb_connection_initialize), 1);
+    rb_define_singleton_method(nuodb_connection_klass, "open_many", RUBY_METHOD_FUNC(nuodb_connection_open_many), 2);
 
-            return self;
-        }
+    sym_username = ID2SYM(rb_intern("username"));
+    sym_password = ID2SYM(rb_intern("password"));
+    sym_database = ID2SYM(rb_intern("database"));
+    sym_schema = ID2SYM(rb_intern("schema"));
+    sym_timezone = ID2SYM(rb_intern("timezone"));
+    sym_timeout = ID2SYM(rb_intern("timeout"));
+    sym_fetch_size = ID2SYM(rb_intern("fetch_size"));
+    sym_decimal = ID2SYM(rb_intern("decimal"));
+    sym_bigdecimal = ID2SYM(rb_intern("bigdecimal"));
+    sym_rational = ID2SYM(rb_intern("rational"));
+    sym_string = ID2SYM(rb_intern("string"));
+    sym_encoding = ID2SYM(rb_intern("encoding"));
+    sym_statement_cache_size = ID2SYM(rb_intern("statement_cache_size"));
+    sym_lazy = ID2SYM(rb_intern("lazy"));
+    sym_reconnect = ID2SYM(rb_intern("reconnect"));
+    sym_reconnect_attempts = ID2SYM(rb_intern("reconnect_attempts"));
+    sym_reconnect_delay = ID2SYM(rb_intern("reconnect_delay"));
+    sym_reconnect_max_delay = ID2SYM(rb_intern("reconnect_max_delay"));
 
-        trace("nuodb_prepared_statement_initialize: begin block");
+    // DBI
 
-        int exception = 0;
-        VALUE result = rb_protect(rb_yield, self, &exception);
+    rb_define_method(nuodb_connection_klass, "commit", RUBY_METHOD_FUNC(nuodb_connection_commit), 0);
+    //rb_define_method(nuodb_connection_klass, "disconnect", RUBY_METHOD_FUNC(nuodb_connection_disconnect), 0);
+    rb_define_method(nuodb_connection_klass, "ping", RUBY_METHOD_FUNC(nuodb_connection_ping), 0);
+    rb_define_method(nuodb_connection_klass, "prepare", RUBY_METHOD_FUNC(nuodb_connection_prepare), -1);
+    rb_define_method(nuodb_connection_klass, "rollback", RUBY_METHOD_FUNC(nuodb_connection_rollback), 0);
 
-        trace("nuodb_prepared_statement_initialize: end block");
+    // NUODB EXTENSIONS
 
-        // n.b. don't do this as it may introduce crashes of the ruby process !!!
-        //nuodb_prepared_statement_finish(self);
+    rb_define_method(nuodb_connection_klass, "tables", RUBY_METHOD_FUNC(nuodb_connection_tables), -1);
+    rb_define_method(nuodb_connection_klass, "columns", RUBY_METHOD_FUNC(nuodb_connection_columns), -1);
+    rb_define_method(nuodb_connection_klass, "clear_schema_cache", RUBY_METHOD_FUNC(nuodb_connection_clear_schema_cache), 0);
+    rb_define_method(nuodb_connection_klass, "evict_schema_cache", RUBY_METHOD_FUNC(nuodb_connection_evict_schema_cache), -1);
+    rb_define_method(nuodb_connection_klass, "autocommit=", RUBY_METHOD_FUNC(nuodb_connection_autocommit_set), 1);
+    rb_define_method(nuodb_connection_klass, "autocommit?", RUBY_METHOD_FUNC(nuodb_connection_autocommit_get), 0);
+    rb_define_method(nuodb_connection_klass, "statement", RUBY_METHOD_FUNC(nuodb_connection_statement), 0);
+    rb_define_method(nuodb_connection_klass, "statement_cache_stats", RUBY_METHOD_FUNC(nuodb_connection_statement_cache_stats), 0);
+    rb_define_method(nuodb_connection_klass, "clear_statement_cache", RUBY_METHOD_FUNC(nuodb_connection_clear_statement_cache), 0);
+    rb_define_method(nuodb_connection_klass, "timeout", RUBY_METHOD_FUNC(nuodb_connection_timeout_get), 0);
+    rb_define_method(nuodb_connection_klass, "timeout=", RUBY_METHOD_FUNC(nuodb_connection_timeout_set), 1);
+    rb_define_method(nuodb_connection_klass, "fetch_size", RUBY_METHOD_FUNC(nuodb_connection_fetch_size_get), 0);
+    rb_define_method(nuodb_connection_klass, "fetch_size=", RUBY_METHOD_FUNC(nuodb_connection_fetch_size_set), 1);
+    rb_define_method(nuodb_connection_klass, "decimal", RUBY_METHOD_FUNC(nuodb_connection_decimal_get), 0);
+    rb_define_method(nuodb_connection_klass, "decimal=", RUBY_METHOD_FUNC(nuodb_connection_decimal_set), 1);
+    rb_define_method(nuodb_connection_klass, "encoding", RUBY_METHOD_FUNC(nuodb_connection_encoding_get), 0);
+    rb_define_method(nuodb_connection_klass, "encoding=", RUBY_METHOD_FUNC(nuodb_connection_encoding_set), 1);
+    rb_define_method(nuodb_connection_klass, "connected?", RUBY_METHOD_FUNC(nuodb_connection_ping), 0);
+    rb_define_method(nuodb_connection_klass, "reconnect!", RUBY_METHOD_FUNC(nuodb_connection_reconnect), 0);
+}
 
-        trace("nuodb_prepared_statement_initialize: auto finish");
+//------------------------------------------------------------------------------
 
-        if (exception)
-        {
-            rb_jump_tag(exception);
-        }
-        else
-        {
-            return result;
-        }
+/*
+ * Class NuoDB::Pool
+ *
+ * The pool's bookkeeping is only ever touched with the GVL held, so checkout
+ * and checkin take no lock of their own. The mutex and condition variable only
+ * serve threads waiting, with the GVL released, for a connection to be
+ * checked in; they are left alone while nobody waits.
+ */
+
+struct nuodb_pool_connection
+{
+    VALUE connection;
+    double idle_since;
+};
+
+struct nuodb_pool
+{
+    VALUE config;
+    size_t min_size;
+    size_t max_size;
+    double checkout_timeout;
+    double idle_timeout;
+    bool validate;
+    bool shutdown;
+
+    // connections open, idle or checked out, including those being opened
+    size_t size;
+    // idle connections, most recently checked in last
+    std::vector<nuodb_pool_connection> idle;
+    std::set<VALUE> borrowed;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t available;
+    unsigned long generation;
+    size_t waiting;
+
+    unsigned long created;
+    unsigned long checkouts;
+    unsigned long timeouts;
+    unsigned long validation_failures;
+    unsigned long reaped;
+    double wait_total;
+    double wait_max;
+};
+
+static
+void nuodb_pool_mark(void * ptr)
+{
+    nuodb_pool * pool = static_cast<nuodb_pool *>(ptr);
+    rb_gc_mark(pool->config);
+    std::vector<nuodb_pool_connection>::const_iterator idle;
+    for (idle = pool->idle.begin(); idle != pool->idle.end(); ++idle)
+    {
+        rb_gc_mark(idle->connection);
     }
-    else
+    std::set<VALUE>::const_iterator borrowed;
+    for (borrowed = pool->borrowed.begin(); borrowed != pool->borrowed.end(); ++borrowed)
     {
-        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+        rb_gc_mark(*borrowed);
     }
-    return Qnil;
 }
 
 static
-void raise_unsupported_type_at_index(char const * type_name, int32_t index)
+void nuodb_pool_free(void * ptr)
 {
-    rb_raise(rb_eTypeError, "unsupported type %s at %d", type_name, index);
+    trace("nuodb_pool_free");
+
+    nuodb_pool * pool = static_cast<nuodb_pool *>(ptr);
+    pthread_cond_destroy(&pool->available);
+    pthread_mutex_destroy(&pool->mutex);
+    delete pool;
+}
+
+static
+VALUE nuodb_pool_alloc(VALUE klass)
+{
+    trace("nuodb_pool_alloc");
+
+    nuodb_pool * pool = new nuodb_pool();
+    pool->config = Qnil;
+    pool->min_size = 0;
+    pool->max_size = 5;
+    pool->checkout_timeout = 5;
+    pool->idle_timeout = 300;
+    pool->validate = true;
+    pool->shutdown = false;
+    pool->size = 0;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    pool->generation = 0;
+    pool->waiting = 0;
+    pool->created = 0;
+    pool->checkouts = 0;
+    pool->timeouts = 0;
+    pool->validation_failures = 0;
+    pool->reaped = 0;
+    pool->wait_total = 0;
+    pool->wait_max = 0;
+    return Data_Wrap_Struct(klass, nuodb_pool_mark, nuodb_pool_free, pool);
+}
+
+static
+nuodb_pool * nuodb_pool_get(VALUE self)
+{
+    nuodb_pool * pool = NULL;
+    Data_Get_Struct(self, nuodb_pool, pool);
+    if (pool == NULL)
+    {
+        rb_raise(rb_eArgError, "invalid state: pool handle nil");
+    }
+    return pool;
 }
 
 /*
- * call-seq:
- *  bind_param(param, value)
- *
- * Attempts to bind the value to this statement as the parameter number specified.
- *
- *  connection.prepare insert_dml do |statement|
- *      statement.bind_param(1, "Joe Smith")
- *      statement.execute
- *  end  #=> implicit statement.finish
+ * Wakes the threads waiting for a connection; called whenever a connection is
+ * checked in or a slot frees up.
  */
 static
-VALUE nuodb_prepared_statement_bind_param(VALUE self, VALUE param, VALUE value)
+void nuodb_pool_signal(nuodb_pool * pool)
 {
-    trace("nuodb_prepared_statement_bind_param");
-
-    if (TYPE(param) != T_FIXNUM)
+    if (pool->waiting > 0)
     {
-        rb_raise(rb_eTypeError, "index must be a number");
+        pthread_mutex_lock(&pool->mutex);
+        pool->generation++;
+        pthread_cond_broadcast(&pool->available);
+        pthread_mutex_unlock(&pool->mutex);
     }
-    int32_t index = NUM2UINT(param);
+}
 
-    NuoDB::PreparedStatement * statement = cast_pointer_member<
-                                           nuodb_prepared_statement_handle, NuoDB::PreparedStatement>(self);
+struct nuodb_pool_wait_call : nuodb_blocking_call
+{
+    nuodb_pool * pool;
+    unsigned long generation;
+    double timeout;
+    bool cancelled;
 
-    try
+    virtual void run()
     {
-        switch (TYPE(value))
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        double seconds = floor(timeout);
+        deadline.tv_sec += static_cast<time_t>(seconds);
+        deadline.tv_nsec += static_cast<long>((timeout - seconds) * 1e9);
+        if (deadline.tv_nsec >= 1000000000L)
         {
-        case T_FLOAT: // 0x04
-            {
-                log(DEBUG, "supported: T_FLOAT");
-                double real_value = NUM2DBL(value);
-                statement->setDouble(index, real_value);
-            }
-            break;
-        case T_STRING: // 0x05
-            {
-                log(DEBUG, "supported: T_STRING");
-                char const * real_value = RSTRING_PTR(value);
-                statement->setString(index, real_value);
-            }
-            break;
-        case T_NIL: // 0x11
-            {
-                log(DEBUG, "supported: T_NIL");
-                statement->setNull(index, 0);
-            }
-            break;
-        case T_TRUE: // 0x12
-            {
-                log(DEBUG, "supported: T_TRUE");
-                statement->setBoolean(index, true);
-            }
-            break;
-        case T_FALSE: // 0x13
-            {
-                log(DEBUG, "supported: T_FALSE");
-                statement->setBoolean(index, false);
-            }
-            break;
-        case T_FIXNUM: // 0x15
-            {
-                log(DEBUG, "supported: T_FIXNUM");
-                int64_t real_value = NUM2LONG(value);
-                statement->setLong(index, real_value);
-            }
-            break;
-        case T_DATA: // 0x22
-            {
-                log(DEBUG, "supported: T_DATA");
-                if (rb_obj_is_instance_of(value, rb_cTime))
-                {
-                    log(DEBUG, "supported Time");
-                    VALUE sec = rb_funcall(value, rb_intern("tv_sec"), 0);
-                    //VALUE offset = rb_funcall(value, rb_intern("utc_offset"), 0);
-                    VALUE usec = rb_funcall(value, rb_intern("tv_usec"), 0);
-                    SqlTimestamp sqlTimestamp(NUM2INT(sec), NUM2INT(usec) * 1000); //  + NUM2INT(offset)
-                    statement->setTimestamp(index, &sqlTimestamp);
-                    break;
-                }
-                VALUE cDate = rb_const_get(rb_cObject, rb_intern("Date"));
-                if (rb_obj_is_instance_of(value, cDate))
-                {
-                    log(DEBUG, "supported Date");
-                    VALUE time = rb_funcall(value, rb_intern("to_time"), 0);
-                    VALUE sec = rb_funcall(time, rb_intern("tv_sec"), 0);
-                    //VALUE offset = rb_funcall(time, rb_intern("utc_offset"), 0);
-                    VALUE usec = rb_funcall(time, rb_intern("tv_usec"), 0);
-                    SqlTimestamp sqlTimestamp(NUM2LONG(sec), NUM2INT(usec) * 1000);//  + NUM2INT(offset)
-                    statement->setTimestamp(index, &sqlTimestamp);
-                    break;
-                }
-                break;
-            }
-        case T_OBJECT: // 0x01
-            {
-                log(WARN, "unsupported: T_OBJECT");
-                raise_unsupported_type_at_index("T_OBJECT", index);
-            }
-            break;
-        case T_BIGNUM: // 0x0a
-            {
-                log(DEBUG, "supported: T_BIGNUM");
-                int64_t real_value = NUM2LONG(value);
-                statement->setLong(index, real_value);
-            }
-            break;
-        case T_ARRAY: // 0x07
-            {
-                log(WARN, "unsupported: T_ARRAY");
-                raise_unsupported_type_at_index("T_ARRAY", index);
-            }
-            break;
-        case T_HASH: // 0x08
-            {
-                log(WARN, "unsupported: T_HASH");
-                raise_unsupported_type_at_index("T_HASH", index);
-            }
-            break;
-        case T_STRUCT: // 0x09
-            {
-                log(WARN, "unsupported: T_STRUCT");
-                raise_unsupported_type_at_index("T_STRUCT", index);
-            }
-            break;
-        case T_FILE: // 0x0e
-            {
-                log(WARN, "unsupported: T_FILE");
-                raise_unsupported_type_at_index("T_FILE", index);
-            }
-            break;
-        case T_MATCH: // 0x23
-            {
-                log(WARN, "unsupported: T_MATCH");
-                raise_unsupported_type_at_index("T_MATCH", index);
-            }
-            break;
-        case T_SYMBOL: // 0x24
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        while (!cancelled && pool->generation == generation)
+        {
+            if (pthread_cond_timedwait(&pool->available, &pool->mutex, &deadline) == ETIMEDOUT)
             {
-                log(WARN, "unsupported: T_SYMBOL");
-                raise_unsupported_type_at_index("T_SYMBOL", index);
                 break;
             }
-            break;
-        default:
-            rb_raise(rb_eTypeError, "unsupported type: %d", TYPE(value));
-            break;
         }
+        pthread_mutex_unlock(&pool->mutex);
     }
-    catch (SQLException & e)
+
+    virtual void cancel()
     {
-        rb_raise_nuodb_error(e.getSqlcode(), "Failed to set prepared statement parameter(%d, %lld) failed: %s",
-                             index, param, e.getText());
+        pthread_mutex_lock(&pool->mutex);
+        cancelled = true;
+        pthread_cond_broadcast(&pool->available);
+        pthread_mutex_unlock(&pool->mutex);
     }
+};
+
+static
+VALUE nuodb_pool_wait_protect(VALUE data)
+{
+    nuodb_pool_wait_call * call = reinterpret_cast<nuodb_pool_wait_call *>(data);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL2
+    nuodb_call_without_gvl(NULL, *call);
+#else
+    // n.b. without rb_thread_call_without_gvl2 the waiting thread polls instead
+    rb_thread_wait_for(rb_time_interval(rb_float_new(call->timeout < 0.01 ? call->timeout : 0.01)));
+#endif
+    return Qnil;
+}
+
+static
+VALUE nuodb_pool_wait_ensure(VALUE data)
+{
+    reinterpret_cast<nuodb_pool *>(data)->waiting--;
     return Qnil;
 }
 
 /*
- * call-seq:
- *  bind_params(*binds)
- *
- * Attempts to bind the list of values successively using bind_param.
- *
- *  connection.prepare insert_dml do |statement|
- *      statement.bind_params([56, 6.7, "String", Date.new(2001, 12, 3), Time.new])
- *      statement.execute
- *  end  #=> implicit statement.finish
+ * Waits, with the GVL released, until a connection is checked in, a slot frees
+ * up, or the timeout expires.
  */
 static
-VALUE nuodb_prepared_statement_bind_params(VALUE self, VALUE array)
+void nuodb_pool_wait(nuodb_pool * pool, double timeout)
 {
-    trace("nuodb_prepared_statement_bind_params");
+    nuodb_pool_wait_call call;
+    call.pool = pool;
+    call.generation = pool->generation;
+    call.timeout = timeout;
+    call.cancelled = false;
+    pool->waiting++;
+    rb_ensure(nuodb_pool_wait_protect, reinterpret_cast<VALUE>(&call),
+            nuodb_pool_wait_ensure, reinterpret_cast<VALUE>(pool));
+}
 
-    nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+/*
+ * Closes a connection the pool releases.
+ */
+static
+void nuodb_pool_close(VALUE connection)
+{
+    internal_connection_close(cast_handle<nuodb_connection_handle>(connection));
+}
+
+/*
+ * Closes idle connections that have been idle longer than the idle timeout,
+ * oldest first, as long as the pool stays at or above its minimum size.
+ */
+static
+size_t nuodb_pool_reap(nuodb_pool * pool, double now)
+{
+    size_t count = 0;
+    if (pool->idle_timeout > 0)
     {
-        for (int i = 0; i < RARRAY_LEN(array); ++i)
+        while (!pool->idle.empty() && pool->size > pool->min_size &&
+                pool->idle.front().idle_since + pool->idle_timeout <= now)
         {
-            VALUE value = RARRAY_PTR(array)[i];
-            nuodb_prepared_statement_bind_param(self, UINT2NUM(i+1), value);
+            nuodb_pool_close(pool->idle.front().connection);
+            pool->idle.erase(pool->idle.begin());
+            pool->size--;
+            count++;
         }
+        pool->reaped += count;
     }
-    else
+    if (count > 0)
     {
-        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+        nuodb_pool_signal(pool);
     }
-    return Qnil;
+    return count;
+}
+
+static
+VALUE nuodb_pool_open_connection(VALUE config)
+{
+    return rb_class_new_instance(1, &config, nuodb_connection_klass);
 }
 
 /*
- * call-seq:
- *  execute() -> Bool
- *
- * Executes a prepared statement. Returns true if the result is a Result object;
- * returns false if the result is an update count or there is no result. For the
- * latter case, count() should be called next, for the former case each() should
- * be called.
+ * Opens a connection counted against the pool's size, which the caller has
+ * already reserved.
  */
 static
-VALUE nuodb_prepared_statement_execute(VALUE self)
+VALUE nuodb_pool_open(nuodb_pool * pool)
 {
-    trace("nuodb_prepared_statement_execute");
+    int exception = 0;
+    VALUE connection = rb_protect(nuodb_pool_open_connection, pool->config, &exception);
+    if (exception)
+    {
+        pool->size--;
+        nuodb_pool_signal(pool);
+        rb_jump_tag(exception);
+    }
+    pool->created++;
+    return connection;
+}
 
-    nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+static
+VALUE nuodb_pool_checkout_connection(VALUE self)
+{
+    trace("nuodb_pool_checkout_connection");
+
+    nuodb_pool * pool = nuodb_pool_get(self);
+    double started = nuodb_monotonic_time();
+    double deadline = started + pool->checkout_timeout;
+    VALUE connection = Qnil;
+    while (NIL_P(connection))
     {
-        try
+        if (pool->shutdown)
         {
-            return AS_QBOOL(handle->pointer->execute());
+            rb_raise(rb_eArgError, "invalid state: pool shut down");
         }
-        catch (SQLException & e)
+        nuodb_pool_reap(pool, nuodb_monotonic_time());
+        while (NIL_P(connection) && !pool->idle.empty())
+        {
+            VALUE candidate = pool->idle.back().connection;
+            pool->idle.pop_back();
+            int exception = 0;
+            VALUE alive = pool->validate ? rb_protect(nuodb_connection_ping, candidate, &exception) : Qtrue;
+            if (exception || !RTEST(alive))
+            {
+                nuodb_pool_close(candidate);
+                pool->validation_failures++;
+                pool->size--;
+                nuodb_pool_signal(pool);
+                if (exception)
+                {
+                    rb_jump_tag(exception);
+                }
+                continue;
+            }
+            connection = candidate;
+        }
+        if (NIL_P(connection) && pool->size < pool->max_size)
         {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to execute SQL prepared statement: %s", e.getText());
+            pool->size++;
+            connection = nuodb_pool_open(pool);
+        }
+        if (NIL_P(connection))
+        {
+            double remaining = deadline - nuodb_monotonic_time();
+            if (remaining <= 0)
+            {
+                pool->timeouts++;
+                rb_raise(c_nuodb_pool_timeout_error, "could not obtain a connection from the pool within %.3f seconds (%lu connections in use)",
+                        pool->checkout_timeout, static_cast<unsigned long>(pool->borrowed.size()));
+            }
+            nuodb_pool_wait(pool, remaining);
         }
     }
-    else
+
+    pool->borrowed.insert(connection);
+    double waited = nuodb_monotonic_time() - started;
+    pool->checkouts++;
+    pool->wait_total += waited;
+    if (waited > pool->wait_max)
     {
-        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+        pool->wait_max = waited;
     }
-    return Qnil;
+    return connection;
 }
 
 /*
  * call-seq:
- *  count() -> Number
+ *  checkin(connection)
  *
- * Returns the update count for an update statement.
+ * Returns a checked out connection to the pool. Transactions left open on the
+ * connection are not rolled back.
  */
-static
-VALUE nuodb_prepared_statement_update_count(VALUE self)
+static VALUE nuodb_pool_checkin(VALUE self, VALUE connection)
 {
-    trace("nuodb_prepared_statement_update_count");
+    trace("nuodb_pool_checkin");
 
-    nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+    nuodb_pool * pool = nuodb_pool_get(self);
+    if (pool->borrowed.erase(connection) == 0)
     {
-        try
-        {
-            return INT2NUM(handle->pointer->getUpdateCount());
-        }
-        catch (SQLException & e)
-        {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to get the update count for the prepared statement: %s", e.getText());
-        }
+        rb_raise(rb_eArgError, "invalid state: connection not checked out of this pool");
+    }
+    double now = nuodb_monotonic_time();
+    if (pool->shutdown)
+    {
+        nuodb_pool_close(connection);
+        pool->size--;
     }
     else
     {
-        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+        nuodb_pool_connection idle;
+        idle.connection = connection;
+        idle.idle_since = now;
+        pool->idle.push_back(idle);
+        nuodb_pool_reap(pool, now);
     }
+    nuodb_pool_signal(pool);
     return Qnil;
 }
 
+static
+VALUE nuodb_pool_checkin_ensure(VALUE args)
+{
+    return nuodb_pool_checkin(rb_ary_entry(args, 0), rb_ary_entry(args, 1));
+}
+
 /*
  * call-seq:
- *  results() -> Results
+ *  checkout                        -> Connection
+ *  checkout { |connection| ... }   -> obj
  *
- * Retrieves a result set containing rows for the related query.
+ * Checks out a connection, validating idle connections with ping unless the
+ * pool was created with :validate => false, and opening a new connection
+ * while the pool is below its maximum size. Otherwise waits, without holding
+ * the GVL, for a connection to be checked in, and raises PoolTimeoutError
+ * should the checkout timeout expire first.
+ *
+ * Given a block, yields the connection and checks it back in once the block
+ * exits, returning the value of the block.
+ *
+ *      pool.checkout do |connection|
+ *          connection.statement { |statement| statement.execute 'select 1 from dual' }
+ *      end
  */
-static VALUE nuodb_prepared_statement_results(VALUE self)
+static VALUE nuodb_pool_checkout(VALUE self)
 {
-    trace("nuodb_prepared_statement_results");
+    trace("nuodb_pool_checkout");
 
-    nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+    VALUE connection = nuodb_pool_checkout_connection(self);
+    if (!rb_block_given_p())
     {
-        try
-        {
-            return nuodb_result_alloc(self, handle->pointer->getResultSet(), handle->pointer->getConnection());
-        }
-        catch (SQLException & e)
-        {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to get the result set for the prepared statement: %s", e.getText());
-        }
+        return connection;
     }
-    else
+    return rb_ensure(rb_yield, connection, nuodb_pool_checkin_ensure, rb_assoc_new(self, connection));
+}
+
+/*
+ * call-seq:
+ *  reap -> integer
+ *
+ * Closes connections idle for longer than the idle timeout while the pool is
+ * above its minimum size, and returns their number. The pool also reaps on
+ * every checkout and checkin.
+ */
+static VALUE nuodb_pool_reap_idle(VALUE self)
+{
+    trace("nuodb_pool_reap_idle");
+
+    nuodb_pool * pool = nuodb_pool_get(self);
+    return SIZET2NUM(nuodb_pool_reap(pool, nuodb_monotonic_time()));
+}
+
+/*
+ * call-seq:
+ *  shutdown
+ *
+ * Closes all idle connections, and those checked out as they are checked in;
+ * further checkouts raise.
+ */
+static VALUE nuodb_pool_shutdown(VALUE self)
+{
+    trace("nuodb_pool_shutdown");
+
+    nuodb_pool * pool = nuodb_pool_get(self);
+    pool->shutdown = true;
+    for (size_t i = 0; i < pool->idle.size(); ++i)
     {
-        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+        nuodb_pool_close(pool->idle[i].connection);
     }
+    pool->size -= pool->idle.size();
+    pool->idle.clear();
+    nuodb_pool_signal(pool);
     return Qnil;
 }
 
 /*
  * call-seq:
- *  generated_keys() -> Results
+ *  size -> integer
  *
- * Retrieves a result set containing the generated keys related to the
- * previously executed insert.
+ * Returns the number of connections open, whether idle or checked out.
  */
-static VALUE nuodb_prepared_statement_generated_keys(VALUE self)
+static VALUE nuodb_pool_size(VALUE self)
 {
-    trace("nuodb_prepared_statement_generated_keys");
+    trace("nuodb_pool_size");
 
-    nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+    return SIZET2NUM(nuodb_pool_get(self)->size);
+}
+
+/*
+ * call-seq:
+ *  stats -> hash
+ *
+ * Returns the pool's connection counts along with checkout counts and
+ * checkout latencies in seconds.
+ *
+ *  pool.stats  #=> {:size=>4, :idle=>1, :in_use=>3, :waiting=>0, :created=>4,
+ *              #    :checkouts=>5120, :timeouts=>0, :validation_failures=>0,
+ *              #    :reaped=>2, :checkout_time_total=>0.0312,
+ *              #    :checkout_time_mean=>6.1e-06, :checkout_time_max=>0.0154}
+ */
+static VALUE nuodb_pool_stats(VALUE self)
+{
+    trace("nuodb_pool_stats");
+
+    nuodb_pool * pool = nuodb_pool_get(self);
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("size")), SIZET2NUM(pool->size));
+    rb_hash_aset(stats, ID2SYM(rb_intern("idle")), SIZET2NUM(pool->idle.size()));
+    rb_hash_aset(stats, ID2SYM(rb_intern("in_use")), SIZET2NUM(pool->borrowed.size()));
+    rb_hash_aset(stats, ID2SYM(rb_intern("waiting")), SIZET2NUM(pool->waiting));
+    rb_hash_aset(stats, ID2SYM(rb_intern("created")), ULONG2NUM(pool->created));
+    rb_hash_aset(stats, ID2SYM(rb_intern("checkouts")), ULONG2NUM(pool->checkouts));
+    rb_hash_aset(stats, ID2SYM(rb_intern("timeouts")), ULONG2NUM(pool->timeouts));
+    rb_hash_aset(stats, ID2SYM(rb_intern("validation_failures")), ULONG2NUM(pool->validation_failures));
+    rb_hash_aset(stats, ID2SYM(rb_intern("reaped")), ULONG2NUM(pool->reaped));
+    rb_hash_aset(stats, ID2SYM(rb_intern("checkout_time_total")), rb_float_new(pool->wait_total));
+    rb_hash_aset(stats, ID2SYM(rb_intern("checkout_time_mean")),
+            rb_float_new(pool->checkouts > 0 ? pool->wait_total / pool->checkouts : 0.0));
+    rb_hash_aset(stats, ID2SYM(rb_intern("checkout_time_max")), rb_float_new(pool->wait_max));
+    return stats;
+}
+
+/*
+ * call-seq:
+ *  NuoDB::Pool.new(hash) -> Pool
+ *
+ * Creates a pool of connections opened with the given connection options
+ * (see Connection.new), along with these pool options:
+ *
+ * :min_size:: connections opened up front and kept when idle (default 0)
+ * :max_size:: connections open at most (default 5)
+ * :checkout_timeout:: seconds to wait for a connection to be checked in (default 5)
+ * :idle_timeout:: seconds before an idle connection above the minimum size is released, or 0 never to release one (default 300)
+ * :validate:: whether to ping idle connections on checkout (default true)
+ *
+ *      pool = NuoDB::Pool.new :database => 'test@localhost', :username => 'dba',
+ *          :password => 'goalie', :schema => 'hockey', :max_size => 16
+ *
+ * <b>This is a NuoDB-specific extension.</b>
+ */
+static VALUE nuodb_pool_initialize(VALUE self, VALUE hash)
+{
+    trace("nuodb_pool_initialize");
+
+    Check_Type(hash, T_HASH);
+
+    nuodb_pool * pool = nuodb_pool_get(self);
+    pool->min_size = nuodb_size_option(hash, sym_min_size, pool->min_size);
+    pool->max_size = nuodb_size_option(hash, sym_max_size, pool->max_size);
+    if (pool->max_size == 0 || pool->min_size > pool->max_size)
     {
-        try
-        {
-            // this hack should not have been necessary; it should never have
-            // returned null, this is a product defect.
-            ResultSet * results = handle->pointer->getGeneratedKeys();
-            if (results != NULL)
-            {
-                return nuodb_result_alloc(self, results, handle->pointer->getConnection());
-            }
-        }
-        catch (SQLException & e)
-        {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to get the generated keys for the prepared statement: %s", e.getText());
-        }
+        rb_raise(rb_eArgError, "invalid pool size: min_size %lu, max_size %lu",
+                static_cast<unsigned long>(pool->min_size), static_cast<unsigned long>(pool->max_size));
     }
-    else
+    pool->checkout_timeout = nuodb_seconds_option(hash, sym_checkout_timeout, pool->checkout_timeout);
+    pool->idle_timeout = nuodb_seconds_option(hash, sym_idle_timeout, pool->idle_timeout);
+    VALUE validate = rb_hash_aref(hash, sym_validate);
+    pool->validate = NIL_P(validate) || RTEST(validate);
+    pool->config = rb_obj_freeze(rb_hash_dup(hash));
+
+    if (pool->min_size > 0)
     {
-        rb_raise(rb_eArgError, "invalid state: prepared statement handle nil");
+        VALUE connections = nuodb_connection_open_many(nuodb_connection_klass, SIZET2NUM(pool->min_size), pool->config);
+        double now = nuodb_monotonic_time();
+        for (long i = 0; i < RARRAY_LEN(connections); ++i)
+        {
+            nuodb_pool_connection idle;
+            idle.connection = rb_ary_entry(connections, i);
+            idle.idle_since = now;
+            pool->idle.push_back(idle);
+        }
+        pool->size = pool->idle.size();
+        pool->created += pool->idle.size();
     }
-    return Qnil;
+    return self;
 }
 
-static
-void nuodb_define_prepared_statement_api()
+void nuodb_define_pool_api()
 {
-    /*
-     * Document-class: NuoDB::PreparedStatement
+    /**
+     * Document-class: NuoDB::Pool
      *
-     * A PreparedStatement object maintains a connection to a specific database.
-     * SQL statements are executed and results are returned within the context of a
-     * connection.
+     * A Pool object shares a bounded set of connections among threads; see
+     * checkout and checkin.
+     *
+     * <b>This is a NuoDB-specific extension.</b>
      */
-    nuodb_prepared_statement_klass = rb_define_class_under(m_nuodb, "PreparedStatement", rb_cObject);
+    nuodb_pool_klass = rb_define_class_under(m_nuodb, "Pool", rb_cObject);
 
-    // DBI
+    rb_define_alloc_func(nuodb_pool_klass, nuodb_pool_alloc);
+    rb_define_method(nuodb_pool_klass, "initialize", RUBY_METHOD_FUNC(nuodb_pool_initialize), 1);
 
-    rb_define_method(nuodb_prepared_statement_klass, "bind_param", RUBY_METHOD_FUNC(nuodb_prepared_statement_bind_param), 2);
-    rb_define_method(nuodb_prepared_statement_klass, "bind_params", RUBY_METHOD_FUNC(nuodb_prepared_statement_bind_params), 1);
-    rb_define_method(nuodb_prepared_statement_klass, "execute", RUBY_METHOD_FUNC(nuodb_prepared_statement_execute), 0);
-    //rb_define_method(nuodb_prepared_statement_klass, "finish", RUBY_METHOD_FUNC(nuodb_prepared_statement_finish), 0);
+    sym_min_size = ID2SYM(rb_intern("min_size"));
+    sym_max_size = ID2SYM(rb_intern("max_size"));
+    sym_checkout_timeout = ID2SYM(rb_intern("checkout_timeout"));
+    sym_idle_timeout = ID2SYM(rb_intern("idle_timeout"));
+    sym_validate = ID2SYM(rb_intern("validate"));
 
     // NUODB EXTENSIONS
 
-    rb_define_method(nuodb_prepared_statement_klass, "count", RUBY_METHOD_FUNC(nuodb_prepared_statement_update_count), 0);
-    rb_define_method(nuodb_prepared_statement_klass, "generated_keys", RUBY_METHOD_FUNC(nuodb_prepared_statement_generated_keys), 0);
-    rb_define_method(nuodb_prepared_statement_klass, "results", RUBY_METHOD_FUNC(nuodb_prepared_statement_results), 0);
+    rb_define_method(nuodb_pool_klass, "checkout", RUBY_METHOD_FUNC(nuodb_pool_checkout), 0);
+    rb_define_method(nuodb_pool_klass, "checkin", RUBY_METHOD_FUNC(nuodb_pool_checkin), 1);
+    rb_define_method(nuodb_pool_klass, "reap", RUBY_METHOD_FUNC(nuodb_pool_reap_idle), 0);
+    rb_define_method(nuodb_pool_klass, "shutdown", RUBY_METHOD_FUNC(nuodb_pool_shutdown), 0);
+    rb_define_method(nuodb_pool_klass, "size", RUBY_METHOD_FUNC(nuodb_pool_size), 0);
+    rb_define_method(nuodb_pool_klass, "stats", RUBY_METHOD_FUNC(nuodb_pool_stats), 0);
 }
 
 //------------------------------------------------------------------------------
 
 /*
- * Class NuoDB::Connection
+ * Class NuoDB::Router
  */
 
-static
-VALUE nuodb_connection_free_protect(VALUE value)
+enum nuodb_balance_policy
 {
-    trace("nuodb_connection_free_protect");
+    NUODB_ROUND_ROBIN,
+    NUODB_LEAST_OUTSTANDING,
+    NUODB_LATENCY_WEIGHTED
+};
 
-    nuodb_connection_handle * handle = reinterpret_cast<nuodb_connection_handle *>(value);
-    track_ref_count("FREE CONN CHECK", handle);
-    if (handle != NULL)
-    {
-        track_ref_count("FREE CONN", handle);
-        if (handle->pointer != NULL)
-        {
-            try
-            {
-                track_ref_count("CLOSE CONN", handle);
-                log(INFO, "closing connection");
-                handle->pointer->close();
-                handle->pointer = NULL;
-            }
-            catch (SQLException & e)
-            {
-                log(DEBUG, "rb_raise");
-                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close connection: %s", e.getText());
-            }
-        }
-    }
-    return Qnil;
-}
+struct nuodb_router
+{
+    // a connection per endpoint, the primary first
+    std::vector<VALUE> connections;
+    std::vector<unsigned long> routed;
+    nuodb_balance_policy policy;
+    bool autocommit;
+    size_t next;
+    uint32_t random;
+};
 
 static
-void nuodb_connection_free(void * ptr)
+void nuodb_router_mark(void * ptr)
 {
-    trace("nuodb_connection_free");
-    if (ptr != NULL)
+    nuodb_router * router = static_cast<nuodb_router *>(ptr);
+    std::vector<VALUE>::const_iterator connection;
+    for (connection = router->connections.begin(); connection != router->connections.end(); ++connection)
     {
-        int exception = 0;
-        rb_protect(nuodb_connection_free_protect, reinterpret_cast<VALUE>(ptr), &exception);
-        if (exception)
-        {
-            rb_jump_tag(exception);
-        }
+        rb_gc_mark(*connection);
     }
 }
 
 static
-void nuodb_connection_mark(void * ptr)
-{
-    trace("nuodb_connection_mark");
-
-    nuodb_connection_handle * handle = static_cast<nuodb_connection_handle *>(ptr);
-    track_ref_count("MARK CONN", handle);
-
-    rb_gc_mark(handle->database);
-    rb_gc_mark(handle->username);
-    rb_gc_mark(handle->password);
-    rb_gc_mark(handle->schema);
-}
-
-static
-void nuodb_connection_decr_reference_count(nuodb_handle * handle)
-{
-    trace("nuodb_connection_decr_reference_count");
-    decr_reference_count(handle);
-}
-
-static
-VALUE nuodb_connection_alloc(VALUE klass)
+void nuodb_router_free(void * ptr)
 {
-    trace("nuodb_connection_alloc");
-
-    nuodb_connection_handle * handle = ALLOC(struct nuodb_connection_handle);
-    handle->database = Qnil;
-    handle->username = Qnil;
-    handle->password = Qnil;
-    handle->schema = Qnil;
-    handle->timezone = Qnil;
+    trace("nuodb_router_free");
 
-    handle->free_func = RUBY_DATA_FUNC(&nuodb_connection_free);
-    handle->atomic = 0;
-    handle->parent = Qnil;
-    handle->parent_handle = 0;
-    handle->pointer = 0;
-    incr_reference_count(handle);
-
-    print_address("[ALLOC] connection", handle);
+    delete static_cast<nuodb_router *>(ptr);
+}
 
-    return Data_Wrap_Struct(klass, nuodb_connection_mark, nuodb_connection_decr_reference_count, handle);
+static
+VALUE nuodb_router_alloc(VALUE klass)
+{
+    trace("nuodb_router_alloc");
+
+    nuodb_router * router = new nuodb_router();
+    router->policy = NUODB_ROUND_ROBIN;
+    router->autocommit = true;
+    router->next = 0;
+    router->random = 2463534242U;
+    return Data_Wrap_Struct(klass, nuodb_router_mark, nuodb_router_free, router);
 }
 
-static void internal_connection_connect_or_raise(nuodb_connection_handle * handle)
+static
+nuodb_router * nuodb_router_get(VALUE self)
 {
-    trace("internal_connection_connect_or_raise");
+    nuodb_router * router = NULL;
+    Data_Get_Struct(self, nuodb_router, router);
+    if (router == NULL || router->connections.empty())
+    {
+        rb_raise(rb_eArgError, "invalid state: router handle nil");
+    }
+    return router;
+}
 
-    if (handle->schema != Qnil)
+/*
+ * Picks the endpoint for a read according to the balancing policy. Least
+ * outstanding picks the endpoint with the fewest calls holding or waiting for
+ * its connection, taking turns among the least loaded; latency weighted
+ * picks at random, weighting each endpoint by the inverse of its average call
+ * latency, endpoints not called yet being weighted as the fastest one.
+ */
+static
+size_t nuodb_router_balance(nuodb_router * router)
+{
+    size_t count = router->connections.size();
+    size_t start = router->next++ % count;
+    switch (router->policy)
     {
-        try
+    case NUODB_LEAST_OUTSTANDING:
+    {
+        size_t least = start;
+        rb_atomic_t fewest = cast_handle<nuodb_connection_handle>(router->connections[start])->outstanding;
+        for (size_t i = 1; i < count && fewest > 0; ++i)
         {
-            handle->pointer = Connection::create();
-            Properties * props = handle->pointer->allocProperties();
-            props->putValue("user", StringValueCStr(handle->username));
-            props->putValue("password", StringValueCStr(handle->password));
-            props->putValue("schema", StringValueCStr(handle->schema));
-            if (!NIL_P(handle->timezone))
+            size_t index = (start + i) % count;
+            rb_atomic_t outstanding = cast_handle<nuodb_connection_handle>(router->connections[index])->outstanding;
+            if (outstanding < fewest)
             {
-                props->putValue("TimeZone", StringValueCStr(handle->timezone));
+                least = index;
+                fewest = outstanding;
             }
-            handle->pointer->openDatabase(StringValueCStr(handle->database), props);
-        }
-        catch (SQLException & e)
-        {
-            rb_raise_nuodb_error(e.getSqlcode(),
-                                 "Failed to create database connection (\"%s\", \"%s\", ********, \"%s\"): %s",
-                                 StringValueCStr(handle->database),
-                                 StringValueCStr(handle->username),
-                                 StringValueCStr(handle->schema),
-                                 e.getText());
         }
+        return least;
     }
-    else
+    case NUODB_LATENCY_WEIGHTED:
     {
-        try
+        std::vector<double> latencies(count);
+        double fastest = 0;
+        for (size_t i = 0; i < count; ++i)
         {
-            handle->pointer = Connection::create();
-            Properties * props = handle->pointer->allocProperties();
-            props->putValue("user", StringValueCStr(handle->username));
-            props->putValue("password", StringValueCStr(handle->password));
-            if (!NIL_P(handle->timezone))
+            latencies[i] = cast_handle<nuodb_connection_handle>(router->connections[i])->latency;
+            if (latencies[i] > 0 && (fastest == 0 || latencies[i] < fastest))
             {
-                props->putValue("TimeZone", StringValueCStr(handle->timezone));
+                fastest = latencies[i];
             }
-            handle->pointer->openDatabase(StringValueCStr(handle->database), props);
         }
-        catch (SQLException & e)
+        if (fastest == 0)
         {
-            rb_raise_nuodb_error(e.getSqlcode(),
-                                 "Failed to create database connection (\"%s\", \"%s\", ********): %s",
-                                 StringValueCStr(handle->database),
-                                 StringValueCStr(handle->username),
-                                 e.getText());
+            return start;
         }
+        double total = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            latencies[i] = 1 / (latencies[i] > 0 ? latencies[i] : fastest);
+            total += latencies[i];
+        }
+        // xorshift32
+        router->random ^= router->random << 13;
+        router->random ^= router->random >> 17;
+        router->random ^= router->random << 5;
+        double pick = total * (router->random / 4294967296.0);
+        for (size_t i = 0; i < count; ++i)
+        {
+            pick -= latencies[i];
+            if (pick < 0)
+            {
+                return i;
+            }
+        }
+        return count - 1;
+    }
+    case NUODB_ROUND_ROBIN:
+    default:
+        return start;
     }
 }
 
+/*
+ * Reads spread across the endpoints unless a transaction is open, in which
+ * case everything stays on the primary with the transaction.
+ */
+static
+VALUE nuodb_router_route(nuodb_router * router, VALUE sql)
+{
+    if (TYPE(sql) != T_STRING)
+    {
+        rb_raise(rb_eTypeError, "wrong sql argument type %s (String expected)", rb_class2name(CLASS_OF(sql)));
+    }
+    size_t index = 0;
+    if (router->autocommit && router->connections.size() > 1 && nuodb_sql_is_read(RSTRING_PTR(sql), RSTRING_LEN(sql)))
+    {
+        index = nuodb_router_balance(router);
+    }
+    router->routed[index]++;
+    return router->connections[index];
+}
+
 /*
  * call-seq:
- *  commit()
+ *  connection_for(sql) -> Connection
  *
- * Commit the database transaction.
+ * Returns the connection the SQL statement is routed to: one picked by the
+ * balancing policy for queries that only read, while autocommit is on, and
+ * the primary otherwise.
+ */
+static VALUE nuodb_router_connection_for(VALUE self, VALUE sql)
+{
+    trace("nuodb_router_connection_for");
+
+    return nuodb_router_route(nuodb_router_get(self), sql);
+}
+
+/*
+ * call-seq:
+ *  prepare(sql, generated_keys = true) -> PreparedStatement
+ *  prepare(sql, generated_keys = true) { |statement| block } -> Object
  *
- *      NuoDB::Connection.new (hash) do |connection|
- *          ...
- *          connection.commit
- *      end  #=> automatically disconnected connection
+ * Creates a prepared statement on the connection the SQL statement is routed
+ * to; see connection_for and Connection#prepare. With a block, yields the
+ * prepared statement and returns the value of the block.
  */
-static VALUE nuodb_connection_commit(VALUE self)
+static VALUE nuodb_router_prepare(int argc, VALUE * argv, VALUE self)
 {
-    trace("nuodb_connection_commit");
+    trace("nuodb_router_prepare");
 
-    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+    VALUE sql, generated_keys;
+    rb_scan_args(argc, argv, "11", &sql, &generated_keys);
+
+    VALUE connection = nuodb_router_route(nuodb_router_get(self), sql);
+    return nuodb_prepared_statement_initialize(connection, sql, NIL_P(generated_keys) || RTEST(generated_keys));
+}
+
+/*
+ * call-seq:
+ *  statement -> RoutedStatement
+ *  statement { |statement| block } -> Object
+ *
+ * Creates a statement whose executions are each routed by their SQL, see
+ * connection_for. With a block, yields the statement and returns the value
+ * of the block.
+ */
+static VALUE nuodb_router_statement(VALUE self)
+{
+    trace("nuodb_router_statement");
+
+    nuodb_router_get(self);
+    VALUE klass = nuodb_registry_class(&c_routed_statement, m_nuodb, "nuodb/routed_statement", id_routed_statement);
+    VALUE statement = rb_class_new_instance(1, &self, klass);
+    if (!rb_block_given_p())
     {
-        try
-        {
-            handle->pointer->commit();
-        }
-        catch (SQLException & e)
-        {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to commit transaction: %s", e.getText());
-        }
+        return statement;
     }
-    else
+    return rb_yield(statement);
+}
+
+/*
+ * call-seq:
+ *  primary -> Connection
+ *
+ * Returns the connection to the primary, the first endpoint.
+ */
+static VALUE nuodb_router_primary(VALUE self)
+{
+    trace("nuodb_router_primary");
+
+    return nuodb_router_get(self)->connections[0];
+}
+
+/*
+ * call-seq:
+ *  connections -> array
+ *
+ * Returns the connections to all endpoints, the primary first.
+ */
+static VALUE nuodb_router_connections(VALUE self)
+{
+    trace("nuodb_router_connections");
+
+    nuodb_router * router = nuodb_router_get(self);
+    VALUE connections = rb_ary_new2(router->connections.size());
+    for (size_t i = 0; i < router->connections.size(); ++i)
     {
-        rb_raise(rb_eArgError, "invalid state: connection handle nil");
+        rb_ary_push(connections, router->connections[i]);
     }
-    return Qnil;
+    return connections;
 }
 
 /*
  * call-seq:
- *  disconnect()
+ *  autocommit = boolean
  *
- * Disconnects the connection.
+ * Sets autocommit on the primary. While autocommit is off every statement is
+ * routed to the primary, so that transactions stay on a single connection.
  */
-static VALUE nuodb_connection_disconnect(VALUE self)
+static VALUE nuodb_router_autocommit_set(VALUE self, VALUE value)
 {
-    trace("nuodb_connection_disconnect");
-    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);//;
-    track_ref_count("CONN DISCONNECT", handle);
-    nuodb_connection_free(handle);
-//    if (handle != NULL)
-//    {
-//        track_ref_count("FREE CONN", handle);
-//        if (handle->pointer != NULL)
-//        {
-//            try
-//            {
-//                track_ref_count("CLOSE CONN", handle);
-//                handle->pointer->close();
-//                handle->pointer = NULL;
-//            }
-//            catch (SQLException & e)
-//            {
-//                log(DEBUG, "rb_raise");
-//                rb_raise_nuodb_error(e.getSqlcode(), "Failed to successfully close connection: %s", e.getText());
-//            }
-//        }
-//    }
+    trace("nuodb_router_autocommit_set");
+
+    nuodb_router * router = nuodb_router_get(self);
+    nuodb_connection_autocommit_set(router->connections[0], value);
+    router->autocommit = RTEST(value);
     return Qnil;
-//
-//
-//
-//    if (ENABLE_CLOSE_HOOK)
-//    {
-//        nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
-//        if (handle != NULL && handle->pointer != NULL)
-//        {
-//            nuodb_connection_decr_reference_count(handle);
-//        }
-//        else
-//        {
-//            rb_raise(rb_eArgError, "invalid state: connection handle nil");
-//        }
-//    }
-//    return Qnil;
 }
 
 /*
  * call-seq:
- *  connection.ping         -> boolean
- *  connection.connected?   -> boolean
- *
- * Returns true if the connection is still alive, otherwise false.
+ *  autocommit? -> boolean
  *
- *  connection.connected?   #=> true
+ * Returns whether autocommit is on.
  */
-static VALUE nuodb_connection_ping(VALUE self)
+static VALUE nuodb_router_autocommit_get(VALUE self)
 {
-    trace("nuodb_connection_ping");
+    trace("nuodb_router_autocommit_get");
 
-    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
-    {
-        try
-        {
-            handle->pointer->ping();
-            return Qtrue;
-        }
-        catch (SQLException & e)
-        {
-        }
-    }
-    return Qfalse;
+    return AS_QBOOL(nuodb_router_get(self)->autocommit);
 }
 
 /*
  * call-seq:
- *  prepare(sql) -> PreparedStatement
+ *  commit()
  *
- * Creates a prepared statement.
+ * Commits the transaction on the primary.
+ */
+static VALUE nuodb_router_commit(VALUE self)
+{
+    trace("nuodb_router_commit");
+
+    return nuodb_connection_commit(nuodb_router_get(self)->connections[0]);
+}
+
+/*
+ * call-seq:
+ *  rollback()
  *
- *      NuoDB::Connection.new (hash) do |connection|
- *          connection.prepare 'insert into foo (f1,f2) values (?, ?)' do |statement|
- *              statement.bind_params [...]
- *              statement.execute
- *          end
- *      end  #=> automatically disconnected connection
+ * Rolls back the transaction on the primary.
  */
-static VALUE nuodb_connection_prepare(VALUE self, VALUE sql)
+static VALUE nuodb_router_rollback(VALUE self)
 {
-    trace("nuodb_connection_prepare");
+    trace("nuodb_router_rollback");
 
-    return nuodb_prepared_statement_initialize(self, sql);
+    return nuodb_connection_rollback(nuodb_router_get(self)->connections[0]);
 }
 
 /*
  * call-seq:
- *  statement -> Statement
+ *  ping -> boolean
  *
- * Creates a statement.
+ * Returns true if the connections to all endpoints are alive.
+ */
+static VALUE nuodb_router_ping(VALUE self)
+{
+    trace("nuodb_router_ping");
+
+    nuodb_router * router = nuodb_router_get(self);
+    bool alive = true;
+    for (size_t i = 0; i < router->connections.size(); ++i)
+    {
+        alive = RTEST(nuodb_connection_ping(router->connections[i])) && alive;
+    }
+    return AS_QBOOL(alive);
+}
+
+/*
+ * call-seq:
+ *  stats -> array
  *
- * <b>This is a NuoDB-specific extension.</b>
+ * Returns, for each endpoint, the primary first, the statements routed to it
+ * and the average latency of its calls in seconds.
  *
- *      NuoDB::Connection.new (hash) do |connection|
- *          connection.statement do |statement|
- *              statement.execute sql
- *          end
- *      end  #=> automatically disconnected connection
+ *  router.stats  #=> [{:database=>"hockey@te1", :routed=>1034, :latency=>0.0021}, ...]
  */
-static VALUE nuodb_connection_statement(VALUE self)
+static VALUE nuodb_router_stats(VALUE self)
 {
-    trace("nuodb_connection_statement");
+    trace("nuodb_router_stats");
 
-    return nuodb_statement_initialize(self);
+    nuodb_router * router = nuodb_router_get(self);
+    VALUE stats = rb_ary_new2(router->connections.size());
+    for (size_t i = 0; i < router->connections.size(); ++i)
+    {
+        nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(router->connections[i]);
+        VALUE endpoint = rb_hash_new();
+        rb_hash_aset(endpoint, ID2SYM(rb_intern("database")), handle->database);
+        rb_hash_aset(endpoint, ID2SYM(rb_intern("routed")), ULONG2NUM(router->routed[i]));
+        rb_hash_aset(endpoint, ID2SYM(rb_intern("latency")), rb_float_new(handle->latency));
+        rb_ary_push(stats, endpoint);
+    }
+    return stats;
 }
 
 /*
  * call-seq:
- *  rollback()
+ *  NuoDB::Router.new(hash) -> Router
  *
- * Rollback the database transaction.
+ * Creates a router over connections to the transaction engines listed in the
+ * :databases option, the first being the primary, given the other options of
+ * Connection.new. The connections are opened concurrently. Queries that only
+ * read are spread across all endpoints according to the :balance option,
+ * one of :round_robin (the default), :least_outstanding, or
+ * :latency_weighted; other statements, and all statements while autocommit
+ * is off, go to the primary.
  *
- *      NuoDB::Connection.new (hash) do |connection|
- *          ...
- *          connection.rollback
- *      end  #=> automatically disconnected connection
+ *      router = NuoDB::Router.new :databases => ['hockey@te1', 'hockey@te2'],
+ *          :username => 'gretzky', :password => 'goal!', :schema => 'players',
+ *          :balance => :least_outstanding
+ *
+ * <b>This is a NuoDB-specific extension.</b>
  */
-static VALUE nuodb_connection_rollback(VALUE self)
+static VALUE nuodb_router_initialize(VALUE self, VALUE hash)
 {
-    trace("nuodb_connection_rollback");
+    trace("nuodb_router_initialize");
 
-    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+    Check_Type(hash, T_HASH);
+
+    nuodb_router * router = NULL;
+    Data_Get_Struct(self, nuodb_router, router);
+
+    VALUE databases = rb_hash_aref(hash, sym_databases);
+    if (TYPE(databases) != T_ARRAY || RARRAY_LEN(databases) == 0)
     {
-        try
+        rb_raise(rb_eArgError, "missing databases argument for router: please specify :databases => ['db@te1', 'db@te2']");
+    }
+
+    VALUE balance = rb_hash_aref(hash, sym_balance);
+    if (NIL_P(balance) || balance == sym_round_robin)
+    {
+        router->policy = NUODB_ROUND_ROBIN;
+    }
+    else if (balance == sym_least_outstanding)
+    {
+        router->policy = NUODB_LEAST_OUTSTANDING;
+    }
+    else if (balance == sym_latency_weighted)
+    {
+        router->policy = NUODB_LATENCY_WEIGHTED;
+    }
+    else
+    {
+        rb_raise(rb_eArgError, "unsupported balance policy: %s", RSTRING_PTR(rb_inspect(balance)));
+    }
+
+    VALUE connections = rb_ary_new2(RARRAY_LEN(databases));
+    for (long i = 0; i < RARRAY_LEN(databases); ++i)
+    {
+        VALUE config = rb_hash_dup(hash);
+        rb_hash_aset(config, sym_database, rb_ary_entry(databases, i));
+        rb_hash_aset(config, sym_lazy, Qtrue);
+        rb_ary_push(connections, rb_class_new_instance(1, &config, nuodb_connection_klass));
+    }
+    nuodb_connection_connect_all(connections);
+
+    router->connections.assign(RARRAY_PTR(connections), RARRAY_PTR(connections) + RARRAY_LEN(connections));
+    router->routed.assign(router->connections.size(), 0);
+    RB_GC_GUARD(connections);
+    return self;
+}
+
+void nuodb_define_router_api()
+{
+    /**
+     * Document-class: NuoDB::Router
+     *
+     * A Router object routes statements across connections to several
+     * transaction engines, spreading reads and keeping writes and
+     * transactions on a primary.
+     *
+     * <b>This is a NuoDB-specific extension.</b>
+     */
+    nuodb_router_klass = rb_define_class_under(m_nuodb, "Router", rb_cObject);
+
+    rb_define_alloc_func(nuodb_router_klass, nuodb_router_alloc);
+    rb_define_method(nuodb_router_klass, "initialize", RUBY_METHOD_FUNC(nuodb_router_initialize), 1);
+
+    sym_databases = ID2SYM(rb_intern("databases"));
+    sym_balance = ID2SYM(rb_intern("balance"));
+    sym_round_robin = ID2SYM(rb_intern("round_robin"));
+    sym_least_outstanding = ID2SYM(rb_intern("least_outstanding"));
+    sym_latency_weighted = ID2SYM(rb_intern("latency_weighted"));
+
+    // DBI
+
+    rb_define_method(nuodb_router_klass, "commit", RUBY_METHOD_FUNC(nuodb_router_commit), 0);
+    rb_define_method(nuodb_router_klass, "ping", RUBY_METHOD_FUNC(nuodb_router_ping), 0);
+    rb_define_method(nuodb_router_klass, "prepare", RUBY_METHOD_FUNC(nuodb_router_prepare), -1);
+    rb_define_method(nuodb_router_klass, "rollback", RUBY_METHOD_FUNC(nuodb_router_rollback), 0);
+
+    // NUODB EXTENSIONS
+
+    rb_define_method(nuodb_router_klass, "autocommit=", RUBY_METHOD_FUNC(nuodb_router_autocommit_set), 1);
+    rb_define_method(nuodb_router_klass, "autocommit?", RUBY_METHOD_FUNC(nuodb_router_autocommit_get), 0);
+    rb_define_method(nuodb_router_klass, "statement", RUBY_METHOD_FUNC(nuodb_router_statement), 0);
+    rb_define_method(nuodb_router_klass, "connection_for", RUBY_METHOD_FUNC(nuodb_router_connection_for), 1);
+    rb_define_method(nuodb_router_klass, "primary", RUBY_METHOD_FUNC(nuodb_router_primary), 0);
+    rb_define_method(nuodb_router_klass, "connections", RUBY_METHOD_FUNC(nuodb_router_connections), 0);
+    rb_define_method(nuodb_router_klass, "stats", RUBY_METHOD_FUNC(nuodb_router_stats), 0);
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Module NuoDB
+ */
+
+/*
+ * The state of a parallel execution, on the heap and freed by the ensure
+ * function as the execution may raise, or be interrupted, at any point.
+ */
+struct nuodb_parallel_execution
+{
+    VALUE statements;
+    std::vector<nuodb_connection_handle *> handles;
+    size_t acquired;
+    std::vector<nuodb_prepared_execute_call> calls;
+    nuodb_parallel_call call;
+    long failed;
+    int error_code;
+    char error_text[BUFSIZ];
+};
+
+static
+VALUE nuodb_parallel_execution_run(VALUE data)
+{
+    nuodb_parallel_execution * execution = reinterpret_cast<nuodb_parallel_execution *>(data);
+    VALUE statements = execution->statements;
+    long count = RARRAY_LEN(statements);
+
+    // n.b. the connections are acquired in address order, waiting for those
+    // in use, so that parallel executions sharing connections cannot deadlock
+    std::sort(execution->handles.begin(), execution->handles.end(), std::less<nuodb_connection_handle *>());
+    for (; execution->acquired < execution->handles.size(); ++execution->acquired)
+    {
+        nuodb_connection_acquire(execution->handles[execution->acquired]);
+    }
+
+    nuodb_call_without_gvl(NULL, execution->call);
+
+    VALUE results = rb_ary_new2(count);
+    for (long i = 0; i < count && execution->failed < 0; ++i)
+    {
+        nuodb_prepared_execute_call & call = execution->calls[i];
+        if (call.failed)
+        {
+            execution->failed = i;
+            execution->error_code = call.error_code;
+            snprintf(execution->error_text, sizeof(execution->error_text), "%s", call.error_text);
+        }
+        else if (call.result)
         {
-            handle->pointer->rollback();
+            ResultSet * results_set = NULL;
+            try
+            {
+                results_set = call.statement->getResultSet();
+            }
+            catch (SQLException & e)
+            {
+                execution->failed = i;
+                execution->error_code = e.getSqlcode();
+                snprintf(execution->error_text, sizeof(execution->error_text), "%s", e.getText());
+            }
+            if (results_set != NULL)
+            {
+                rb_ary_push(results, nuodb_result_alloc(rb_ary_entry(statements, i), results_set, call.statement));
+            }
         }
-        catch (SQLException & e)
+        else
         {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to rollback transaction: %s", e.getText());
+            rb_ary_push(results, Qnil);
         }
     }
-    else
+    if (execution->failed >= 0)
     {
-        rb_raise(rb_eArgError, "invalid state: connection handle nil");
+        rb_raise_nuodb_error(execution->error_code, "Failed to execute SQL statement on connection %ld: %s",
+                execution->failed, execution->error_text);
+    }
+    return results;
+}
+
+static
+VALUE nuodb_parallel_execution_release(VALUE data)
+{
+    nuodb_parallel_execution * execution = reinterpret_cast<nuodb_parallel_execution *>(data);
+    for (size_t i = 0; i < execution->acquired; ++i)
+    {
+        nuodb_connection_release(execution->handles[i]);
     }
+    delete execution;
     return Qnil;
 }
 
 /*
- * call-seq:
- *  autocommit= boolean
- *
- * Sets the connections autocommit state.
- *
- *      NuoDB::Connection.new (hash) do |connection|
- *          connection.autocommit = false
- *          ...
- *          connection.commit
- *      end  #=> automatically disconnected connection
- *
- * <b>This is a NuoDB-specific extension.</b>
+ * Raises unless the prepared statements are on distinct connections.
  */
-static VALUE nuodb_connection_autocommit_set(VALUE self, VALUE value)
+static
+void nuodb_parallel_check_distinct(VALUE statements)
 {
-    trace("nuodb_connection_autocommit_set");
-
-    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+    long count = RARRAY_LEN(statements);
+    for (long i = 0; i < count; ++i)
     {
-        bool auto_commit = !(RB_TYPE_P(value, T_FALSE) || RB_TYPE_P(value, T_NIL));
-        try
-        {
-            handle->pointer->setAutoCommit(auto_commit);
-        }
-        catch (SQLException & e)
+        nuodb_handle * handle = cast_handle<nuodb_handle>(rb_ary_entry(statements, i));
+        for (long j = 0; j < i; ++j)
         {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to set autocommit (%d) for connection: %s", auto_commit, e.getText());
+            if (cast_handle<nuodb_handle>(rb_ary_entry(statements, j))->parent_handle == handle->parent_handle)
+            {
+                rb_raise(rb_eArgError, "connections %ld and %ld are the same connection", j, i);
+            }
         }
     }
-    else
+}
+
+/*
+ * Executes the prepared statements, each on a distinct connection,
+ * concurrently, each holding its connection for the duration, and returns
+ * their results, nil for statements without.
+ */
+static
+VALUE nuodb_parallel_execute(VALUE statements)
+{
+    nuodb_parallel_check_distinct(statements);
+
+    long count = RARRAY_LEN(statements);
+    nuodb_parallel_execution * execution = new nuodb_parallel_execution();
+    execution->statements = statements;
+    execution->acquired = 0;
+    execution->failed = -1;
+    execution->error_code = 0;
+    execution->error_text[0] = '\0';
+    execution->calls.resize(count);
+    for (long i = 0; i < count; ++i)
     {
-        rb_raise(rb_eArgError, "invalid state: connection handle nil");
+        nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(rb_ary_entry(statements, i));
+        execution->handles.push_back(static_cast<nuodb_connection_handle *>(handle->parent_handle));
+        execution->calls[i].statement = handle->pointer;
+        execution->calls[i].result = false;
+        execution->call.calls.push_back(&execution->calls[i]);
     }
-    return Qnil;
+    VALUE results = rb_ensure(nuodb_parallel_execution_run, reinterpret_cast<VALUE>(execution),
+            nuodb_parallel_execution_release, reinterpret_cast<VALUE>(execution));
+    RB_GC_GUARD(statements);
+    return results;
 }
 
 /*
- * call-seq:
- *  autocommit? -> boolean
- *
- * Gets the connections autocommit state.
- *
- *  unless connection.autocommit? do    #=> false
- *      connection.commit
- *  end
- *
- * <b>This is a NuoDB-specific extension.</b>
+ * Compares sort keys, nil first; raises if the keys do not compare.
  */
-static VALUE nuodb_connection_autocommit_get(VALUE self)
+static
+int nuodb_sort_key_compare(VALUE left, VALUE right)
 {
-    trace("nuodb_connection_autocommit_get");
+    if (NIL_P(left) || NIL_P(right))
+    {
+        return NIL_P(left) ? (NIL_P(right) ? 0 : -1) : 1;
+    }
+    return rb_cmpint(rb_funcall(left, id_cmp, 1, right), left, right);
+}
 
-    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
-    if (handle != NULL && handle->pointer != NULL)
+static
+int nuodb_row_compare(VALUE left, VALUE right, VALUE order_by, bool descending)
+{
+    for (long i = 0; i < RARRAY_LEN(order_by); ++i)
     {
-        try
-        {
-            bool current = handle->pointer->getAutoCommit();
-            return AS_QBOOL(current);
-        }
-        catch (SQLException & e)
+        long column = NUM2LONG(rb_ary_entry(order_by, i));
+        int result = nuodb_sort_key_compare(rb_ary_entry(left, column), rb_ary_entry(right, column));
+        if (result != 0)
         {
-            rb_raise_nuodb_error(e.getSqlcode(), "Failed to determine autocommit state for connection: %s", e.getText());
+            return descending ? -result : result;
         }
     }
-    else
-    {
-        rb_raise(rb_eArgError, "invalid state: connection handle nil");
-    }
-    return Qnil;
+    return 0;
 }
 
 /*
  * call-seq:
+ *  NuoDB.parallel_query(connections, sql, binds = nil, options = {})                -> array
+ *  NuoDB.parallel_query(connections, sql, binds = nil, options = {}) { |row| ... }  -> nil
  *
- *  Connection.new(key, value, ...) -> new_connection
- *  Connection.new(key, value, ...) { |connection| block }
+ * Prepares the SQL statement on each of the connections, binds the values in
+ * binds, and executes the statements concurrently on native threads without
+ * holding the GVL. The rows of all results are returned, or yielded as they
+ * are fetched, in the order of the connections, which must be distinct.
+ * Connections in use by other threads are waited for.
  *
- * Creates a new connection using the specified connection parameters. In the
- * first form a new connection is created but the caller is responsible for
- * calling disconnect. In the second form a new connection is created but the
- * caller is not responsible for calling disconnect; the connection is
- * automatically closed after the block exits.
+ * Options:
  *
- *      NuoDB::Connection.new (
- *          :database => 'hockey',
- *          :username => 'gretzky',
- *          :password => 'goal!',
- *          :schema   => 'players')     #=> connection
- *      NuoDB::Connection.new (
- *          :database => 'hockey',
- *          :username => 'gretzky',
- *          :password => 'goal!',
- *          :schema   => 'players') { |connection| ... }    #=> automatically disconnected connection
+ * :order_by:: a column index, or array of indices, each result is already
+ *             ordered by; rows are then merged in that order
+ * :descending:: whether the results are ordered descending (default false)
+ * :limit:: the number of rows to return at most, also applied to each
+ *          statement
+ *
+ *  NuoDB.parallel_query(shards, 'select id, total from orders where total > ? order by total desc',
+ *      [100], :order_by => 1, :descending => true, :limit => 10)
+ *
+ * <b>This is a NuoDB-specific extension.</b>
  */
-static VALUE nuodb_connection_initialize(VALUE self, VALUE hash)
+static VALUE nuodb_parallel_query(int argc, VALUE * argv, VALUE)
 {
-    trace("nuodb_connection_initialize");
+    trace("nuodb_parallel_query");
 
-    if (TYPE(hash) != T_HASH)
+    VALUE connections, sql, binds, options;
+    rb_scan_args(argc, argv, "22", &connections, &sql, &binds, &options);
+
+    Check_Type(connections, T_ARRAY);
+    if (TYPE(sql) != T_STRING)
     {
-        rb_raise(rb_eTypeError, "wrong argument type %s (Hash expected)", rb_class2name(CLASS_OF(hash)));
+        rb_raise(rb_eTypeError, "wrong sql argument type %s (String expected)", rb_class2name(CLASS_OF(sql)));
     }
-
-    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
-    if (NIL_P(handle->database))
+    if (!NIL_P(binds))
     {
-        VALUE value = rb_hash_aref(hash, sym_database);
-        if (value == Qnil)
-        {
-            rb_raise(rb_eArgError, "missing database argument for connection: please specify :database => 'your_db_name'");
-        }
-        if (TYPE(value) != T_STRING)
-        {
-            rb_raise(rb_eTypeError, "wrong database argument type %s (String expected)", rb_class2name(CLASS_OF(value)));
-        }
-        handle->database = value;
+        Check_Type(binds, T_ARRAY);
     }
-    if (handle->username == Qnil)
+
+    VALUE order_by = Qnil;
+    bool descending = false;
+    long limit = -1;
+    if (!NIL_P(options))
     {
-        VALUE value = rb_hash_aref(hash, sym_username);
-        if (value == Qnil)
+        Check_Type(options, T_HASH);
+        order_by = rb_hash_aref(options, sym_order_by);
+        if (!NIL_P(order_by))
         {
-            rb_raise(rb_eArgError, "missing username argument for connection: please specify :username => 'your_db_username'");
+            order_by = rb_Array(order_by);
+            for (long i = 0; i < RARRAY_LEN(order_by); ++i)
+            {
+                Check_Type(rb_ary_entry(order_by, i), T_FIXNUM);
+            }
         }
-        if (TYPE(value) != T_STRING)
+        descending = RTEST(rb_hash_aref(options, sym_descending));
+        if (!NIL_P(rb_hash_aref(options, sym_limit)))
         {
-            rb_raise(rb_eTypeError, "wrong username argument type %s (String expected)", rb_class2name(CLASS_OF(value)));
+            limit = (long) nuodb_size_option(options, sym_limit, 0);
         }
-        handle->username = value;
     }
-    if (handle->password == Qnil)
+
+    long count = RARRAY_LEN(connections);
+    VALUE statements = rb_ary_new2(count);
+    for (long i = 0; i < count; ++i)
     {
-        VALUE value = rb_hash_aref(hash, sym_password);
-        if (value == Qnil)
-        {
-            rb_raise(rb_eArgError, "missing password argument for connection: please specify :password => 'your_db_password'");
-        }
-        if (TYPE(value) != T_STRING)
+        VALUE connection = rb_ary_entry(connections, i);
+        nuodb_connection_handle * connection_handle = nuodb_connection_get(connection);
+        if (connection_handle == NULL || connection_handle->pointer == NULL)
         {
-            rb_raise(rb_eTypeError, "wrong password argument type %s (String expected)", rb_class2name(CLASS_OF(value)));
+            rb_raise(rb_eArgError, "invalid state: connection handle nil");
         }
-        handle->password = value;
-    }
-    if (handle->schema == Qnil)
-    {
-        VALUE value = rb_hash_aref(hash, sym_schema);
-        if (TYPE(value) != T_STRING)
+        VALUE statement = nuodb_prepared_statement_alloc(connection, connection_handle, sql, false);
+        rb_ary_push(statements, statement);
+        if (!NIL_P(binds))
         {
-            rb_raise(rb_eTypeError, "wrong schema argument type %s (String expected)", rb_class2name(CLASS_OF(value)));
+            nuodb_prepared_statement_bind_params(1, &binds, statement);
         }
-        handle->schema = value;
-    }
-    if (handle->timezone == Qnil)
-    {
-        VALUE value = rb_hash_aref(hash, sym_timezone);
-        if (value != Qnil)
+        if (limit >= 0)
         {
-            if (TYPE(value) != T_STRING)
+            nuodb_prepared_statement_handle * handle = cast_handle<nuodb_prepared_statement_handle>(statement);
+            handle->max_rows = limit > INT_MAX ? INT_MAX : (int) limit;
+            nuodb_statement_settings_call call(handle->pointer);
+            call.max_rows = handle->max_rows;
+            nuodb_call_without_gvl(connection_handle, call);
+            if (call.failed)
             {
-                rb_raise(rb_eTypeError, "wrong timezone argument type %s (String expected)", rb_class2name(CLASS_OF(value)));
+                rb_raise_nuodb_error(call.error_code, "Failed to limit the rows of the statement: %s", call.error_text);
             }
-            handle->timezone = value;
         }
     }
 
-    internal_connection_connect_or_raise(handle);
+    VALUE results = nuodb_parallel_execute(statements);
 
-    if (!rb_block_given_p()) {
-
-        trace("nuodb_connection_initialize: no block");
-
-        return self;
-    }
-
-    trace("nuodb_connection_initialize: begin block");
-
-    int state = 0;
-    VALUE result = rb_protect(rb_yield, self, &state);
-
-    trace("nuodb_connection_initialize: end block");
-
-    // n.b. don't do this as it may introduce crashes of the ruby process !!!
-    //nuodb_connection_disconnect(self);
-
-    trace("nuodb_connection_initialize: auto disconnect");
-
-    if (state)
+    bool yield = rb_block_given_p();
+    VALUE rows = yield ? Qnil : rb_ary_new();
+    long emitted = 0;
+    if (NIL_P(order_by))
     {
-        rb_jump_tag(state);
+        for (long i = 0; i < count && emitted != limit; ++i)
+        {
+            VALUE result = rb_ary_entry(results, i);
+            if (NIL_P(result))
+            {
+                continue;
+            }
+            nuodb_result_handle * handle = cast_handle<nuodb_result_handle>(result);
+            while (emitted != limit && nuodb_result_next(handle))
+            {
+                VALUE row = nuodb_result_current_row(handle);
+                emitted++;
+                if (yield)
+                {
+                    rb_yield(row);
+                }
+                else
+                {
+                    rb_ary_push(rows, row);
+                }
+            }
+        }
     }
     else
     {
-        return result;
+        // a k-way merge of the current rows of the results, nil once drained
+        VALUE heads = rb_ary_new2(count);
+        for (long i = 0; i < count; ++i)
+        {
+            VALUE result = rb_ary_entry(results, i);
+            nuodb_result_handle * handle = NIL_P(result) ? NULL : cast_handle<nuodb_result_handle>(result);
+            rb_ary_push(heads, handle != NULL && nuodb_result_next(handle) ? nuodb_result_current_row(handle) : Qnil);
+        }
+        while (emitted != limit)
+        {
+            long next = -1;
+            for (long i = 0; i < count; ++i)
+            {
+                VALUE head = rb_ary_entry(heads, i);
+                if (!NIL_P(head) && (next < 0 || nuodb_row_compare(head, rb_ary_entry(heads, next), order_by, descending) < 0))
+                {
+                    next = i;
+                }
+            }
+            if (next < 0)
+            {
+                break;
+            }
+            VALUE row = rb_ary_entry(heads, next);
+            nuodb_result_handle * handle = cast_handle<nuodb_result_handle>(rb_ary_entry(results, next));
+            rb_ary_store(heads, next, nuodb_result_next(handle) ? nuodb_result_current_row(handle) : Qnil);
+            emitted++;
+            if (yield)
+            {
+                rb_yield(row);
+            }
+            else
+            {
+                rb_ary_push(rows, row);
+            }
+        }
+        RB_GC_GUARD(heads);
     }
 
-    return Qnil;
+    RB_GC_GUARD(statements);
+    RB_GC_GUARD(results);
+    return rows;
 }
 
-///*
-// * call-seq:
-// *  tables(schema = nil) -> Results
-// *
-// * Retrieves a result set containing the tables associated to the specified schema,
-// * or if the specified schema is nil, return a result set of tables for the schema
-// * associated with the connection.
-// */
-//static VALUE nuodb_connection_tables(VALUE self, VALUE schema)
-//{
-//    trace("nuodb_connection_tables");
-//
-//    nuodb_connection_handle * handle = cast_handle<nuodb_connection_handle>(self);
-//    if (handle != NULL && handle->pointer != NULL)
-//    {
-//        if (schema == Qnil)
-//        {
-//            schema = handle->schema;
-//        }
-////        char const * sql = "SELECT tablename FROM system.tables WHERE schema = ?"
-////        try
-////        {
-////            return nuodb_result_alloc(self, handle->pointer->getGeneratedKeys());
-////        }
-////        catch (SQLException & e)
-////        {
-////            rb_raise_nuodb_error(e.getSqlcode(), "Failed to get the tables keys for the schema: %s", e.getText());
-////        }
-//    }
-//    else
-//    {
-//        rb_raise(rb_eArgError, "invalid state: connection handle nil");
-//    }
-//    return Qnil;
-//}
-
-void nuodb_define_connection_api()
+void nuodb_define_module_api()
 {
-    /*
-     * Document-class: NuoDB::Connection
-     *
-     * A Connection object maintains a connection to a specific database.
-     * SQL statements are executed and results are returned within the context of a
-     * connection.
-     */
-    nuodb_connection_klass = rb_define_class_under(m_nuodb, "Connection", rb_cObject);
-
-    rb_define_alloc_func(nuodb_connection_klass, nuodb_connection_alloc);
-    rb_define_method(nuodb_connection_klass, "initialize", RUBY_METHOD_FUNC(nuodb_connection_initialize), 1);
-
-    sym_username = ID2SYM(rb_intern("username"));
-    sym_password = ID2SYM(rb_intern("password"));
-    sym_database = ID2SYM(rb_intern("database"));
-    sym_schema = ID2SYM(rb_intern("schema"));
-    sym_timezone = ID2SYM(rb_intern("timezone"));
-
-    // DBI
-
-    rb_define_method(nuodb_connection_klass, "commit", RUBY_METHOD_FUNC(nuodb_connection_commit), 0);
-    //rb_define_method(nuodb_connection_klass, "disconnect", RUBY_METHOD_FUNC(nuodb_connection_disconnect), 0);
-    rb_define_method(nuodb_connection_klass, "ping", RUBY_METHOD_FUNC(nuodb_connection_ping), 0);
-    rb_define_method(nuodb_connection_klass, "prepare", RUBY_METHOD_FUNC(nuodb_connection_prepare), 1);
-    rb_define_method(nuodb_connection_klass, "rollback", RUBY_METHOD_FUNC(nuodb_connection_rollback), 0);
-    // todo add .tables, definitely!
-    // todo add .columns, or not? If we did: .columns(table_name)
-    // todo and tie this into the SchemaCache on the Ruby side.
+    sym_order_by = ID2SYM(rb_intern("order_by"));
+    sym_descending = ID2SYM(rb_intern("descending"));
+    sym_limit = ID2SYM(rb_intern("limit"));
 
     // NUODB EXTENSIONS
 
-    //rb_define_method(nuodb_connection_klass, "tables", RUBY_METHOD_FUNC(nuodb_connection_tables), 1);
-    rb_define_method(nuodb_connection_klass, "autocommit=", RUBY_METHOD_FUNC(nuodb_connection_autocommit_set), 1);
-    rb_define_method(nuodb_connection_klass, "autocommit?", RUBY_METHOD_FUNC(nuodb_connection_autocommit_get), 0);
-    rb_define_method(nuodb_connection_klass, "statement", RUBY_METHOD_FUNC(nuodb_connection_statement), 0);
-    rb_define_method(nuodb_connection_klass, "connected?", RUBY_METHOD_FUNC(nuodb_connection_ping), 0);
+    rb_define_module_function(m_nuodb, "parallel_query", RUBY_METHOD_FUNC(nuodb_parallel_query), -1);
 }
 
 //------------------------------------------------------------------------------
@@ -2510,10 +9743,22 @@ extern "C" void Init_nuodb(void)
      */
     m_nuodb = rb_define_module("NuoDB");
 
+    nuodb_current_pid = getpid();
+    pthread_atfork(NULL, NULL, nuodb_atfork_child);
+
+#ifdef HAVE_GCC_TARGET_AVX2
+    __builtin_cpu_init();
+    nuodb_have_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
     c_nuodb_error = rb_const_get(m_nuodb, rb_intern("DatabaseError"));
 
+    c_nuodb_pool_timeout_error = rb_const_get(m_nuodb, rb_intern("PoolTimeoutError"));
+
     c_error_code_assignment = rb_intern("error_code=");
 
+    nuodb_define_registry();
+
     nuodb_define_connection_api();
 
     nuodb_define_statement_api();
@@ -2521,4 +9766,10 @@ extern "C" void Init_nuodb(void)
     nuodb_define_prepared_statement_api();
 
     nuodb_define_result_api();
+
+    nuodb_define_pool_api();
+
+    nuodb_define_router_api();
+
+    nuodb_define_module_api();
 }
@@ -12,12 +12,17 @@ module NuoDB
     end
 
     attr_reader :name, :default, :type, :limit, :null, :sql_type, :precision, :scale
+    # The columns of results are shared by results of the same shape and are
+    # frozen; set these on a dup.
     attr_accessor :primary, :coder
 
     alias :encoded? :coder
 
     # Instantiates a new column in the table.
     #
+    # Columns describing results and tables are created by the native extension
+    # directly from the column's type information and do not pass through here.
+    #
     # +name+ is the column's name, such as <tt>supplier_id</tt> in <tt>supplier_id int(11)</tt>.
     # +default+ is the type-casted default value, such as +new+ in <tt>sales_stage varchar(20) default 'new'</tt>.
     # +sql_type+ is used to extract the column's length, if necessary. For example +60+ in
@@ -0,0 +1,85 @@
+#
+# Copyright (c) 2012, NuoDB, Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#     * Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#     * Redistributions in binary form must reproduce the above copyright
+#       notice, this list of conditions and the following disclaimer in the
+#       documentation and/or other materials provided with the distribution.
+#     * Neither the name of NuoDB, Inc. nor the names of its contributors may
+#       be used to endorse or promote products derived from this software
+#       without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL NUODB, INC. BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+# OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+# LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+# OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+# ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+module NuoDB
+
+  # The values of one column of a result, see Result#columnar.
+  #
+  # Numbers, booleans and strings are packed in binary buffers, in native byte
+  # order, rather than held as one Ruby object per value:
+  #
+  # +type+:: <tt>:int64</tt>, <tt>:double</tt>, <tt>:boolean</tt>, <tt>:string</tt> or <tt>:object</tt>
+  # +data+:: 8 bytes per value for <tt>:int64</tt> and <tt>:double</tt>, one bit
+  #          per value for <tt>:boolean</tt>, the bytes of all values for <tt>:string</tt>,
+  #          in the connection encoding or ASCII-8BIT for binary columns
+  # +offsets+:: for <tt>:string</tt>, <tt>length + 1</tt> 32-bit offsets into +data+
+  # +validity+:: one bit per value, least significant bit first, clear for +NULL+ values
+  # +values+:: for <tt>:object</tt>, the values, say dates, as an array
+  #
+  # For instance, <tt>Numo::Int64.from_binary(vector.data)</tt> takes up an
+  # <tt>:int64</tt> vector as is.
+  class ColumnVector
+    include Enumerable
+
+    attr_reader :name, :type, :length, :null_count, :data, :offsets, :validity, :values
+
+    alias_method :size, :length
+
+    # Returns +true+ if the value at the index is +NULL+.
+    def null?(index)
+      validity.getbyte(index >> 3)[index & 7] == 0
+    end
+
+    # Returns the value at the index as a Ruby object.
+    def [](index)
+      return nil if index < 0 || index >= length || null?(index)
+      case type
+        when :int64 then
+          data.byteslice(index * 8, 8).unpack('q').first
+        when :double then
+          data.byteslice(index * 8, 8).unpack('d').first
+        when :boolean then
+          data.getbyte(index >> 3)[index & 7] == 1
+        when :string then
+          first, last = offsets.byteslice(index * 4, 8).unpack('l2')
+          data.byteslice(first, last - first)
+        else
+          values[index]
+      end
+    end
+
+    def each
+      return to_enum(:each) unless block_given?
+      length.times { |index| yield self[index] }
+    end
+
+    def inspect
+      "#<#{self.class.name} #{name} #{type}[#{length}]>"
+    end
+  end
+end
@@ -11,4 +11,8 @@ module NuoDB
 
   end
 
+  # Raised when a connection cannot be checked out of a Pool in time.
+  class PoolTimeoutError < DatabaseError
+  end
+
 end
\ No newline at end of file
@@ -0,0 +1,93 @@
+#
+# Copyright (c) 2012, NuoDB, Inc.
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#     * Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#     * Redistributions in binary form must reproduce the above copyright
+#       notice, this list of conditions and the following disclaimer in the
+#       documentation and/or other materials provided with the distribution.
+#     * Neither the name of NuoDB, Inc. nor the names of its contributors may
+#       be used to endorse or promote products derived from this software
+#       without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL NUODB, INC. BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+# OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+# LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+# OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+# ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+module NuoDB
+
+  # A statement created by Router#statement. Each execute runs on the
+  # connection its SQL is routed to, see Router#connection_for, through a
+  # statement kept per connection; count, results, generated_keys and cancel
+  # apply to the statement executed last.
+  class RoutedStatement
+
+    def initialize(router)
+      @router = router
+      @statements = {}
+      @settings = {}
+      @current = nil
+    end
+
+    def execute(sql)
+      @current = statement_on(@router.connection_for(sql))
+      @current.execute(sql)
+    end
+
+    def cancel
+      @current.cancel unless @current.nil?
+    end
+
+    def count
+      current.count
+    end
+
+    def generated_keys
+      current.generated_keys
+    end
+
+    def results
+      current.results
+    end
+
+    [:timeout, :fetch_size, :max_rows].each do |setting|
+      define_method(setting) do
+        current.send(setting)
+      end
+
+      define_method("#{setting}=") do |value|
+        current.send("#{setting}=", value)
+        @settings[setting] = value
+        @statements.each_value { |statement| statement.send("#{setting}=", value) }
+        value
+      end
+    end
+
+    private
+
+    def current
+      @current || statement_on(@router.primary)
+    end
+
+    def statement_on(connection)
+      @statements[connection] ||= begin
+        statement = connection.statement
+        @settings.each { |setting, value| statement.send("#{setting}=", value) }
+        statement
+      end
+    end
+
+  end
+end
@@ -90,6 +90,216 @@ describe NuoDB::Connection do
 
   end
 
+  context "lazy and parallel connections" do
+
+    it "should defer connection errors until first use of a lazy connection" do
+      config = BaseTest.connection_config.clone
+      config[:password] = 'invalid'
+      config[:lazy] = true
+      connection = NuoDB::Connection.new config
+      lambda {
+        connection.statement
+      }.should raise_error(NuoDB::DatabaseError)
+    end
+
+    it "should connect a lazy connection on first use" do
+      connection = NuoDB::Connection.new BaseTest.connection_config.merge(:lazy => true)
+      connection.ping.should be_true
+    end
+
+    it "should open many connections at once" do
+      connections = NuoDB::Connection.open_many(4, BaseTest.connection_config)
+      connections.length.should eql(4)
+      connections.each { |connection| connection.ping.should be_true }
+    end
+
+    it "should raise a DatabaseError error when any of many connections fails to open" do
+      lambda {
+        config = BaseTest.connection_config.clone
+        config[:password] = 'invalid'
+        NuoDB::Connection.open_many(2, config)
+      }.should raise_error(NuoDB::DatabaseError)
+    end
+
+  end
+
+  context "forking" do
+
+    before(:each) do
+      @connection = BaseTest.connect
+    end
+
+    after(:each) do
+      @connection = nil
+    end
+
+    it "should reconnect explicitly" do
+      @connection.reconnect!.should equal(@connection)
+      @connection.ping.should be_true
+    end
+
+    it "should reconnect after disconnecting" do
+      @connection.disconnect
+      @connection.reconnect!.should equal(@connection)
+      @connection.ping.should be_true
+    end
+
+    it "should reconnect in a forked child and leave the parent's session usable" do
+      reader, writer = IO.pipe
+      pid = fork do
+        reader.close
+        writer.write(@connection.ping ? 'ok' : 'failed')
+        writer.close
+        exit!(0)
+      end
+      writer.close
+      Process.wait(pid)
+      reader.read.should eql('ok')
+      @connection.ping.should be_true
+    end
+
+    it "should raise an ArgumentError error when using a statement created before fork" do
+      statement = @connection.statement
+      reader, writer = IO.pipe
+      pid = fork do
+        reader.close
+        begin
+          statement.execute('select 1 from dual')
+          writer.write('executed')
+        rescue ArgumentError
+          writer.write('raised')
+        end
+        writer.close
+        exit!(0)
+      end
+      writer.close
+      Process.wait(pid)
+      reader.read.should eql('raised')
+    end
+
+  end
+
+  context "resilient connections" do
+
+    before(:each) do
+      @connection = NuoDB::Connection.new BaseTest.connection_config.merge(:reconnect => true, :reconnect_delay => 0.01)
+    end
+
+    after(:each) do
+      @connection = nil
+    end
+
+    it "should raise an ArgumentError error when given a negative reconnect delay" do
+      lambda {
+        NuoDB::Connection.new BaseTest.connection_config.merge(:reconnect => true, :reconnect_delay => -1)
+      }.should raise_error(ArgumentError)
+    end
+
+    it "should prepare statements again, with their bound values, after reconnecting" do
+      statement = @connection.prepare 'select ? from dual'
+      statement.bind_params([42])
+      @connection.reconnect!
+      statement.execute.should be_true
+      statement.results.rows.should eql([[42]])
+    end
+
+    it "should create statements again after reconnecting" do
+      statement = @connection.statement
+      @connection.reconnect!
+      statement.execute('select 1 from dual').should be_true
+    end
+
+    it "should keep the settings of statements created again after reconnecting" do
+      statement = @connection.statement
+      statement.timeout = 30
+      statement.fetch_size = 50
+      statement.max_rows = 1
+      @connection.reconnect!
+      statement.execute('select 1 from dual union all select 2 from dual').should be_true
+      statement.results.rows.should eql([[1]])
+      statement.timeout.should eql(30)
+      statement.fetch_size.should eql(50)
+      statement.max_rows.should eql(1)
+    end
+
+    it "should raise rather than read results of the session closed by reconnecting" do
+      statement = @connection.statement
+      statement.execute('select 1 from dual').should be_true
+      results = statement.results
+      @connection.reconnect!
+      lambda {
+        results.rows
+      }.should raise_error(ArgumentError)
+      statement.execute('select 2 from dual').should be_true
+      statement.results.rows.should eql([[2]])
+    end
+
+    it "should keep cached statements across reconnects" do
+      cached = NuoDB::Connection.new BaseTest.connection_config.merge(:reconnect => true, :statement_cache_size => 2)
+      first = cached.prepare('select 1 from dual') { |statement| statement }
+      cached.reconnect!
+      cached.prepare 'select 1 from dual' do |statement|
+        statement.should equal(first)
+        statement.execute.should be_true
+        statement.results.rows.should eql([[1]])
+      end
+    end
+
+  end
+
+  context "schema cache" do
+
+    before(:each) do
+      @connection = BaseTest.connect
+      @connection.statement do |statement|
+        statement.execute('drop table if exists TEST_SCHEMA_CACHE')
+        statement.execute('create table TEST_SCHEMA_CACHE (f1 INTEGER DEFAULT 4, f2 DOUBLE NOT NULL)')
+      end
+    end
+
+    after(:each) do
+      @connection.statement do |statement|
+        statement.execute('drop table if exists TEST_SCHEMA_CACHE')
+      end
+      @connection = nil
+    end
+
+    it "should list the tables of the connection schema" do
+      @connection.clear_schema_cache
+      @connection.tables.should include('TEST_SCHEMA_CACHE')
+    end
+
+    it "should describe the columns of a table" do
+      @connection.clear_schema_cache
+      columns = @connection.columns('TEST_SCHEMA_CACHE')
+      columns.map(&:name).should eql(['F1', 'F2'])
+      columns[0].default.should eql(4)
+      columns[0].null.should be_true
+      columns[1].null.should be_false
+    end
+
+    it "should look up a table once for all the columns of a result" do
+      @connection.clear_schema_cache
+      @connection.statement do |statement|
+        statement.execute('select f2, f1 from TEST_SCHEMA_CACHE').should be_true
+        statement.results.columns.map(&:default).should eql([nil, 4])
+        statement.execute('alter table TEST_SCHEMA_CACHE add column f3 INTEGER DEFAULT 7')
+      end
+      @connection.columns('TEST_SCHEMA_CACHE').map(&:name).should eql(['F1', 'F2'])
+    end
+
+    it "should reload the columns of a table once evicted" do
+      @connection.columns('TEST_SCHEMA_CACHE').length.should eql(2)
+      @connection.statement do |statement|
+        statement.execute('alter table TEST_SCHEMA_CACHE add column f3 STRING')
+      end
+      @connection.columns('TEST_SCHEMA_CACHE').length.should eql(2)
+      @connection.evict_schema_cache('TEST_SCHEMA_CACHE')
+      @connection.columns('TEST_SCHEMA_CACHE').length.should eql(3)
+    end
+
+  end
+
   #context "inactive connections" do
   #
   #  before(:each) do
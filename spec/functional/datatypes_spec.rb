@@ -130,6 +130,61 @@ describe NuoDB::Result do
       end
     end
 
+    it "decodes timestamps to the nanosecond and dates before the epoch" do
+      statement.execute("select cast('2013-03-01 12:34:56.123456' as timestamp), cast('1957-03-27' as date) from dual").should be_true
+      row = statement.results.rows.first
+      row[0].usec.should eql(123456)
+      row[1].should eql(Date.new(1957, 3, 27))
+    end
+
+    it "decodes exact numerics to integers, decimals, rationals or strings" do
+      sql = "select cast(42 as decimal(10,0)), cast(-1234.50 as decimal(10,2)), cast(0.05 as numeric(10,2)) from dual"
+      statement.execute(sql).should be_true
+      statement.results.rows.first.should eql([42, BigDecimal("-1234.50"), BigDecimal("0.05")])
+      begin
+        connection.decimal = :rational
+        statement.execute(sql).should be_true
+        statement.results.rows.first.should eql([42, Rational(-2469, 2), Rational(1, 20)])
+        connection.decimal = :string
+        statement.execute(sql).should be_true
+        statement.results.rows.first.should eql(['42', '-1234.50', '0.05'])
+      ensure
+        connection.decimal = :bigdecimal
+      end
+    end
+
+    it "decodes exact numerics by the declared scale of their column" do
+      statement.execute("select cast(42 as decimal(10,2)), cast(42 as decimal(10,0)) from dual").should be_true
+      row = statement.results.rows.first
+      row[0].should be_a(BigDecimal)
+      row[0].should eql(BigDecimal("42"))
+      row[1].should eql(42)
+    end
+
+    it "builds decimal values exactly from their digits" do
+      statement.execute("select cast(-1234.5 as decimal(10,2)), cast(0.000000000000000001 as decimal(19,18)), cast(12345678901234567890.12 as decimal(30,2)) from dual").should be_true
+      row = statement.results.rows.first
+      row[0].should eql(BigDecimal("-1234.50"))
+      row[1].should eql(BigDecimal("1e-18"))
+      row[2].should eql(BigDecimal("12345678901234567890.12"))
+    end
+
+    it "decodes character values in the connection encoding" do
+      statement.execute("select 'gr\u00fc\u00dfe', 'plain' from dual").should be_true
+      row = statement.results.rows.first
+      row[0].encoding.should eql(Encoding::UTF_8)
+      row[0].should eql("gr\u00fc\u00dfe")
+      row[1].encoding.should eql(Encoding::UTF_8)
+      begin
+        connection.encoding = 'ISO-8859-1'
+        connection.encoding.should eql(Encoding::ISO_8859_1)
+        statement.execute("select 'plain' from dual").should be_true
+        statement.results.rows.first[0].encoding.should eql(Encoding::ISO_8859_1)
+      ensure
+        connection.encoding = nil
+      end
+    end
+
   end
 
   #context "nuodb naturally handles ruby date/time conversions" do
@@ -0,0 +1,49 @@
+require 'spec_helper'
+require 'nuodb'
+
+describe "NuoDB.parallel_query" do
+  before(:all) do
+    @connections = NuoDB::Connection.open_many(3, BaseTest.connection_config)
+    @connections.first.statement do |statement|
+      statement.execute('drop table if exists TEST_PARALLEL')
+      statement.execute('create table TEST_PARALLEL (f1 INTEGER)')
+      statement.execute('insert into TEST_PARALLEL values (1), (4), (7), (2), (5)')
+    end
+  end
+
+  after(:all) do
+    @connections.first.statement do |statement|
+      statement.execute('drop table if exists TEST_PARALLEL')
+    end
+  end
+
+  it "should concatenate the rows of every connection" do
+    rows = NuoDB.parallel_query(@connections, 'select f1 from TEST_PARALLEL where f1 > ?', [3])
+    rows.length.should eql(9)
+  end
+
+  it "should merge ordered results and apply the limit" do
+    rows = NuoDB.parallel_query(@connections, 'select f1 from TEST_PARALLEL order by f1', nil,
+                                :order_by => 0, :limit => 4)
+    rows.should eql([[1], [1], [1], [2]])
+  end
+
+  it "should merge results ordered descending" do
+    rows = NuoDB.parallel_query(@connections, 'select f1 from TEST_PARALLEL order by f1 desc', nil,
+                                :order_by => [0], :descending => true)
+    rows.first(4).should eql([[7], [7], [7], [5]])
+  end
+
+  it "should yield rows as they are fetched" do
+    count = 0
+    NuoDB.parallel_query(@connections, 'select f1 from TEST_PARALLEL') { |row| count += 1 }.should be_nil
+    count.should eql(15)
+  end
+
+  it "should raise an ArgumentError error when a connection is given twice" do
+    lambda {
+      NuoDB.parallel_query([@connections.first, @connections.first], 'select 1 from dual')
+    }.should raise_error(ArgumentError, /same connection/)
+  end
+
+end
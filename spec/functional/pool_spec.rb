@@ -0,0 +1,97 @@
+require 'spec_helper'
+require 'nuodb'
+
+describe NuoDB::Pool do
+  before do
+  end
+
+  after do
+  end
+
+  context "creating a pool" do
+
+    it "should raise an ArgumentError error when the minimum size exceeds the maximum size" do
+      lambda {
+        NuoDB::Pool.new BaseTest.connection_config.merge(:min_size => 3, :max_size => 2)
+      }.should raise_error(ArgumentError)
+    end
+
+    it "should open the minimum number of connections up front" do
+      pool = NuoDB::Pool.new BaseTest.connection_config.merge(:min_size => 2)
+      pool.size.should eql(2)
+      pool.stats[:idle].should eql(2)
+    end
+
+  end
+
+  context "checking out connections" do
+
+    before(:each) do
+      @pool = NuoDB::Pool.new BaseTest.connection_config.merge(:max_size => 1, :checkout_timeout => 0.1)
+    end
+
+    after(:each) do
+      @pool.shutdown
+      @pool = nil
+    end
+
+    it "should reuse a checked in connection" do
+      connection = @pool.checkout
+      connection.ping.should be_true
+      @pool.checkin connection
+      @pool.checkout.should equal(connection)
+      @pool.stats[:created].should eql(1)
+    end
+
+    it "should check the connection back in after a block" do
+      @pool.checkout { |connection| connection.ping }.should be_true
+      @pool.stats[:in_use].should eql(0)
+      @pool.stats[:checkouts].should eql(1)
+    end
+
+    it "should raise a PoolTimeoutError when no connection is checked in in time" do
+      @pool.checkout
+      lambda {
+        @pool.checkout
+      }.should raise_error(NuoDB::PoolTimeoutError)
+      @pool.stats[:timeouts].should eql(1)
+    end
+
+    it "should hand a connection checked in by another thread to a waiting thread" do
+      connection = @pool.checkout
+      waiter = Thread.new { @pool.checkout }
+      sleep 0.01
+      @pool.checkin connection
+      waiter.value.should equal(connection)
+    end
+
+    it "should reap connections idle for longer than the idle timeout" do
+      pool = NuoDB::Pool.new BaseTest.connection_config.merge(:idle_timeout => 0.01)
+      pool.checkin pool.checkout
+      sleep 0.02
+      pool.reap.should eql(1)
+      pool.size.should eql(0)
+    end
+
+    it "should close the connections it reaps or releases on shutdown" do
+      pool = NuoDB::Pool.new BaseTest.connection_config.merge(:idle_timeout => 0.01)
+      reaped = pool.checkout
+      pool.checkin reaped
+      sleep 0.02
+      pool.reap.should eql(1)
+      reaped.ping.should be_false
+      idle = pool.checkout
+      pool.checkin idle
+      pool.shutdown
+      idle.ping.should be_false
+    end
+
+    it "should raise an ArgumentError error when checking in a foreign connection" do
+      lambda {
+        @pool.checkin BaseTest.connect
+      }.should raise_error(ArgumentError)
+    end
+
+  end
+
+end
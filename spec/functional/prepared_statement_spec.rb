@@ -138,6 +138,225 @@ describe NuoDB::PreparedStatement do
 
   end
 
+  context "binding parameters by their type" do
+
+    create_ddl = "create table TEST_BINDING (f1 INTEGER, f2 DOUBLE, f3 FLOAT, f4 STRING, f5 DATE)"
+    drop_table = "drop table if exists TEST_BINDING"
+    insert_dml = "insert into test_binding(f1, f2, f3, f4, f5) values(?, ?, ?, ?, ?)"
+    select_dml = "select f1, f2, f3, f4, f5 from test_binding"
+
+    before(:each) do
+      @connection.prepare drop_table do |statement|
+        statement.execute
+      end
+      @connection.prepare create_ddl do |statement|
+        statement.execute.should be_false
+      end
+    end
+
+    after(:each) do
+      @connection.prepare drop_table do |statement|
+        statement.execute.should be_false
+      end
+    end
+
+    def rows(select_dml)
+      @connection.prepare select_dml do |select|
+        select.execute.should be_true
+        select.results.rows
+      end
+    end
+
+    it "should bind integers to FLOAT and DOUBLE parameters as floats" do
+      @connection.prepare insert_dml do |statement|
+        statement.bind_params([3, 7, 9, "String", Date.new(2001, 12, 3)])
+        statement.execute.should be_false
+      end
+      row = rows(select_dml).first
+      row[0].should eql(3)
+      row[1].should eql(7.0)
+      row[2].should eql(9.0)
+    end
+
+    it "should bind nil to parameters of any type" do
+      @connection.prepare insert_dml do |statement|
+        statement.bind_params([nil, nil, nil, nil, nil])
+        statement.execute.should be_false
+      end
+      rows(select_dml).should eql([[nil, nil, nil, nil, nil]])
+    end
+
+    it "should bind the values given either as an array or as separate arguments" do
+      date = Date.new(2001, 12, 3)
+      @connection.prepare insert_dml do |statement|
+        statement.bind_params([1, 2.5, 3.5, "array", date])
+        statement.execute.should be_false
+        statement.bind_params(2, 2.5, 3.5, "splat", date)
+        statement.execute.should be_false
+      end
+      rows(select_dml + " order by f1").should eql([[1, 2.5, 3.5, "array", date], [2, 2.5, 3.5, "splat", date]])
+    end
+
+  end
+
+  context "inserting binary data" do
+
+    create_ddl = "create table TEST_BINARY (f1 STRING, f2 BLOB)"
+    drop_table = "drop table if exists TEST_BINARY"
+
+    before(:each) do
+      @connection.prepare drop_table do |statement|
+        statement.execute
+      end
+      @connection.prepare create_ddl do |statement|
+        statement.execute.should be_false
+      end
+    end
+
+    after(:each) do
+      @connection.prepare drop_table do |statement|
+        statement.execute.should be_false
+      end
+    end
+
+    it "should round trip strings and blobs holding NUL bytes whole" do
+      text = "before\0after"
+      bytes = (0..255).map(&:chr).join * 64
+      @connection.prepare "insert into test_binary(f1, f2) values(?, ?)" do |statement|
+        statement.bind_params([text, bytes])
+        statement.execute.should be_false
+      end
+      @connection.prepare "select f1, f2 from test_binary" do |select|
+        select.execute.should be_true
+        row = select.results.rows.first
+        row[0].should eql(text)
+        row[1].encoding.should eql(Encoding::ASCII_8BIT)
+        row[1].bytesize.should eql(bytes.bytesize)
+        row[1].bytes.to_a.should eql(bytes.bytes.to_a)
+      end
+    end
+
+  end
+
+  context "executing batches" do
+
+    create_ddl = "create table TEST_BATCH (id INTEGER GENERATED ALWAYS AS IDENTITY, f1 INTEGER, f2 STRING)"
+    drop_table = "drop table if exists TEST_BATCH"
+    insert_dml = "insert into test_batch(f1, f2) values(?, ?)"
+    count_dml = "select count(*) from test_batch"
+
+    before(:each) do
+      @connection.prepare drop_table do |statement|
+        statement.execute
+      end
+      @connection.prepare create_ddl do |statement|
+        statement.execute.should be_false
+      end
+    end
+
+    after(:each) do
+      @connection.prepare drop_table do |statement|
+        statement.execute.should be_false
+      end
+    end
+
+    it "should return an update count per batched command" do
+      @connection.prepare insert_dml do |statement|
+        statement.bind_params([1, "one"])
+        statement.add_batch
+        statement.bind_params([2, "two"])
+        statement.add_batch
+        statement.execute_batch.should eql([1, 1])
+      end
+      @connection.prepare count_dml do |select|
+        select.execute.should be_true
+        select.results.rows.should eql([[2]])
+      end
+    end
+
+    it "should bind and execute many rows at once, returning the generated keys if requested" do
+      @connection.prepare insert_dml do |statement|
+        counts, keys = statement.execute_many([[1, "one"], [2, "two"], [3, "three"]], true)
+        counts.should eql([1, 1, 1])
+        keys.length.should eql(3)
+      end
+    end
+
+    it "should raise a TypeError and discard the batch when a row is not an array" do
+      @connection.prepare insert_dml do |statement|
+        lambda {
+          statement.execute_many([[1, "one"], 2])
+        }.should raise_error(TypeError)
+        statement.execute_batch.should eql([])
+      end
+    end
+
+  end
+
+  context "caching prepared statements" do
+
+    before(:each) do
+      @cached = NuoDB::Connection.new BaseTest.connection_config.merge(:statement_cache_size => 2)
+    end
+
+    after(:each) do
+      @cached = nil
+    end
+
+    it "should reuse a cached statement for the same sql and generated keys mode" do
+      first = @cached.prepare('select 1 from dual') { |statement| statement }
+      @cached.prepare('select 1 from dual') { |statement| statement }.should equal(first)
+      @cached.prepare('select 1 from dual', false) { |statement| statement }.should_not equal(first)
+      stats = @cached.statement_cache_stats
+      stats[:hits].should eql(1)
+      stats[:misses].should eql(2)
+    end
+
+    it "should not pass the settings of a cached statement on to its next borrower" do
+      @cached.prepare 'select 1 from dual union all select 2 from dual' do |statement|
+        statement.max_rows = 1
+        statement.timeout = 30
+        statement.execute.should be_true
+        statement.results.rows.should eql([[1]])
+      end
+      @cached.prepare 'select 1 from dual union all select 2 from dual' do |statement|
+        statement.max_rows.should eql(0)
+        statement.timeout.should eql(0)
+        statement.execute.should be_true
+        statement.results.rows.should eql([[1], [2]])
+      end
+      @cached.statement_cache_stats[:hits].should eql(1)
+    end
+
+    it "should evict the least recently used statement when full" do
+      first = @cached.prepare('select 1 from dual') { |statement| statement }
+      @cached.prepare('select 2 from dual') { |statement| statement }
+      @cached.prepare('select 3 from dual') { |statement| statement }
+      @cached.statement_cache_stats[:evictions].should eql(1)
+      @cached.statement_cache_stats[:size].should eql(2)
+      @cached.prepare('select 1 from dual') { |statement| statement }.should_not equal(first)
+    end
+
+    it "should hand out distinct statements to live prepares without a block" do
+      first = @cached.prepare 'select ? from dual'
+      first.bind_params([1])
+      second = @cached.prepare 'select ? from dual'
+      second.should_not equal(first)
+      second.bind_params([2])
+      first.execute.should be_true
+      first.results.rows.should eql([[1]])
+      second.execute.should be_true
+      second.results.rows.should eql([[2]])
+    end
+
+    it "should not hand out a statement in use by a prepare block" do
+      @cached.prepare 'select 1 from dual' do |outer|
+        @cached.prepare('select 1 from dual').should_not equal(outer)
+      end
+    end
+
+  end
+
   context "executing a prepared statement" do
 
     before(:each) do
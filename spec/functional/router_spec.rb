@@ -0,0 +1,108 @@
+require 'spec_helper'
+require 'nuodb'
+
+describe NuoDB::Router do
+  before do
+  end
+
+  after do
+  end
+
+  def router_config(options = {})
+    config = BaseTest.connection_config.clone
+    database = config.delete(:database)
+    config.merge(:databases => [database, database]).merge(options)
+  end
+
+  context "creating a router" do
+
+    it "should raise an ArgumentError error when provided no databases" do
+      lambda {
+        NuoDB::Router.new BaseTest.connection_config
+      }.should raise_error(ArgumentError)
+    end
+
+    it "should raise an ArgumentError error when provided an unknown balance policy" do
+      lambda {
+        NuoDB::Router.new router_config(:balance => :random)
+      }.should raise_error(ArgumentError)
+    end
+
+  end
+
+  context "routing statements" do
+
+    before(:each) do
+      @router = NuoDB::Router.new router_config
+    end
+
+    after(:each) do
+      @router = nil
+    end
+
+    it "should spread reads across the endpoints" do
+      first = @router.connection_for('select 1 from dual')
+      second = @router.connection_for('select 1 from dual')
+      first.should_not equal(second)
+    end
+
+    it "should send writes to the primary" do
+      @router.connection_for('insert into foo values (1)').should equal(@router.primary)
+      @router.connection_for('select 1 from foo for update').should equal(@router.primary)
+    end
+
+    it "should pin every statement to the primary while autocommit is off" do
+      @router.autocommit = false
+      @router.connection_for('select 1 from dual').should equal(@router.primary)
+      @router.connection_for('select 1 from dual').should equal(@router.primary)
+      @router.rollback
+      @router.autocommit = true
+    end
+
+    it "should prepare and execute a routed statement" do
+      @router.prepare 'select 1 from dual' do |statement|
+        statement.execute.should be_true
+        statement.results.rows.should eql([[1]])
+      end
+      @router.stats.map { |endpoint| endpoint[:routed] }.inject(:+).should eql(1)
+    end
+
+    it "should route each execution of a router statement by its sql" do
+      @router.statement do |statement|
+        statement.max_rows = 10
+        statement.execute('select 1 from dual').should be_true
+        statement.results.rows.should eql([[1]])
+        statement.execute('select 2 from dual').should be_true
+        statement.results.rows.should eql([[2]])
+        statement.max_rows.should eql(10)
+      end
+      @router.stats.map { |endpoint| endpoint[:routed] }.should eql([1, 1])
+    end
+
+    it "should spread reads under least outstanding" do
+      router = NuoDB::Router.new router_config(:balance => :least_outstanding)
+      10.times { router.connections.should include(router.connection_for('select 1 from dual')) }
+    end
+
+    it "should route reads away from a connection with a call in flight under least outstanding" do
+      router = NuoDB::Router.new router_config(:balance => :least_outstanding)
+      busy = router.connections.first
+      busy.statement do |statement|
+        statement.execute('select 1 from dual').should be_true
+        results = statement.results
+        results.prefetch = 1
+        results.each do |row|
+          3.times { router.connection_for('select 1 from dual').should_not equal(busy) }
+        end
+      end
+    end
+
+    it "should balance by latency once the endpoints have been called" do
+      router = NuoDB::Router.new router_config(:balance => :latency_weighted)
+      router.ping.should be_true
+      10.times { router.connections.should include(router.connection_for('select 1 from dual')) }
+    end
+
+  end
+
+end
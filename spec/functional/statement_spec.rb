@@ -1,5 +1,6 @@
 require 'spec_helper'
 require 'nuodb'
+require 'stringio'
 
 describe NuoDB::Statement do
   before(:all) do
@@ -162,6 +163,324 @@ describe NuoDB::Statement do
       end
     end
 
+    it "should share the frozen columns of results of the same shape" do
+      @connection.statement do |statement|
+        statement.execute("select 1 as f1 from dual").should be_true
+        first = statement.results.columns
+        statement.execute("select 2 as f1 from dual").should be_true
+        second = statement.results.columns
+        second.should_not equal(first)
+        second[0].should equal(first[0])
+        second[0].should be_frozen
+        lambda {
+          second[0].primary = true
+        }.should raise_error(RuntimeError)
+        column = second[0].dup
+        column.primary = true
+        column.primary.should be_true
+        first[0].primary.should be_nil
+      end
+    end
+
+    it "should describe the type, limit, precision, scale and nullability of columns" do
+      @connection.statement do |statement|
+        statement.execute("drop table if exists test_column_fields")
+        statement.execute("create table test_column_fields (f1 DECIMAL(10,2) NOT NULL, f2 NUMERIC(12,0), f3 VARCHAR(20), f4 INTEGER NOT NULL, f5 DOUBLE)")
+        begin
+          statement.execute("select * from test_column_fields").should be_true
+          columns = statement.results.columns
+
+          columns.map(&:type).should eql([:decimal, :integer, :string, :integer, :float])
+
+          columns[0].precision.should eql(10)
+          columns[0].scale.should eql(2)
+          columns[0].limit.should be_nil
+          columns[1].precision.should eql(12)
+          columns[1].scale.should eql(0)
+          columns[2].limit.should eql(20)
+          columns[2].precision.should be_nil
+          columns[2].scale.should be_nil
+          columns[3].limit.should be_nil
+          columns[3].precision.should be_nil
+
+          columns.map(&:null).should eql([false, true, true, false, true])
+        ensure
+          statement.execute("drop table if exists test_column_fields")
+        end
+      end
+    end
+
+  end
+
+  context "streaming results" do
+
+    it "should yield each row as it is fetched without retaining the rows" do
+      @connection.statement do |statement|
+        statement.execute("select 1 from dual union all select 2 from dual").should be_true
+        results = statement.results
+        values = []
+        results.each_row do |row|
+          values << row[0]
+        end
+        values.should eql([1, 2])
+        results.instance_variable_get(:@rows).should be_nil
+      end
+    end
+
+    it "should return an enumerator from each_row when no block is given" do
+      @connection.statement do |statement|
+        statement.execute("select 1 from dual").should be_true
+        statement.results.each_row.to_a.should eql([[1]])
+      end
+    end
+
+    it "should prefetch rows in batches when a prefetch size is set" do
+      @connection.statement do |statement|
+        statement.execute("select 1, 'one' from dual union all select 2, 'two' from dual union all select 3, null from dual").should be_true
+        results = statement.results
+        results.prefetch = 2
+        results.prefetch.should eql(2)
+        results.to_a.should eql([[1, 'one'], [2, 'two'], [3, nil]])
+      end
+    end
+
+    it "should raise an ArgumentError when the connection is used while prefetching" do
+      @connection.statement do |statement|
+        statement.execute("select 1 from dual union all select 2 from dual").should be_true
+        results = statement.results
+        results.prefetch = 1
+        lambda {
+          results.each { |row| @connection.ping }
+        }.should raise_error(ArgumentError)
+      end
+      @connection.ping.should be_true
+    end
+
+    it "should stop prefetching when the iteration stops early" do
+      @connection.statement do |statement|
+        statement.execute("select 1 from dual union all select 2 from dual union all select 3 from dual").should be_true
+        results = statement.results
+        results.prefetch = 1
+        results.each { |row| break }
+      end
+      @connection.ping.should be_true
+    end
+
+  end
+
+  context "columnar results" do
+
+    it "should pack numbers and strings column by column" do
+      @connection.statement do |statement|
+        statement.execute("select 1, 2.5, 'one' from dual union all select 2, null, 'two' from dual").should be_true
+        vectors = statement.results.columnar
+        vectors.length.should eql(3)
+        vectors[0].type.should eql(:int64)
+        vectors[0].data.unpack('q*').should eql([1, 2])
+        vectors[1].type.should eql(:double)
+        vectors[1].null_count.should eql(1)
+        vectors[1].to_a.should eql([2.5, nil])
+        vectors[2].type.should eql(:string)
+        vectors[2].offsets.unpack('l*').should eql([0, 3, 6])
+        vectors[2].to_a.should eql(['one', 'two'])
+      end
+    end
+
+    it "should pack the rows already fetched by rows" do
+      @connection.statement do |statement|
+        statement.execute("select 1 from dual union all select 2 from dual").should be_true
+        results = statement.results
+        results.rows.should eql([[1], [2]])
+        results.columnar.first.to_a.should eql([1, 2])
+      end
+    end
+
+  end
+
+  context "arrow export" do
+
+    it "should write the rows as an arrow IPC stream" do
+      @connection.statement do |statement|
+        statement.execute("select 1, 'one' from dual union all select 2, 'two' from dual").should be_true
+        io = StringIO.new(''.force_encoding('BINARY'))
+        statement.results.to_arrow_ipc(io, :batch_size => 1).should eql(2)
+        stream = io.string
+        stream[0, 4].should eql("\xFF\xFF\xFF\xFF".force_encoding('BINARY'))
+        stream[-8, 8].should eql("\xFF\xFF\xFF\xFF\x00\x00\x00\x00".force_encoding('BINARY'))
+      end
+    end
+
+    it "should raise an ArgumentError when the batch size is zero" do
+      @connection.statement do |statement|
+        statement.execute("select 1 from dual").should be_true
+        lambda {
+          statement.results.to_arrow_ipc(StringIO.new, :batch_size => 0)
+        }.should raise_error(ArgumentError)
+      end
+    end
+
+    it "should pass on errors raised by the IO" do
+      io = Object.new
+      def io.write(data)
+        raise IOError, 'closed stream'
+      end
+      @connection.statement do |statement|
+        statement.execute("select 1 from dual").should be_true
+        lambda {
+          statement.results.to_arrow_ipc(io)
+        }.should raise_error(IOError)
+      end
+    end
+
+  end
+
+  context "fetch sizes and row limits" do
+
+    it "should support configuring the fetch size of a statement" do
+      @connection.statement do |statement|
+        statement.fetch_size = 50
+        statement.fetch_size.should eql(50)
+      end
+    end
+
+    it "should apply the connection fetch size to statements it creates" do
+      @connection.fetch_size = 20
+      @connection.fetch_size.should eql(20)
+      @connection.prepare 'select 1 from dual' do |statement|
+        statement.fetch_size.should eql(20)
+      end
+      @connection.fetch_size = nil
+    end
+
+    it "should limit the rows of a result" do
+      @connection.statement do |statement|
+        statement.max_rows = 2
+        statement.max_rows.should eql(2)
+        statement.execute("select 1 from dual union all select 2 from dual union all select 3 from dual").should be_true
+        statement.results.rows.should eql([[1], [2]])
+      end
+    end
+
+    it "should estimate the round trips taken to fetch the rows" do
+      @connection.statement do |statement|
+        statement.fetch_size = 2
+        statement.execute("select 1 from dual union all select 2 from dual union all select 3 from dual").should be_true
+        results = statement.results
+        results.rows.length.should eql(3)
+        results.estimated_round_trips.should eql(2)
+      end
+    end
+
+    it "should raise an ArgumentError when the fetch size is negative" do
+      lambda {
+        @connection.fetch_size = -1
+      }.should raise_error(ArgumentError)
+    end
+
+  end
+
+  context "timeouts and cancellation" do
+
+    it "should support configuring the query timeout of a statement" do
+      @connection.statement do |statement|
+        statement.timeout = 5
+        statement.timeout.should eql(5)
+        statement.timeout = nil
+        statement.timeout.should eql(0)
+      end
+    end
+
+    it "should apply the connection timeout to statements it creates" do
+      @connection.timeout = 2.5
+      @connection.timeout.should eql(3)
+      @connection.statement do |statement|
+        statement.timeout.should eql(3)
+      end
+      @connection.timeout = nil
+    end
+
+    it "should raise an ArgumentError when the timeout is negative" do
+      lambda {
+        @connection.timeout = -1
+      }.should raise_error(ArgumentError)
+    end
+
+    it "should not raise an error when cancelling an idle statement" do
+      @connection.statement do |statement|
+        lambda {
+          statement.cancel
+        }.should_not raise_error
+      end
+    end
+
+  end
+
+  context "concurrent use" do
+
+    it "should let other threads run while a statement executes" do
+      ticks = 0
+      ticker = Thread.new { loop { ticks += 1; sleep 0.001 } }
+      begin
+        sleep 0.01
+        @connection.statement do |statement|
+          before = ticks
+          statement.execute('select count(*) from system.fields a, system.fields b, system.fields c').should be_true
+          (ticks - before).should be > 0
+        end
+      ensure
+        ticker.kill
+      end
+    end
+
+    it "should serialize threads sharing a connection rather than raise" do
+      threads = (0...4).map do |i|
+        Thread.new do
+          (0...5).map do
+            @connection.statement do |statement|
+              statement.execute("select #{i} from dual").should be_true
+              statement.results.rows
+            end
+          end
+        end
+      end
+      threads.each_with_index do |thread, i|
+        thread.value.should eql([[[i]]] * 5)
+      end
+    end
+
+    it "should serialize prepares, settings and metadata calls of threads sharing a connection" do
+      threads = (0...4).map do |i|
+        Thread.new do
+          (0...5).map do
+            @connection.tables
+            @connection.prepare "select #{i} from dual" do |statement|
+              statement.max_rows = 1
+              statement.execute.should be_true
+              [statement.max_rows, statement.results.rows]
+            end
+          end
+        end
+      end
+      threads.each_with_index do |thread, i|
+        thread.value.should eql([[1, [[i]]]] * 5)
+      end
+    end
+
+    it "should let a thread waiting for a connection be interrupted" do
+      @connection.statement do |statement|
+        statement.execute('select 1 from dual union select 2 from dual').should be_true
+        results = statement.results
+        results.prefetch = 1
+        results.each do |row|
+          waiter = Thread.new { @connection.ping }
+          sleep 0.05
+          waiter.alive?.should be_true
+          waiter.kill
+          waiter.join(1).should_not be_nil
+        end
+      end
+    end
+
   end
 
   # TODO BEGIN